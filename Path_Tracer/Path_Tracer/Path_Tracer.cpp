@@ -1,11 +1,14 @@
 #include <iostream>
 #include <string.h>
-#include <conio.h> 
+#include <time.h>
+#include <algorithm>
+#include <memory>
 
 // dla wielowatkowosci
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <chrono>
 std::mutex console_mutex;
 
 // pliki z logika programu
@@ -15,83 +18,93 @@ std::mutex console_mutex;
 #include "render.h"
 #include "gaussian_filter.h"
 #include "vec3_simd.h"
+#include "checkpoint.h"
+#include "incremental.h"
+#include "settings.h"
+#include "scene_file.h"
+#include "scene_cache.h"
+#include "texture.h"
+#include "topology.h"
+#include "distributed.h"
+#include "preview.h"
+#include "benchmark.h"
+#include "stats.h"
+#include "trace.h"
 
 // definicje zapobiegajace ostrzezeniom z zewnetrznej biblioteki do zapisywania wyrenderowanego obrazu do pliku
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#ifdef _MSC_VER
+#ifndef _CRT_SECURE_NO_WARNINGS // ustawione tez w projekcie dla wszystkich plikow
 #define _CRT_SECURE_NO_WARNINGS
+#endif
 #define __STDC_LIB_EXT1__
+#endif
 // zewnetrzna biblioteka do zapisywania wyrenderowanego obrazu do pliku
 #include "png.h"
 
-int main(int argc, const char* argv[])
+// zapis licznikow (--stats)
+static void write_stats(const std::string& path)
 {
-	// menu
-	printf("PATH TRACER\n");
-	printf("Ten program generuje obraz w 3D za pomoca Path Tracingu\n");
-	printf("\n\nOpcje:\n");
-	printf("Renderowana jakosc obrazu (1- wysoka, 2 - niska): ");
-	int quality = 1; std::cin >> quality;
-	while (quality != 1 && quality != 2) {
-		printf("Wpisana wartosc jest bledna:\n");
-		printf("Renderowana jakosc obrazu (1- wysoka, 2 - niska): ");
-		std::cin >> quality;
-	}
-	printf("\nUWAGA: Wyswietlenie postepu spowolni dzialanie algorytmu renderowania\n");
-	printf("Czy wyswietlac postep path tracera (1- tak, 0- nie): ");
-	bool progress = false; std::cin >> progress; 
-	printf("\nUWAGA: Wybranie rozmycia obrazu wydluzy dzialanie programu\n");
-	printf("Czy rozmyc obraz po wyrenderowaniu (1- tak, 0- nie): ");
-	bool gaussian = false; std::cin >> gaussian;
-	system("cls");
-
-	srand((uint32_t)time(NULL));
-
-	// ustawienia
-	const uint32_t width = 1024;
-	const uint32_t height = 768;
-	const uint32_t bounces = 10 / quality;
-	if (quality == 2) quality = 100;
-	const uint32_t samples = 1000 / quality;
-	const uint32_t tile_size = 64;
-	const uint32_t batch_size = 1;
-
-	// inne zmienne
-	const uint32_t stride = 3; // glebia obrazu -> 3 dla RGB 
-	const uint32_t image_size = width * height * stride; // wielkosc obrazu
-	const uint32_t num_threads = std::thread::hardware_concurrency(); // ilosc watkow
-	printf("Program rozpoczal dzialanie na %i watkach...\n", num_threads);
-
-	void* image = malloc(image_size); // alokowanie bloku pamieci dla obrazu
-	memset(image, 0, image_size); // wypelnia zaalokowana pamic (wielkosci image_size) bloku wskazywanego przez image na 0  
+	if (stats_write(path.c_str()))
+		printf("Liczniki zapisane do pliku %s\n", path.c_str());
+	else
+		printf("Blad zapisu licznikow do pliku %s\n", path.c_str());
+}
 
-	// ustawienia sceny, dodanie obiektow na scene 3D
-	Scene scene;
+// zapis osi czasu (--trace)
+static void write_trace(const std::string& path)
+{
+	if (trace_write(path.c_str()))
+		printf("Os czasu zapisana do pliku %s\n", path.c_str());
+	else
+		printf("Blad zapisu osi czasu do pliku %s\n", path.c_str());
+}
 
-	// Add plane
-	scene.add_plane(
-		Vec3_simd(0.0f, 1.0f, 0.0f),    // normal (will be auto-normalized)
-		-1.0f,                          // distance
-		Vec3_simd(0.8f, 0.8f, 0.8f),    // color
-		0.9f                            // roughness
-	);
+// najwieksza scena kopiowana do pamieci kazdego wezla NUMA (wieksze sa czytane z jednej kopii)
+static const size_t MAX_REPLICATED_SCENE = (size_t)256 << 20;
 
-	// Add spheres (converting Vec3 literals to Vec3_simd)
-	scene.add_sphere(
-		Vec3_simd(-2.0f, 0.0f, 0.0f),   // position
-		1.0f,                           // radius
-		Vec3_simd(1.0f, 0.5f, 0.8f),    // color
-		0.04f                           // roughness
-	);
+// renderowanie wszystkich fragmentow obrazu na watkach tego procesu
+static void render_local(const RenderSettings& settings, Framebuffer& framebuffer, Scene& scene, uint32_t num_threads)
+{
+	const uint32_t width = framebuffer.width;
+	const uint32_t height = framebuffer.height;
+	const uint32_t tile_size = settings.tile_size;
+	const uint32_t batch_size = settings.batch_size;
+	const Camera camera(scene.camera, width, height); // liczona raz na klatke, wspolna dla watkow
 
-	scene.add_sphere(Vec3_simd(0.0f, 0.0f, 0.0f), 1.0f, Vec3_simd(0.6f, 0.9f, 0.6f), 0.3f);
+	// szerokosc i wysokosc fragmentow (kazdy watek dostaje pewna ilosc fragmentow obrazu do wyrenderowania)
+	const uint32_t total_tiles = tile_count(width, height, tile_size);
 
-	scene.add_sphere(Vec3_simd(2.0f, 0.0f, 0.0f), 1.0f, Vec3_simd(0.8f, 0.4f, 0.8f), 0.9f);
+	// przypisanie watkow do rdzeni (--pin); na maszynie NUMA kazdy wezel dostaje wlasny pas wierszy fragmentow,
+	// wiec strony bufora obrazu trafiaja do pamieci wezla, ktory pierwszy je zapisuje
+	const ThreadPlacement placement(pin_policy(settings.pin), num_threads);
+	const uint32_t nodes = placement.node_count();
+	const uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+	const uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+	std::unique_ptr<std::atomic<uint32_t>[]> next_tile(new std::atomic<uint32_t>[nodes]);
+	std::vector<uint32_t> node_end(nodes);
+	for (uint32_t n = 0; n < nodes; ++n)
+	{
+		next_tile[n] = tiles_x * (tiles_y * n / nodes);
+		node_end[n] = tiles_x * (tiles_y * (n + 1) / nodes);
+	}
 
-	// szerokosc i wysokosc fragmentow (kazdy watek dostaje pewna ilosc fragmentow obrazu do wyrenderowania)
-	std::atomic<uint32_t> next_tile(0);
-	const uint32_t num_tiles_x = (width + tile_size - 1) / tile_size;
-	const uint32_t num_tiles_y = (height + tile_size - 1) / tile_size;
-	const uint32_t total_tiles = num_tiles_x * num_tiles_y;
+	// kopia sceny w pamieci kazdego wezla, jesli jest dosc mala (tworzona przez watek na tym wezle)
+	std::vector<std::unique_ptr<Scene>> node_scenes(nodes);
+	if (nodes > 1 && scene.render_data_bytes() <= MAX_REPLICATED_SCENE)
+	{
+		for (uint32_t n = 0; n < nodes; ++n)
+		{
+			std::thread([&, n]() {
+				placement.pin_to_node(n);
+				node_scenes[n].reset(new Scene());
+				scene.replicate(*node_scenes[n]);
+			}).join();
+		}
+	}
+	if (placement.pinned())
+		printf("Watki przypiete do rdzeni (%s), wezly NUMA: %u%s\n", settings.pin.c_str(), nodes,
+			node_scenes[0] ? ", kopia sceny na kazdym wezle" : "");
 
 	std::vector<std::thread> jobs;
 	std::atomic<uint32_t> tiles_done(0);
@@ -99,70 +112,270 @@ int main(int argc, const char* argv[])
 	// praca watkow
 	for (uint32_t t = 0; t < num_threads; ++t)
 	{
-		jobs.emplace_back([&]() {
-			while (true)
+		jobs.emplace_back([&, t]() {
+			char thread_name[32];
+			snprintf(thread_name, sizeof(thread_name), "render %u", t);
+			trace_thread_name(thread_name);
+			placement.pin(t);
+			const uint32_t home = placement.thread_node(t);
+			Scene& local_scene = node_scenes[home] ? *node_scenes[home] : scene;
+
+			// najpierw fragmenty wlasnego wezla, potem pomoc pozostalym
+			for (uint32_t k = 0; k < nodes; ++k)
 			{
-				uint32_t start_tile_index = next_tile.fetch_add(batch_size); // ustawienie poczatkowego fragmentu zeby watek wiedzial jaki zakres fragmentow pobrac
-				
-				if (start_tile_index >= total_tiles)
-					break;
+				const uint32_t node = (home + k) % nodes;
+				while (true)
+				{
+					uint32_t start_tile_index = next_tile[node].fetch_add(batch_size); // ustawienie poczatkowego fragmentu zeby watek wiedzial jaki zakres fragmentow pobrac
 
-				uint32_t end_tile_index = std::min(start_tile_index + batch_size, total_tiles); // wyznaczenie ostatniego pobranego fragmentu przez watek
+					if (start_tile_index >= node_end[node])
+						break;
 
-				// renderowanie po kolei kazdego fragmentu
-				for (uint32_t tile_index = start_tile_index; tile_index < end_tile_index; ++tile_index)
-				{
-					uint32_t tile_x = (tile_index % num_tiles_x) * tile_size;
-					uint32_t tile_y = (tile_index / num_tiles_x) * tile_size;
+					uint32_t end_tile_index = std::min(start_tile_index + batch_size, node_end[node]); // wyznaczenie ostatniego pobranego fragmentu przez watek
 
-					// renderowanie po kolei kazdego piksela z danego fragmentu
-					for (uint32_t y = tile_y; y < tile_y + tile_size && y < height; ++y)
+					// renderowanie po kolei kazdego fragmentu
+					for (uint32_t tile_index = start_tile_index; tile_index < end_tile_index; ++tile_index)
 					{
-						for (uint32_t x = tile_x; x < tile_x + tile_size && x < width; ++x)
-						{
-							Vec3_simd color = render(x, y, width, height, bounces, samples, scene); // wyliczenie kolorow RGB piksela
-							uint8_t* pixel = (uint8_t*)image + stride * (x + y * width);
-
-							// zapisanie do piksela kolorow RGB
-							pixel[0] = static_cast<uint8_t>(saturate(color.x) * 255.0f);
-							pixel[1] = static_cast<uint8_t>(saturate(color.y) * 255.0f);
-							pixel[2] = static_cast<uint8_t>(saturate(color.z) * 255.0f);
-						}
-					}
+						// renderowanie po kolei kazdego piksela z danego fragmentu (piksele gotowe przed przerwaniem sa pomijane)
+						render_tile(tile_rect(tile_index, width, height, tile_size), framebuffer, local_scene, camera);
 
-					uint32_t done = tiles_done.fetch_add(1) + 1;
+						uint32_t done = tiles_done.fetch_add(1) + 1;
 
-					float percent = (100.0f * done) / total_tiles;
-					printf("\rProgress: %.2f%% (%u / %u tiles)", percent, done, total_tiles);
-					fflush(stdout); // force flush for \r to work properly
-					
+						if (settings.progress) {
+							float percent = (100.0f * done) / total_tiles;
+							std::lock_guard<std::mutex> lock(console_mutex);
+							printf("\rProgress: %.2f%% (%u / %u tiles)", percent, done, total_tiles);
+							fflush(stdout); // force flush for \r to work properly
+						}
+					}
 				}
 			}
 		});
 	}
 
+	// okresowe zapisywanie checkpointu az do zakonczenia renderowania
+	auto last_checkpoint = std::chrono::steady_clock::now();
+	while (!settings.checkpoint_path.empty() && tiles_done.load() < total_tiles)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_checkpoint >= std::chrono::seconds(settings.checkpoint_interval)) {
+			TraceScope trace("checkpoint");
+			framebuffer.flush();
+			last_checkpoint = now;
+		}
+	}
+
 	// dolaczanie watkow
 	for (auto& job : jobs)
 	{
 		job.join();
 	}
+}
+
+int main(int argc, const char* argv[])
+{
+	RenderSettings settings;
+	Scene scene;
+
+	// bez argumentow - menu interaktywne, z argumentami - tryb wsadowy (scena z pliku i flagi)
+	if (argc == 1) {
+		ask_settings(settings);
+	}
+	else {
+		if (!parse_arguments(argc, argv, settings)) {
+			print_usage();
+			return 1;
+		}
+		if (!settings.trace_path.empty()) {
+			trace_start();
+			trace_thread_name("main");
+		}
+		set_specialized_kernels(!settings.generic_kernel); // kernel skompilowany dla rodzajow obiektow w scenie
+		set_fast_math(settings.fast_math);
+		if (settings.bench_kernels)
+			return run_kernel_benchmarks(settings) ? 0 : 1; // wlasne sceny testowe, bez renderowania
+		if (settings.bench_render)
+			return run_render_benchmarks(settings) ? 0 : 1;
+		if (settings.bench_accuracy)
+			return run_accuracy_benchmarks(settings) ? 0 : 1;
+		if (!settings.scene_path.empty()) {
+			// scena z binarnej kopii, jesli plik sceny sie nie zmienil
+			std::string cache_path;
+			set_texture_cache_size((size_t)settings.texture_cache_mb << 20); // przed otwarciem pierwszej tekstury
+			if (settings.scene_cache)
+				cache_path = settings.scene_cache_path.empty() ? settings.scene_path + ".cache" : settings.scene_cache_path;
+			if (!load_scene(settings.scene_path.c_str(), cache_path, scene, settings))
+				return 1;
+			parse_arguments(argc, argv, settings); // flagi nadpisuja ustawienia z pliku sceny
+		}
+	}
+	if (settings.scene_path.empty()) {
+		build_default_scene(scene);
+		scene.build_bvh();
+	}
+
+	// ustawienia
+	uint32_t width = settings.width;
+	uint32_t height = settings.height;
+	uint32_t bounces = settings.bounces;
+	uint32_t samples = settings.samples;
+	const char* checkpoint_path = settings.checkpoint_path.empty() ? nullptr : settings.checkpoint_path.c_str();
+	const uint64_t seed = settings.seed_set ? settings.seed : (uint64_t)time(NULL);
+	uint32_t first_sample = 0;
+	if (settings.split_count > 1) {
+		// kazda czesc renderuje swoj zakres numerow probek, razem daja te same probki co calosc
+		first_sample = split_first_sample(samples, settings.split_index, settings.split_count);
+		samples = split_samples(samples, settings.split_index, settings.split_count);
+		if (samples == 0) {
+			printf("Za malo probek (%u) na %u czesci\n", settings.samples, settings.split_count);
+			return 1;
+		}
+	}
+
+	// inne zmienne
+	const uint32_t stride = 3; // glebia obrazu -> 3 dla RGB 
+	if (!settings.stats_path.empty() && !stats_enabled())
+		printf("UWAGA: program zbudowany bez PT_STATS, liczniki beda puste\n");
+	if (!settings.worker_address.empty()) {
+		bool worker_ok = run_worker(settings, scene); // tryb workera: fragmenty od koordynatora, bez zapisu obrazu
+		if (!settings.stats_path.empty())
+			write_stats(settings.stats_path);
+		if (!settings.trace_path.empty())
+			write_trace(settings.trace_path);
+		return worker_ok ? 0 : 1;
+	}
+
+	const uint32_t num_threads = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency()); // ilosc watkow
+
+	// bufor akumulacji (sumy probek, liczba probek i stan RNG dla kazdego piksela)
+	Framebuffer framebuffer;
+	bool framebuffer_ready;
+	const bool merge = !settings.merge_paths.empty();
+	GBuffer gbuffer; // przy --incremental: pierwsze trafienia tej sceny, zapisywane po renderowaniu
+	if (settings.incremental && (settings.resume || merge || settings.split_count > 1 || !settings.coordinator_address.empty())) {
+		printf("--incremental nie laczy sie z --resume, --merge, --split ani --coordinator\n");
+		return 1;
+	}
+	const bool preview = !settings.preview_address.empty(); // renderowanie w przebiegach z podgladem przez HTTP
+	if (preview && (settings.resume || merge || settings.incremental || !settings.coordinator_address.empty())) {
+		printf("--preview nie laczy sie z --resume, --merge, --incremental ani --coordinator\n");
+		return 1;
+	}
+	if (merge) { // bez renderowania - obraz z polaczonych czesci
+		framebuffer_ready = merge_partials(settings.merge_paths, checkpoint_path, framebuffer);
+		if (framebuffer_ready) {
+			width = framebuffer.width;
+			height = framebuffer.height;
+			printf("Polaczono %u czesci: %u probek na piksel\n", (uint32_t)settings.merge_paths.size(), framebuffer.samples);
+		}
+	}
+	else if (settings.resume) { // rozdzielczosc, probki i odbicia sa zapisane w checkpoincie
+		framebuffer_ready = framebuffer.open_mapped(checkpoint_path);
+		if (framebuffer_ready) {
+			width = framebuffer.width;
+			height = framebuffer.height;
+			samples = framebuffer.samples;
+			bounces = framebuffer.bounces;
+			printf("Wznawianie z %s: %u / %u pikseli gotowych\n", checkpoint_path, framebuffer.finished_pixels(), framebuffer.pixel_count());
+		}
+	}
+	else if (settings.incremental) { // istniejacy checkpoint tej samej klatki: czyszczone tylko piksele zmienione w scenie
+		framebuffer_ready = open_incremental(settings.checkpoint_path, scene, width, height, samples, bounces, seed, settings.seed_set,
+			settings.fast_math, framebuffer, gbuffer);
+	}
+	else if (checkpoint_path) {
+		framebuffer_ready = framebuffer.create_mapped(checkpoint_path, width, height, samples, bounces, seed,
+			first_sample, settings.split_index, settings.split_count);
+	}
+	else {
+		framebuffer_ready = framebuffer.create(width, height, samples, bounces, seed,
+			first_sample, settings.split_index, settings.split_count);
+	}
+	if (!framebuffer_ready) {
+		printf("Nie udalo sie przygotowac bufora obrazu%s%s\n", checkpoint_path ? ": " : "", checkpoint_path ? checkpoint_path : "");
+		return 1;
+	}
+	const bool cost_map = !settings.cost_map.empty() && !merge && settings.coordinator_address.empty() && !preview;
+	if (cost_map) // koszt mierzony przy renderowaniu, piksele gotowe przed wznowieniem maja koszt 0
+		framebuffer.enable_cost_map(settings.cost_map == "rays" ? Framebuffer::COST_RAYS : Framebuffer::COST_CYCLES);
+	else if (!settings.cost_map.empty())
+		printf("UWAGA: mapa kosztu jest dostepna tylko przy renderowaniu na tej maszynie\n");
+
+	if (!merge)
+		printf("Program rozpoczal dzialanie na %i watkach (%ux%u, %u probek, %u odbic)...\n", num_threads, width, height, samples, bounces);
+
+	const uint32_t image_size = width * height * stride; // wielkosc obrazu
+	void* image = malloc(image_size); // alokowanie bloku pamieci dla obrazu
+
+	if (merge) {
+		// piksele sa juz w buforze
+	}
+	else if (!settings.coordinator_address.empty()) {
+		// fragmenty renderuja workery (inne procesy lub maszyny)
+		if (!run_coordinator(settings, scene, framebuffer, argc, argv))
+			return 1;
+	}
+	else if (preview) {
+		// przebiegi po jednej probce na piksel az do POST /stop, edycje sceny restartuja akumulacje
+		if (!run_preview(settings, framebuffer, scene, num_threads))
+			return 1;
+	}
+	else {
+		render_local(settings, framebuffer, scene, num_threads);
+	}
+
+	{
+		TraceScope trace("resolve");
+		framebuffer.flush();
+		framebuffer.resolve((uint8_t*)image, stride); // usrednienie probek do 8-bitowego obrazu
+	}
+	if (settings.incremental && !write_gbuffer(settings.checkpoint_path + ".gbuf", gbuffer))
+		printf("UWAGA: nie udalo sie zapisac %s.gbuf, nastepne renderowanie bedzie pelne\n", checkpoint_path);
 
 	printf("\nRenderowanie obrazu zakonczone.\n");
+	if (!settings.stats_path.empty())
+		write_stats(settings.stats_path);
+	if (settings.print_hash)
+		printf("Skrot obrazu: %016llx\n", (unsigned long long)framebuffer.hash());
 
-	if (gaussian) {
+	if (settings.gaussian) {
 		printf("Aplikowanie filtru Gaussa...\n");
-		apply_gaussian_filter((uint8_t*)image, width, height, stride, 3, 1.0f); // aplikowanie filtru gaussa na wyrenderowany obraz (radius = 3, sigma = 1.0)
+		TraceScope trace("gaussian_filter");
+		apply_gaussian_filter((uint8_t*)image, width, height, stride, settings.blur_radius, settings.blur_sigma); // aplikowanie filtru gaussa na wyrenderowany obraz (domyslnie radius = 3, sigma = 1.0)
 		printf("Filtr zaaplikowany!\n");
 	}
 
 	// zapis wyrenderowanego obrazu do pliku
-	int32_t res = stbi_write_png("render.png", width, height, 3, image, stride * width);
+	const char* output_path = settings.output_path.c_str();
+	int32_t res;
+	{
+		TraceScope trace("png_write");
+		res = stbi_write_png(output_path, width, height, 3, image, stride * width);
+	}
 
 	if (res)
-		printf("\nObraz zostal zapisany do pliku render.png\n");
+		printf("\nObraz zostal zapisany do pliku %s\n", output_path);
 	else
-		printf("\nBlad zapisu obrazu do pliku render.png\n");
+		printf("\nBlad zapisu obrazu do pliku %s\n", output_path);
+
+	if (cost_map) {
+		// mapa kosztu obok obrazu: render.png -> render_cost.png
+		std::string cost_path = settings.output_path;
+		size_t extension = cost_path.rfind('.');
+		if (extension == std::string::npos || cost_path.find_first_of("/\\", extension) != std::string::npos)
+			extension = cost_path.size();
+		cost_path.insert(extension, "_cost");
+
+		uint64_t scale = framebuffer.resolve_cost((uint8_t*)image, stride);
+		if (stbi_write_png(cost_path.c_str(), width, height, 3, image, stride * width))
+			printf("Mapa kosztu (%s, biel = %llu) zapisana do pliku %s\n", settings.cost_map.c_str(), (unsigned long long)scale, cost_path.c_str());
+		else
+			printf("Blad zapisu mapy kosztu do pliku %s\n", cost_path.c_str());
+	}
 
 	free(image);
-	return res;
+	if (!settings.trace_path.empty())
+		write_trace(settings.trace_path);
+	return res ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "arena.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+static const size_t SMALL_PAGE = 4096;
+static const size_t MIN_BLOCK = 64 * 1024;
+
+static size_t round_up(size_t value, size_t granularity) {
+    return (value + granularity - 1) / granularity * granularity;
+}
+
+void* allocate_pages(size_t& size, bool allow_huge, bool& huge) {
+    huge = false;
+#ifdef _WIN32
+    // Large pages need SeLockMemoryPrivilege; without it the first call fails
+    SIZE_T large_page = allow_huge ? GetLargePageMinimum() : 0;
+    if (large_page && size >= large_page) {
+        size_t rounded = round_up(size, large_page);
+        void* memory = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (memory) {
+            size = rounded;
+            huge = true;
+            return memory;
+        }
+    }
+    size = round_up(size, SMALL_PAGE);
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    const size_t huge_page = 2 * 1024 * 1024;
+    if (!allow_huge || size < huge_page) {
+        size = round_up(size, SMALL_PAGE);
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    // Transparent huge pages only back 2 MB aligned ranges: map one page more and trim
+    size = round_up(size, huge_page);
+    void* mapped = mmap(NULL, size + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+        return nullptr;
+    uint8_t* start = (uint8_t*)mapped;
+    uint8_t* aligned = (uint8_t*)round_up((size_t)start, huge_page);
+    if (aligned > start)
+        munmap(start, aligned - start);
+    if (aligned + size < start + size + huge_page)
+        munmap(aligned + size, start + size + huge_page - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    huge = madvise(aligned, size, MADV_HUGEPAGE) == 0;
+#endif
+    return aligned;
+#endif
+}
+
+void free_pages(void* memory, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+void Arena::grow(size_t min_size) {
+    if (block) {
+        if (block_used) {
+            retired.push_back({ block, block_size });
+            retired_bytes += block_used;
+        }
+        else {
+            free_pages(block, block_size);
+        }
+    }
+
+    size_t size = min_size;
+    if (size < MIN_BLOCK) size = MIN_BLOCK;
+    if (size < high_water) size = high_water;
+    if (size < 2 * block_size) size = 2 * block_size;
+    block = (uint8_t*)allocate_pages(size, true, block_huge);
+    block_size = block ? size : 0;
+    block_used = 0;
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    size_t offset = block ? round_up((size_t)block + block_used, alignment) - (size_t)block : 0;
+    if (!block || offset + size > block_size) {
+        grow(size + alignment);
+        if (!block)
+            return nullptr;
+        offset = round_up((size_t)block, alignment) - (size_t)block;
+    }
+    block_used = offset + size;
+    if (used() > high_water)
+        high_water = used();
+    return block + offset;
+}
+
+void Arena::reserve(size_t size) {
+    if (!block || block_size - block_used < size)
+        grow(size);
+}
+
+void Arena::reset() {
+    for (const Block& old : retired)
+        free_pages(old.memory, old.size);
+    // After an overflow the next block is allocated at the high-water size
+    if (!retired.empty() && block) {
+        free_pages(block, block_size);
+        block = nullptr;
+        block_size = 0;
+    }
+    retired.clear();
+    retired_bytes = 0;
+    block_used = 0;
+}
+
+void Arena::rewind(const Mark& m) {
+    // A newer block holds only allocations made after the mark
+    block_used = m.block == block ? m.used : 0;
+}
+
+void Arena::release() {
+    reset();
+    if (block)
+        free_pages(block, block_size);
+    block = nullptr;
+    block_size = 0;
+    block_huge = false;
+    high_water = 0;
+}
+
+Arena& thread_scratch() {
+    thread_local Arena scratch;
+    return scratch;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Zero-filled, page-aligned memory straight from the OS, `size` rounded up to what was
+// mapped. Pages are placed in memory when first written, on the NUMA node of the thread
+// writing them. With `allow_huge` blocks of 2 MB or more ask for huge pages; `huge` tells
+// whether they were granted (on Linux: requested, the kernel decides).
+void* allocate_pages(size_t& size, bool allow_huge, bool& huge);
+void free_pages(void* memory, size_t size);
+
+// Bump allocators over large page-aligned blocks.
+//
+// Blocks come straight from the OS (mmap / VirtualAlloc) and ask for huge pages: transparent
+// huge pages on Linux, large pages on Windows when the process may lock memory. Where that is
+// not available the block is made of normal pages, nothing else changes. Allocation moves a
+// pointer; memory is only given back all at once (reset) or down to a mark (ScratchScope).
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { release(); }
+
+    // `size` bytes aligned to `alignment` (a power of two). A full block is replaced by a
+    // larger one; earlier allocations stay valid until the next reset().
+    void* allocate(size_t size, size_t alignment = 64);
+
+    // Make room for `size` more bytes in the current block, so they end up contiguous
+    void reserve(size_t size);
+
+    template <typename T>
+    T* allocate_array(size_t count) {
+        return (T*)allocate(count * sizeof(T), alignof(T) > 64 ? alignof(T) : 64);
+    }
+
+    // Give back everything. Overflow blocks are freed and the next block is sized for the
+    // most this arena has held, so a steady workload settles into one block.
+    void reset();
+    // Free all memory
+    void release();
+
+    size_t used() const { return block_used + retired_bytes; }
+    bool huge_pages() const { return block_huge; }
+
+    // Position to roll back to, for nested scratch allocations
+    struct Mark {
+        void* block;
+        size_t used;
+    };
+    Mark mark() const { return { block, block_used }; }
+    // Give back what was allocated after `m`. Blocks that filled up since stay until reset().
+    void rewind(const Mark& m);
+
+private:
+    friend class ScratchScope;
+
+    struct Block {
+        uint8_t* memory;
+        size_t size;
+    };
+
+    void grow(size_t min_size);
+
+    uint8_t* block = nullptr;
+    size_t block_size = 0;
+    size_t block_used = 0;
+    bool block_huge = false;
+    std::vector<Block> retired;     // full blocks, freed on reset()
+    size_t retired_bytes = 0;
+    size_t high_water = 0;
+    uint32_t open_scopes = 0;
+};
+
+// Per-thread arena for transient buffers (one tile's result, a filter pass), reused across
+// calls so steady-state rendering does not touch the heap
+Arena& thread_scratch();
+
+// Scratch allocations made while the scope is alive are given back when it ends
+class ScratchScope {
+public:
+    ScratchScope() : arena(thread_scratch()), start(arena.mark()) { arena.open_scopes++; }
+    ~ScratchScope() {
+        // The outermost scope also folds overflow blocks into one
+        if (--arena.open_scopes == 0)
+            arena.reset();
+        else
+            arena.rewind(start);
+    }
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+    template <typename T>
+    T* allocate(size_t count) { return arena.allocate_array<T>(count); }
+
+private:
+    Arena& arena;
+    Arena::Mark start;
+};
@@ -0,0 +1,604 @@
+#include "benchmark.h"
+#include "objects.h"
+#include "intersections.h"
+#include "render.h"
+#include "microfacet.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "scene_file.h"
+#include "fast_math.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+const uint32_t INPUT_SIZE = 4096;       // inputs per timed run, small enough to stay in cache
+const double MIN_RUN_SECONDS = 0.25;    // each kernel is repeated until it ran at least this long
+const uint64_t INPUT_SEED = 12345;      // inputs are the same on every run
+
+volatile float sink; // keeps the compiler from dropping the measured work
+
+struct Measurement {
+    double ns_per_op;
+    double cycles_per_op;   // TSC cycles (nominal frequency, not the boosted core clock)
+};
+
+// Repeat `body` (which performs `ops` operations) with doubling repetition counts until it runs long enough
+template <typename Body>
+Measurement measure(uint32_t ops, Body body) {
+    sink = body(); // warm-up: caches, branch predictors, clock boost
+
+    for (uint64_t runs = 1;; runs *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_tsc = __rdtsc();
+        float result = 0.0f;
+        for (uint64_t r = 0; r < runs; ++r)
+            result += body();
+        uint64_t cycles = __rdtsc() - start_tsc;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        sink = result;
+
+        if (seconds >= MIN_RUN_SECONDS) {
+            double total_ops = (double)runs * ops;
+            Measurement m = { seconds * 1e9 / total_ops, cycles / total_ops };
+            return m;
+        }
+    }
+}
+
+void report(const char* kernel, uint32_t primitives, const Measurement& m) {
+    char prims[16] = "-";
+    if (primitives)
+        snprintf(prims, sizeof(prims), "%u", primitives);
+    printf("%-22s %8s %10.2f %12.2f %10.1f\n", kernel, prims, m.ns_per_op, 1e3 / m.ns_per_op, m.cycles_per_op);
+}
+
+Vec3_simd random_point(Sampler& sampler, float extent) {
+    return mul(randf3(sampler), extent);
+}
+
+// Rays from a shell around the origin: a `hit_ratio` fraction aims at one of `targets`
+// (always a hit), the rest at a random point of the cube [-miss_extent, miss_extent]^3
+std::vector<Ray> make_rays(Sampler& sampler, const std::vector<Vec3_simd>& targets, float hit_ratio,
+    float shell_radius, float miss_extent) {
+    std::vector<Ray> rays(INPUT_SIZE);
+    for (Ray& ray : rays) {
+        ray.pos = mul(norm(rand_in_sphere(sampler)), shell_radius);
+        Vec3_simd target = randf(sampler) < hit_ratio
+            ? targets[sampler_next(sampler) % targets.size()]
+            : random_point(sampler, miss_extent);
+        ray.dir = norm(sub(target, ray.pos));
+    }
+    return rays;
+}
+
+void vector_benchmarks(Sampler& sampler) {
+    std::vector<Vec3_simd> a(INPUT_SIZE), b(INPUT_SIZE), n(INPUT_SIZE);
+    for (uint32_t i = 0; i < INPUT_SIZE; ++i) {
+        a[i] = random_point(sampler, 10.0f);
+        b[i] = random_point(sampler, 10.0f);
+        n[i] = norm(rand_in_sphere(sampler));
+    }
+
+    report("dot", 0, measure(INPUT_SIZE, [&]() {
+        float sum = 0.0f;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum += dot(a[i], b[i]);
+        return sum;
+    }));
+    report("cross", 0, measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, cross(a[i], b[i]));
+        return sum.x;
+    }));
+    report("norm", 0, measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, norm(a[i]));
+        return sum.x;
+    }));
+    report("reflect", 0, measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, reflect(a[i], n[i]));
+        return sum.x;
+    }));
+
+    // Reflection sampling at a random surface, as in every rough bounce of the path tracer
+    std::vector<GGXLobe> lobes(INPUT_SIZE);
+    for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+        lobes[i] = ggx_lobe(n[i], norm(a[i]), Vec3_simd(0.8f, 0.8f, 0.8f), randf(sampler));
+
+    uint32_t sample = 0;
+    report("ggx_sample", 0, measure(INPUT_SIZE, [&]() {
+        Sampler s = sampler_start(INPUT_SEED, 0, sample++);
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i) {
+            Vec3_simd wi, weight;
+            float pdf;
+            if (ggx_sample(lobes[i], randf(s), randf(s), wi, weight, pdf))
+                sum = add(sum, mul(wi, pdf));
+        }
+        return sum.x;
+    }));
+
+    // Primary rays of the default pinhole camera over a 1024x768 image, one at a time and batched
+    const Camera camera(CameraSettings(), 1024, 768);
+    std::vector<CameraSample> camera_samples(INPUT_SIZE);
+    for (CameraSample& camera_sample : camera_samples) {
+        camera_sample.px = 1024.0f * randf(sampler);
+        camera_sample.py = 768.0f * randf(sampler);
+        camera_sample.lens_u = randf(sampler);
+        camera_sample.lens_v = randf(sampler);
+    }
+    report("camera_ray", 0, measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, camera.generate_ray(camera_samples[i]).dir);
+        return sum.x;
+    }));
+    std::vector<Ray> camera_rays(INPUT_SIZE);
+    report("camera_rays (x4)", 0, measure(INPUT_SIZE, [&]() {
+        camera.generate_rays(camera_samples.data(), INPUT_SIZE, camera_rays.data());
+        return camera_rays[INPUT_SIZE - 1].dir.x;
+    }));
+}
+
+void shape_benchmarks(Sampler& sampler, float hit_ratio) {
+    Sphere sphere;
+    sphere.pos = Vec3_simd(0.0f, 0.0f, 0.0f);
+    sphere.radius = 1.0f;
+    sphere.material = 0;
+
+    // Rays from 5 units away: hits aim inside the sphere, misses beside it
+    // (so they fail the distance test rather than the direction test)
+    std::vector<Ray> sphere_rays(INPUT_SIZE);
+    for (Ray& ray : sphere_rays) {
+        ray.pos = mul(norm(rand_in_sphere(sampler)), 5.0f);
+        Vec3_simd target = randf(sampler) < hit_ratio
+            ? mul(rand_in_sphere(sampler), 0.9f)
+            : mul(norm(cross(ray.pos, rand_in_sphere(sampler))), 2.0f);
+        ray.dir = norm(sub(target, ray.pos));
+    }
+
+    report("Sphere::intersect", 1, measure(INPUT_SIZE, [&]() {
+        Hit hit;
+        float sum = 0.0f;
+        for (const Ray& ray : sphere_rays) {
+            if (sphere.intersect(ray, hit))
+                sum += hit.distance;
+        }
+        return sum;
+    }));
+
+    Plane plane;
+    plane.normal = Vec3_simd(0.0f, 1.0f, 0.0f);
+    plane.distance = 1.0f;
+    plane.material = 0;
+
+    // Rays above the plane, pointing down for a hit and up for a miss
+    std::vector<Ray> plane_rays(INPUT_SIZE);
+    for (Ray& ray : plane_rays) {
+        ray.pos = random_point(sampler, 5.0f);
+        ray.pos.y = 4.0f * randf(sampler);
+        Vec3_simd dir = norm(rand_in_sphere(sampler));
+        dir.y = fabsf(dir.y) + 0.01f;
+        if (randf(sampler) < hit_ratio)
+            dir.y = -dir.y;
+        ray.dir = norm(dir);
+    }
+
+    report("Plane::intersect", 1, measure(INPUT_SIZE, [&]() {
+        Hit hit;
+        float sum = 0.0f;
+        for (const Ray& ray : plane_rays) {
+            if (plane.intersect(ray, hit))
+                sum += hit.distance;
+        }
+        return sum;
+    }));
+
+    // Unit triangle in the z = 0 plane: hits aim inside it, misses past its long edge
+    Triangle triangle;
+    triangle.v0 = Vec3_simd(0.0f, 0.0f, 0.0f);
+    triangle.edge1 = Vec3_simd(1.0f, 0.0f, 0.0f);
+    triangle.edge2 = Vec3_simd(0.0f, 1.0f, 0.0f);
+    triangle.material = 0;
+    triangle.uv = Triangle::NO_UV;
+
+    std::vector<Ray> triangle_rays(INPUT_SIZE);
+    for (Ray& ray : triangle_rays) {
+        ray.pos = Vec3_simd(randf3(sampler).x, randf3(sampler).y, -5.0f);
+        float u = randf(sampler), v = randf(sampler);
+        if ((u + v > 1.0f) == (randf(sampler) < hit_ratio)) {
+            u = 1.0f - u;
+            v = 1.0f - v;
+        }
+        ray.dir = norm(sub(Vec3_simd(u, v, 0.0f), ray.pos));
+    }
+
+    report("Triangle::intersect", 1, measure(INPUT_SIZE, [&]() {
+        Hit hit;
+        float sum = 0.0f;
+        for (const Ray& ray : triangle_rays) {
+            if (triangle.intersect(ray, hit))
+                sum += hit.distance;
+        }
+        return sum;
+    }));
+}
+
+void scene_benchmark(Sampler& sampler, uint32_t primitives, float hit_ratio) {
+    // Random spheres in a cube, sized so the cube is about equally filled at every count
+    const float extent = 10.0f;
+    float radius = extent / cbrtf((float)primitives) * 0.4f;
+    Scene scene;
+    uint32_t material = scene.add_material(Vec3_simd(1.0f, 1.0f, 1.0f), 0.5f);
+    std::vector<Vec3_simd> centers;
+    for (uint32_t i = 0; i < primitives; ++i) {
+        Vec3_simd pos = random_point(sampler, extent);
+        scene.add_sphere(pos, radius * (0.5f + randf(sampler)), material);
+        centers.push_back(pos);
+    }
+    scene.build_bvh();
+
+    std::vector<Ray> rays = make_rays(sampler, centers, hit_ratio, 3.0f * extent, extent);
+    uint32_t hits = 0;
+    Hit hit;
+    for (const Ray& ray : rays)
+        hits += intersect(ray, scene, hit) ? 1 : 0;
+
+    char name[32];
+    snprintf(name, sizeof(name), "intersect (%.0f%% hit)", 100.0 * hits / INPUT_SIZE);
+    report(name, primitives, measure(INPUT_SIZE, [&]() {
+        Hit hit;
+        float sum = 0.0f;
+        for (const Ray& ray : rays) {
+            if (intersect(ray, scene, hit))
+                sum += hit.distance;
+        }
+        return sum;
+    }));
+
+    // The same rays as shadow rays over the whole cube: stop at the first hit, no hit record
+    report("occluded", primitives, measure(INPUT_SIZE, [&]() {
+        float sum = 0.0f;
+        for (const Ray& ray : rays) {
+            if (occluded(ray, scene, 6.0f * extent))
+                sum += 1.0f;
+        }
+        return sum;
+    }));
+}
+
+// ---------------------------------------------------------------------------
+// Whole renders
+
+const uint32_t BENCH_WIDTH = 320;
+const uint32_t BENCH_HEIGHT = 240;
+const uint32_t BENCH_BOUNCES = 5;
+const uint32_t BENCH_TILE_SIZE = 16;
+const uint32_t SCALING_SAMPLES = 8;         // samples per pixel of every thread-scaling run
+const uint32_t CONVERGENCE_SAMPLES = 64;    // error is measured at 1, 2, 4 .. this many samples
+const uint32_t REFERENCE_SAMPLES = 256;
+const uint64_t BENCH_SEED = 1;
+const uint64_t REFERENCE_SEED = 2;          // independent of the measured renders
+
+struct BenchScene {
+    const char* name;
+    void (*build)(Scene& scene);
+};
+
+// Floor and a field of small random spheres resting on it
+void build_many_spheres_scene(Scene& scene) {
+    scene.add_plane(Vec3_simd(0.0f, 1.0f, 0.0f), 1.0f, scene.add_material(Vec3_simd(0.8f, 0.8f, 0.8f), 0.9f));
+
+    Sampler sampler = sampler_start(INPUT_SEED, 1, 0);
+    for (uint32_t i = 0; i < 2000; ++i) {
+        float radius = 0.08f + 0.2f * randf(sampler);
+        Vec3_simd pos(12.0f * randf(sampler) - 6.0f, radius - 1.0f, 14.0f * randf(sampler) - 1.0f);
+        Vec3_simd color(0.3f + 0.7f * randf(sampler), 0.3f + 0.7f * randf(sampler), 0.3f + 0.7f * randf(sampler));
+        float roughness = 0.9f * randf(sampler);
+        scene.add_sphere(pos, radius, scene.add_material(color, roughness));
+    }
+}
+
+// Floor and a tilted torus of 96 x 48 quads (9216 triangles)
+void build_mesh_scene(Scene& scene) {
+    scene.add_plane(Vec3_simd(0.0f, 1.0f, 0.0f), 1.0f, scene.add_material(Vec3_simd(0.8f, 0.8f, 0.8f), 0.9f));
+
+    const uint32_t rings = 96, sides = 48;
+    const float major = 1.3f, minor = 0.5f, tilt = 1.0f, pi = 3.14159265f;
+    auto vertex = [&](uint32_t i, uint32_t j) {
+        float u = 2.0f * pi * (i % rings) / rings;
+        float v = 2.0f * pi * (j % sides) / sides;
+        float r = major + minor * cosf(v);
+        float x = r * cosf(u), y = r * sinf(u), z = minor * sinf(v);
+        // tilted around the x axis and moved in front of the camera
+        return Vec3_simd(x, y * cosf(tilt) - z * sinf(tilt) + 0.4f, y * sinf(tilt) + z * cosf(tilt) + 1.5f);
+    };
+
+    uint32_t material = scene.add_material(Vec3_simd(0.9f, 0.6f, 0.3f), 0.2f);
+    for (uint32_t i = 0; i < rings; ++i) {
+        for (uint32_t j = 0; j < sides; ++j) {
+            Vec3_simd a = vertex(i, j), b = vertex(i + 1, j), c = vertex(i + 1, j + 1), d = vertex(i, j + 1);
+            scene.add_triangle(a, b, c, material);
+            scene.add_triangle(a, c, d, material);
+        }
+    }
+}
+
+const BenchScene BENCH_SCENES[] = {
+    { "three_spheres", build_default_scene },
+    { "many_spheres", build_many_spheres_scene },
+    { "mesh", build_mesh_scene },
+};
+
+struct RenderRun {
+    double seconds;
+    uint64_t rays;
+};
+
+// Render the framebuffer's missing samples on `threads` threads
+RenderRun render_frame(Framebuffer& framebuffer, Scene& scene, uint32_t threads) {
+    const uint32_t total_tiles = tile_count(framebuffer.width, framebuffer.height, BENCH_TILE_SIZE);
+    std::atomic<uint32_t> next_tile(0);
+    std::atomic<uint64_t> rays(0);
+    const Camera camera(scene.camera, framebuffer.width, framebuffer.height);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            uint64_t start_rays = rays_traced;
+            for (uint32_t tile = next_tile.fetch_add(1); tile < total_tiles; tile = next_tile.fetch_add(1))
+                render_tile(tile_rect(tile, framebuffer.width, framebuffer.height, BENCH_TILE_SIZE), framebuffer, scene, camera);
+            rays += rays_traced - start_rays;
+        });
+    }
+    for (std::thread& worker : workers)
+        worker.join();
+
+    RenderRun run = { std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), rays.load() };
+    return run;
+}
+
+// Root mean square error of the displayed (clamped) pixel values
+double image_rmse(const Framebuffer& image, const Framebuffer& reference) {
+    double sum = 0.0;
+    for (uint32_t i = 0; i < image.pixel_count(); ++i) {
+        float inv_count = 1.0f / image.counts[i];
+        float inv_reference = 1.0f / reference.counts[i];
+        for (uint32_t c = 0; c < 3; ++c) {
+            double d = saturate(image.accum[3 * i + c] * inv_count) - saturate(reference.accum[3 * i + c] * inv_reference);
+            sum += d * d;
+        }
+    }
+    return sqrt(sum / (3.0 * image.pixel_count()));
+}
+
+void render_benchmark(const BenchScene& bench, uint32_t max_threads) {
+    Scene scene;
+    bench.build(scene);
+    scene.build_bvh();
+    printf("\n== %s (%u sfer, %u plaszczyzn, %u trojkatow; %ux%u, %u odbic; scena %.1f KB%s)\n", bench.name,
+        scene.spheres.size, scene.planes.size, scene.triangles.size, BENCH_WIDTH, BENCH_HEIGHT, BENCH_BOUNCES,
+        scene.arena_bytes() / 1024.0, scene.arena_huge_pages() ? ", duze strony" : "");
+
+    // Thread scaling: the same frame at 1, 2, 4 .. max_threads threads
+    printf("%8s %10s %12s %14s %12s\n", "watki", "czas [s]", "mln prom./s", "mln probek/s", "wydajnosc");
+    double single_thread_seconds = 0.0;
+    for (uint32_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        Framebuffer framebuffer;
+        framebuffer.create(BENCH_WIDTH, BENCH_HEIGHT, SCALING_SAMPLES, BENCH_BOUNCES, BENCH_SEED);
+        RenderRun run = render_frame(framebuffer, scene, threads);
+        if (threads == 1)
+            single_thread_seconds = run.seconds;
+
+        double samples = (double)framebuffer.pixel_count() * SCALING_SAMPLES;
+        double efficiency = single_thread_seconds / (run.seconds * threads);
+        printf("%8u %10.3f %12.2f %14.2f %11.0f%%\n", threads, run.seconds, run.rays / run.seconds * 1e-6,
+            samples / run.seconds * 1e-6, 100.0 * efficiency);
+        if (threads == max_threads)
+            break;
+    }
+
+    // Convergence: error against a high-sample reference as samples are added
+    Framebuffer reference;
+    reference.create(BENCH_WIDTH, BENCH_HEIGHT, REFERENCE_SAMPLES, BENCH_BOUNCES, REFERENCE_SEED);
+    RenderRun reference_run = render_frame(reference, scene, max_threads);
+    printf("%8s %10s %12s   (referencja: %u probek, %.1f s)\n", "probki", "czas [s]", "RMSE", REFERENCE_SAMPLES, reference_run.seconds);
+
+    Framebuffer framebuffer;
+    framebuffer.create(BENCH_WIDTH, BENCH_HEIGHT, 1, BENCH_BOUNCES, BENCH_SEED);
+    double seconds = 0.0;
+    for (uint32_t samples = 1; samples <= CONVERGENCE_SAMPLES; samples *= 2) {
+        framebuffer.samples = samples; // render_tile() adds only the missing samples
+        seconds += render_frame(framebuffer, scene, max_threads).seconds;
+        printf("%8u %10.3f %12.5f\n", samples, seconds, image_rmse(framebuffer, reference));
+    }
+}
+
+// Distance in units in the last place from `value` to `reference` rounded to float
+double ulp_error(float value, double reference) {
+    float rounded = (float)reference;
+    if (value == rounded)
+        return 0.0;
+    if (!std::isfinite(value))
+        return std::numeric_limits<double>::infinity();
+    // Float bit patterns ordered like the values, negative ones mirrored below zero
+    auto ordered = [](float f) {
+        int32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return bits < 0 ? (int64_t)INT32_MIN - bits : (int64_t)bits;
+    };
+    return fabs((double)(ordered(value) - ordered(rounded)));
+}
+
+struct ErrorStats {
+    double max_ulp = 0.0;
+    double sum_ulp = 0.0;
+    double max_relative = 0.0;
+    uint64_t count = 0;
+
+    void add(float value, double reference) {
+        double ulp = ulp_error(value, reference);
+        max_ulp = std::max(max_ulp, ulp);
+        sum_ulp += ulp;
+        if (reference != 0.0)
+            max_relative = std::max(max_relative, fabs((value - reference) / reference));
+        count++;
+    }
+};
+
+const uint32_t ACCURACY_INPUTS = 1 << 20;   // inputs per approximated function
+
+// Positive floats spread evenly over the exponents 2^-20 .. 2^20
+float random_magnitude(Sampler& sampler) {
+    return ldexpf(1.0f + randf(sampler), (int)(41.0f * randf(sampler)) - 20);
+}
+
+// Error of the FastMath function against the exact result, and the time of both versions
+template <typename Precise, typename Fast, typename Exact>
+void accuracy_row(const char* name, const std::vector<float>& inputs, Precise precise, Fast fast, Exact exact) {
+    ErrorStats stats;
+    for (float x : inputs)
+        stats.add(fast(x), exact((double)x));
+    Measurement precise_time = measure(INPUT_SIZE, [&]() {
+        float sum = 0.0f;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum += precise(inputs[i]);
+        return sum;
+    });
+    Measurement fast_time = measure(INPUT_SIZE, [&]() {
+        float sum = 0.0f;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum += fast(inputs[i]);
+        return sum;
+    });
+    printf("%-12s %10.1f %10.3f %15.3g %12.2f %12.2f\n", name, stats.max_ulp, stats.sum_ulp / stats.count, stats.max_relative,
+        precise_time.ns_per_op, fast_time.ns_per_op);
+}
+
+void function_accuracy() {
+    Sampler sampler = sampler_start(INPUT_SEED, 2, 0);
+    std::vector<float> magnitudes(ACCURACY_INPUTS), signed_values(ACCURACY_INPUTS), angles(ACCURACY_INPUTS);
+    for (uint32_t i = 0; i < ACCURACY_INPUTS; ++i) {
+        magnitudes[i] = random_magnitude(sampler);
+        signed_values[i] = randf(sampler) < 0.5f ? -random_magnitude(sampler) : random_magnitude(sampler);
+        angles[i] = 2.0f * 3.14159265f * randf(sampler);  // sampled angles, as in ggx_sample()
+    }
+
+    printf("%-12s %10s %10s %15s %12s %12s\n", "funkcja", "maks. ULP", "sr. ULP", "maks. bl. wzgl.", "ns dokladna", "ns szybka");
+    accuracy_row("sqrt", magnitudes, [](float x) { return PreciseMath::sqrt(x); }, [](float x) { return FastMath::sqrt(x); },
+        [](double x) { return sqrt(x); });
+    accuracy_row("rsqrt", magnitudes, [](float x) { return PreciseMath::rsqrt(x); }, [](float x) { return FastMath::rsqrt(x); },
+        [](double x) { return 1.0 / sqrt(x); });
+    accuracy_row("rcp", signed_values, [](float x) { return PreciseMath::rcp(x); }, [](float x) { return FastMath::rcp(x); },
+        [](double x) { return 1.0 / x; });
+    accuracy_row("sin", angles, [](float x) { return sinf(x); }, [](float x) { float s, c; FastMath::sincos(x, s, c); return s; },
+        [](double x) { return sin(x); });
+    accuracy_row("cos", angles, [](float x) { return cosf(x); }, [](float x) { float s, c; FastMath::sincos(x, s, c); return c; },
+        [](double x) { return cos(x); });
+
+    // norm(): every component of vectors with random direction and length
+    std::vector<Vec3_simd> vectors(ACCURACY_INPUTS);
+    for (Vec3_simd& v : vectors)
+        v = mul(rand_in_sphere(sampler), random_magnitude(sampler));
+    ErrorStats stats;
+    for (const Vec3_simd& v : vectors) {
+        double length = sqrt((double)v.x * v.x + (double)v.y * v.y + (double)v.z * v.z);
+        if (length == 0.0)
+            continue;
+        Vec3_simd n = FastMath::norm(v);
+        stats.add(n.x, v.x / length);
+        stats.add(n.y, v.y / length);
+        stats.add(n.z, v.z / length);
+    }
+    Measurement precise_time = measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, PreciseMath::norm(vectors[i]));
+        return sum.x;
+    });
+    Measurement fast_time = measure(INPUT_SIZE, [&]() {
+        Vec3_simd sum;
+        for (uint32_t i = 0; i < INPUT_SIZE; ++i)
+            sum = add(sum, FastMath::norm(vectors[i]));
+        return sum.x;
+    });
+    printf("%-12s %10.1f %10.3f %15.3g %12.2f %12.2f\n", "norm", stats.max_ulp, stats.sum_ulp / stats.count, stats.max_relative,
+        precise_time.ns_per_op, fast_time.ns_per_op);
+}
+
+// The same frame with precise and fast kernels. The difference is put next to the noise of
+// the frame (RMSE between two seeds), which is what it has to stay well below.
+void image_accuracy(const BenchScene& bench, uint32_t threads) {
+    Scene scene;
+    bench.build(scene);
+    scene.build_bvh();
+
+    Framebuffer precise, fast, other_seed;
+    precise.create(BENCH_WIDTH, BENCH_HEIGHT, SCALING_SAMPLES, BENCH_BOUNCES, BENCH_SEED);
+    fast.create(BENCH_WIDTH, BENCH_HEIGHT, SCALING_SAMPLES, BENCH_BOUNCES, BENCH_SEED);
+    other_seed.create(BENCH_WIDTH, BENCH_HEIGHT, SCALING_SAMPLES, BENCH_BOUNCES, REFERENCE_SEED);
+
+    set_fast_math(false);
+    RenderRun precise_run = render_frame(precise, scene, threads);
+    render_frame(other_seed, scene, threads);
+    set_fast_math(true);
+    RenderRun fast_run = render_frame(fast, scene, threads);
+
+    printf("%-14s %12.3f %12.3f %10.1f%% %12.6f %12.6f\n", bench.name, precise_run.seconds, fast_run.seconds,
+        100.0 * (precise_run.seconds / fast_run.seconds - 1.0), image_rmse(fast, precise), image_rmse(other_seed, precise));
+}
+
+} // namespace
+
+bool run_render_benchmarks(const RenderSettings& settings) {
+    uint32_t max_threads = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    printf("Benchmark renderowania (ziarno %llu, do %u watkow)\n", (unsigned long long)BENCH_SEED, max_threads);
+    for (const BenchScene& bench : BENCH_SCENES)
+        render_benchmark(bench, max_threads);
+    return true;
+}
+
+bool run_accuracy_benchmarks(const RenderSettings& settings) {
+    printf("Dokladnosc --fast-math (%u wejsc na funkcje)\n\n", ACCURACY_INPUTS);
+    function_accuracy();
+
+    uint32_t threads = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    printf("\nObraz %ux%u, %u probek, %u odbic, %u watkow (RMSE wzgledem dokladnego renderu)\n",
+        BENCH_WIDTH, BENCH_HEIGHT, SCALING_SAMPLES, BENCH_BOUNCES, threads);
+    printf("%-14s %12s %12s %11s %12s %12s\n", "scena", "dokladny [s]", "szybki [s]", "zysk", "RMSE szybki", "RMSE szumu");
+    for (const BenchScene& bench : BENCH_SCENES)
+        image_accuracy(bench, threads);
+    set_fast_math(settings.fast_math);
+    return true;
+}
+
+bool run_kernel_benchmarks(const RenderSettings& settings) {
+    Sampler sampler = sampler_start(INPUT_SEED, 0, 0);
+
+    printf("Mikrobenchmarki (%u wejsc na przebieg, trafienia: %.0f%%)\n\n", INPUT_SIZE, 100.0f * settings.bench_hit_ratio);
+    printf("%-22s %8s %10s %12s %10s\n", "kernel", "obiekty", "ns/op", "mln op/s", "cykle/op");
+
+    vector_benchmarks(sampler);
+    shape_benchmarks(sampler, settings.bench_hit_ratio);
+    for (uint32_t primitives : settings.bench_primitives)
+        scene_benchmark(sampler, primitives, settings.bench_hit_ratio);
+    return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "settings.h"
+
+// Microbenchmarks of the hot kernels (--bench-kernels): vector math from vec3_simd.h,
+// GGX reflection sampling, camera ray generation, Sphere/Plane::intersect and the scene intersect() and occluded() over scenes of
+// settings.bench_primitives random spheres. Rays hit their target with probability
+// settings.bench_hit_ratio. Reports ns/op, operations (rays) per second and TSC cycles per op.
+bool run_kernel_benchmarks(const RenderSettings& settings);
+
+// Whole-render benchmark (--bench) over the built-in scenes: the three-sphere scene, a scene
+// of many spheres and a triangle mesh, all at fixed seeds and resolution. Reports rays and
+// samples per second, scaling from 1 to settings.threads threads, and the RMSE against a
+// high-sample reference as the sample count (and time) grows.
+bool run_render_benchmarks(const RenderSettings& settings);
+
+// Accuracy of --fast-math (--bench-accuracy): the largest and mean error in ULP of every
+// approximated function against double precision, with the time of both versions, then the
+// RMSE between fast and precise renders of the benchmark scenes next to the RMSE of the noise.
+bool run_accuracy_benchmarks(const RenderSettings& settings);
@@ -0,0 +1,146 @@
+#include "bvh.h"
+#include <algorithm>
+
+static const uint32_t BVH_BINS = 12;
+static const uint32_t BVH_MAX_LEAF_SIZE = 4;
+static const uint32_t BVH_MAX_DEPTH = 60; // traversal stacks hold 64 entries
+
+namespace {
+
+struct BuildContext {
+    const std::vector<Aabb>& bounds;
+    std::vector<Vec3_simd> centroids;
+    std::vector<BVHNode>& nodes;
+    std::vector<uint32_t>& order;
+};
+
+struct Bin {
+    Aabb bounds = aabb_empty();
+    uint32_t count = 0;
+};
+
+float axis(const Vec3_simd& v, int a) {
+    return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+void subdivide(BuildContext& ctx, uint32_t node_index, uint32_t depth) {
+    uint32_t first = ctx.nodes[node_index].first;
+    uint32_t count = ctx.nodes[node_index].count;
+    if (count <= BVH_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+        return;
+
+    // Centroid bounds decide the split axis and the bin layout
+    Aabb centroid_bounds = aabb_empty();
+    for (uint32_t i = first; i < first + count; ++i) {
+        const Vec3_simd& c = ctx.centroids[ctx.order[i]];
+        centroid_bounds.min = _mm_min_ps(centroid_bounds.min.simd, c.simd);
+        centroid_bounds.max = _mm_max_ps(centroid_bounds.max.simd, c.simd);
+    }
+
+    float best_cost = aabb_area(ctx.nodes[node_index].bounds) * count; // cost of keeping a leaf
+    int best_axis = -1;
+    uint32_t best_split = 0;
+
+    for (int a = 0; a < 3; ++a) {
+        float lo = axis(centroid_bounds.min, a);
+        float hi = axis(centroid_bounds.max, a);
+        if (hi <= lo)
+            continue;
+
+        Bin bins[BVH_BINS];
+        float scale = BVH_BINS / (hi - lo);
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t prim = ctx.order[i];
+            uint32_t b = std::min(BVH_BINS - 1, (uint32_t)((axis(ctx.centroids[prim], a) - lo) * scale));
+            bins[b].count++;
+            bins[b].bounds = aabb_union(bins[b].bounds, ctx.bounds[prim]);
+        }
+
+        // Sweep from both sides to get the area and count left/right of every split plane
+        float left_area[BVH_BINS - 1], right_area[BVH_BINS - 1];
+        uint32_t left_count[BVH_BINS - 1], right_count[BVH_BINS - 1];
+        Aabb left = aabb_empty(), right = aabb_empty();
+        uint32_t left_sum = 0, right_sum = 0;
+        for (uint32_t i = 0; i < BVH_BINS - 1; ++i) {
+            left_sum += bins[i].count;
+            left = aabb_union(left, bins[i].bounds);
+            left_count[i] = left_sum;
+            left_area[i] = left_sum ? aabb_area(left) : 0.0f;
+
+            right_sum += bins[BVH_BINS - 1 - i].count;
+            right = aabb_union(right, bins[BVH_BINS - 1 - i].bounds);
+            right_count[BVH_BINS - 2 - i] = right_sum;
+            right_area[BVH_BINS - 2 - i] = right_sum ? aabb_area(right) : 0.0f;
+        }
+
+        for (uint32_t i = 0; i < BVH_BINS - 1; ++i) {
+            float cost = left_area[i] * left_count[i] + right_area[i] * right_count[i];
+            if (left_count[i] && right_count[i] && cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_split = i;
+            }
+        }
+    }
+
+    if (best_axis < 0)
+        return; // splitting does not pay off
+
+    // Partition primitives around the chosen plane
+    float lo = axis(centroid_bounds.min, best_axis);
+    float scale = BVH_BINS / (axis(centroid_bounds.max, best_axis) - lo);
+    uint32_t* begin = ctx.order.data() + first;
+    uint32_t* middle = std::partition(begin, begin + count, [&](uint32_t prim) {
+        uint32_t b = std::min(BVH_BINS - 1, (uint32_t)((axis(ctx.centroids[prim], best_axis) - lo) * scale));
+        return b <= best_split;
+    });
+    uint32_t left_count = (uint32_t)(middle - begin);
+
+    uint32_t left_index = (uint32_t)ctx.nodes.size();
+    ctx.nodes.resize(ctx.nodes.size() + 2);
+    BVHNode& left = ctx.nodes[left_index];
+    BVHNode& right = ctx.nodes[left_index + 1];
+    left.first = first;
+    left.count = left_count;
+    right.first = first + left_count;
+    right.count = count - left_count;
+
+    for (BVHNode* child : { &left, &right }) {
+        child->bounds = aabb_empty();
+        for (uint32_t i = child->first; i < child->first + child->count; ++i)
+            child->bounds = aabb_union(child->bounds, ctx.bounds[ctx.order[i]]);
+    }
+
+    ctx.nodes[node_index].first = left_index;
+    ctx.nodes[node_index].count = 0;
+
+    subdivide(ctx, left_index, depth + 1);
+    subdivide(ctx, left_index + 1, depth + 1);
+}
+
+} // namespace
+
+void build_bvh(const std::vector<Aabb>& bounds, std::vector<BVHNode>& nodes, std::vector<uint32_t>& order) {
+    nodes.clear();
+    order.resize(bounds.size());
+    for (uint32_t i = 0; i < (uint32_t)bounds.size(); ++i)
+        order[i] = i;
+    if (bounds.empty())
+        return;
+
+    BuildContext ctx = { bounds, {}, nodes, order };
+    ctx.centroids.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); ++i)
+        ctx.centroids[i] = mul(add(bounds[i].min, bounds[i].max), 0.5f);
+
+    nodes.reserve(bounds.size() * 2);
+    BVHNode root;
+    root.bounds = aabb_empty();
+    for (const Aabb& box : bounds)
+        root.bounds = aabb_union(root.bounds, box);
+    root.first = 0;
+    root.count = (uint32_t)bounds.size();
+    nodes.push_back(root);
+
+    subdivide(ctx, 0, 0);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include <stdint.h>
+#include <vector>
+
+// Axis-aligned bounding box
+struct alignas(16) Aabb {
+    Vec3_simd min;
+    Vec3_simd max;
+};
+
+inline Aabb aabb_empty() {
+    Aabb box;
+    box.min = splat(3.4e38f);
+    box.max = splat(-3.4e38f);
+    return box;
+}
+
+inline Aabb aabb_union(const Aabb& a, const Aabb& b) {
+    Aabb box;
+    box.min = _mm_min_ps(a.min.simd, b.min.simd);
+    box.max = _mm_max_ps(a.max.simd, b.max.simd);
+    return box;
+}
+
+inline float aabb_area(const Aabb& box) {
+    Vec3_simd d = sub(box.max, box.min);
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// BVH node (plain data, stored as-is in the binary scene cache).
+// Children of an inner node are stored next to each other, the left one at `first`.
+struct alignas(16) BVHNode {
+    Aabb bounds;
+    uint32_t first;     // leaf: first primitive, inner node: left child
+    uint32_t count;     // leaf: number of primitives, inner node: 0
+};
+
+// Build a BVH with a binned SAH over the given primitive bounds.
+// `order` receives the primitive permutation: leaves reference contiguous ranges of
+// the primitive array once it is reordered with it.
+void build_bvh(const std::vector<Aabb>& bounds, std::vector<BVHNode>& nodes, std::vector<uint32_t>& order);
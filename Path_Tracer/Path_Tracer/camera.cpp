@@ -0,0 +1,147 @@
+#include "camera.h"
+#include <math.h>
+
+static const float CAMERA_PI = 3.14159265f;
+
+Camera::Camera(const CameraSettings& settings, uint32_t image_width, uint32_t image_height)
+    : width(image_width), height(image_height) {
+    Vec3_simd to_target = sub(settings.look_at, settings.position);
+    forward = norm(to_target);
+    Vec3_simd side = cross(forward, settings.up);
+    if (dot(side, side) < 1e-12f) // looking along `up`: any side vector will do
+        side = cross(forward, fabsf(forward.z) < 0.9f ? Vec3_simd(0.0f, 0.0f, 1.0f) : Vec3_simd(1.0f, 0.0f, 0.0f));
+    right = norm(side);
+    down = cross(forward, right);   // image y grows downwards
+
+    // A pinhole camera is sharp everywhere, any focus plane gives the same rays
+    lens_radius = settings.aperture;
+    focus = 1.0f;
+    if (lens_radius > 0.0f)
+        focus = settings.focus_distance > 0.0f ? settings.focus_distance : mag(to_target);
+
+    float aspect = settings.aspect > 0.0f ? settings.aspect : width / (float)height;
+    float half_height = tanf(settings.fov * (CAMERA_PI / 360.0f)) * focus;
+    float half_width = half_height * aspect;
+
+    origin = settings.position;
+    corner = sub(sub(mul(forward, focus), mul(right, half_width)), mul(down, half_height));
+    step_x = mul(right, 2.0f * half_width / width);
+    step_y = mul(down, 2.0f * half_height / height);
+    spread = 2.0f * half_height / (focus * height);
+}
+
+bool Camera::project(Vec3_simd point, float& px, float& py) const {
+    Vec3_simd to_point = sub(point, origin);
+    float depth = dot(to_point, forward);
+    if (depth <= 1e-6f * focus)
+        return false;
+    // Onto the plane of `corner`, then in steps from the corner
+    Vec3_simd offset = sub(mul(to_point, focus / depth), corner);
+    px = dot(offset, step_x) / dot(step_x, step_x);
+    py = dot(offset, step_y) / dot(step_y, step_y);
+    return true;
+}
+
+void Camera::lens_offset(float u, float v, float& dx, float& dy) const {
+    // Concentric mapping of the square onto the disk (Shirley and Chiu), keeps strata compact
+    float a = 2.0f * u - 1.0f;
+    float b = 2.0f * v - 1.0f;
+    if (a == 0.0f && b == 0.0f) {
+        dx = dy = 0.0f;
+        return;
+    }
+    float r, phi;
+    if (fabsf(a) > fabsf(b)) {
+        r = a;
+        phi = (CAMERA_PI / 4.0f) * (b / a);
+    }
+    else {
+        r = b;
+        phi = (CAMERA_PI / 2.0f) - (CAMERA_PI / 4.0f) * (a / b);
+    }
+    dx = lens_radius * r * cosf(phi);
+    dy = lens_radius * r * sinf(phi);
+}
+
+// Both paths below do the same operations per component (fused multiply-adds in the same
+// order, an exact square root and division), which keeps their rays bit-identical.
+
+Ray Camera::generate_ray(const CameraSample& sample) const {
+    Vec3_simd dir = _mm_fmadd_ps(step_y.simd, _mm_set1_ps(sample.py),
+        _mm_fmadd_ps(step_x.simd, _mm_set1_ps(sample.px), corner.simd));
+
+    Ray ray;
+    ray.pos = origin;
+    if (lens_radius > 0.0f) {
+        float dx, dy;
+        lens_offset(sample.lens_u, sample.lens_v, dx, dy);
+        Vec3_simd offset = _mm_fmadd_ps(down.simd, _mm_set1_ps(dy), _mm_mul_ps(right.simd, _mm_set1_ps(dx)));
+        ray.pos = add(origin, offset);
+        dir = sub(dir, offset);
+    }
+
+    float len_sq = fmaf(dir.z, dir.z, fmaf(dir.y, dir.y, dir.x * dir.x));
+    ray.dir = mul(dir, 1.0f / sqrtf(len_sq));
+    return ray;
+}
+
+void Camera::generate_rays(const CameraSample* samples, uint32_t count, Ray* rays) const {
+    for (uint32_t first = 0; first < count; first += 4) {
+        uint32_t lanes = count - first < 4 ? count - first : 4;
+
+        // The last group is padded with copies of its first sample
+        alignas(16) CameraSample group[4];
+        for (uint32_t i = 0; i < 4; ++i)
+            group[i] = samples[first + (i < lanes ? i : 0)];
+
+        // Rows become px, py, lens_u, lens_v of the four samples
+        __m128 px = _mm_load_ps(&group[0].px);
+        __m128 py = _mm_load_ps(&group[1].px);
+        __m128 lens_u = _mm_load_ps(&group[2].px);
+        __m128 lens_v = _mm_load_ps(&group[3].px);
+        _MM_TRANSPOSE4_PS(px, py, lens_u, lens_v);
+
+        __m128 dir_x = _mm_fmadd_ps(_mm_set1_ps(step_y.x), py, _mm_fmadd_ps(_mm_set1_ps(step_x.x), px, _mm_set1_ps(corner.x)));
+        __m128 dir_y = _mm_fmadd_ps(_mm_set1_ps(step_y.y), py, _mm_fmadd_ps(_mm_set1_ps(step_x.y), px, _mm_set1_ps(corner.y)));
+        __m128 dir_z = _mm_fmadd_ps(_mm_set1_ps(step_y.z), py, _mm_fmadd_ps(_mm_set1_ps(step_x.z), px, _mm_set1_ps(corner.z)));
+
+        __m128 pos_x = _mm_set1_ps(origin.x);
+        __m128 pos_y = _mm_set1_ps(origin.y);
+        __m128 pos_z = _mm_set1_ps(origin.z);
+        if (lens_radius > 0.0f) {
+            alignas(16) float dx[4], dy[4];
+            for (uint32_t i = 0; i < 4; ++i)
+                lens_offset(group[i].lens_u, group[i].lens_v, dx[i], dy[i]);
+            __m128 lens_x = _mm_load_ps(dx);
+            __m128 lens_y = _mm_load_ps(dy);
+
+            __m128 offset_x = _mm_fmadd_ps(_mm_set1_ps(down.x), lens_y, _mm_mul_ps(_mm_set1_ps(right.x), lens_x));
+            __m128 offset_y = _mm_fmadd_ps(_mm_set1_ps(down.y), lens_y, _mm_mul_ps(_mm_set1_ps(right.y), lens_x));
+            __m128 offset_z = _mm_fmadd_ps(_mm_set1_ps(down.z), lens_y, _mm_mul_ps(_mm_set1_ps(right.z), lens_x));
+            pos_x = _mm_add_ps(pos_x, offset_x);
+            pos_y = _mm_add_ps(pos_y, offset_y);
+            pos_z = _mm_add_ps(pos_z, offset_z);
+            dir_x = _mm_sub_ps(dir_x, offset_x);
+            dir_y = _mm_sub_ps(dir_y, offset_y);
+            dir_z = _mm_sub_ps(dir_z, offset_z);
+        }
+
+        __m128 len_sq = _mm_fmadd_ps(dir_z, dir_z, _mm_fmadd_ps(dir_y, dir_y, _mm_mul_ps(dir_x, dir_x)));
+        __m128 inv_len = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(len_sq));
+        dir_x = _mm_mul_ps(dir_x, inv_len);
+        dir_y = _mm_mul_ps(dir_y, inv_len);
+        dir_z = _mm_mul_ps(dir_z, inv_len);
+
+        // Back to one ray per register, w = 0
+        __m128 pos_w = _mm_setzero_ps();
+        __m128 dir_w = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(pos_x, pos_y, pos_z, pos_w);
+        _MM_TRANSPOSE4_PS(dir_x, dir_y, dir_z, dir_w);
+        const __m128 pos[4] = { pos_x, pos_y, pos_z, pos_w };
+        const __m128 dir[4] = { dir_x, dir_y, dir_z, dir_w };
+        for (uint32_t i = 0; i < lanes; ++i) {
+            rays[first + i].pos.simd = pos[i];
+            rays[first + i].dir.simd = dir[i];
+        }
+    }
+}
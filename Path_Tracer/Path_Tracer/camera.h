@@ -0,0 +1,50 @@
+#pragma once
+
+#include "objects.h"
+#include <stdint.h>
+
+// One camera sample: image position in pixels (pixel x covers x .. x + 1) and a point on the
+// lens in [0, 1)^2, unused by a pinhole camera
+struct alignas(16) CameraSample {
+    float px, py;
+    float lens_u, lens_v;
+};
+
+// Camera of one frame. The basis, the image plane corner and the per-pixel steps are worked out
+// once from the scene's CameraSettings and the image size, so a ray costs a few multiply-adds
+// and a normalize instead of redoing the projection for every pixel.
+//
+// Rays start on the lens (at the camera position for a pinhole) and pass through the point of
+// the image on the focus plane. Single and batched generation give bit-identical rays, so a
+// sample does not change with the batch it happens to be generated in.
+class alignas(16) Camera {
+public:
+    Camera(const CameraSettings& settings, uint32_t width, uint32_t height);
+
+    Ray generate_ray(const CameraSample& sample) const;
+    // `count` rays, four per SSE pass
+    void generate_rays(const CameraSample* samples, uint32_t count, Ray* rays) const;
+
+    uint32_t width, height;     // image size the camera was set up for
+
+    // Angle one pixel covers near the image center, the starting spread of a ray cone
+    float pixel_spread() const { return spread; }
+    // Image position (in pixels) where the ray through the lens center meets `point`.
+    // False for points behind or beside the camera, which have no such position.
+    bool project(Vec3_simd point, float& px, float& py) const;
+    // Whether the lens has an aperture (points off the focus plane are blurred)
+    bool has_lens() const { return lens_radius > 0.0f; }
+
+private:
+    // Offset on the lens, lens radius included, of the lens sample (u, v)
+    void lens_offset(float u, float v, float& dx, float& dy) const;
+
+    Vec3_simd origin;
+    Vec3_simd corner;           // from `origin` to the top left image corner on the focus plane
+    Vec3_simd step_x, step_y;   // one pixel right / down on the focus plane
+    Vec3_simd right, down;      // unit vectors of the lens plane
+    Vec3_simd forward;
+    float focus;                // distance from `origin` to the plane of `corner`
+    float lens_radius;
+    float spread;
+};
@@ -0,0 +1,302 @@
+#include "checkpoint.h"
+#include "arena.h"
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <stdio.h>
+#include <algorithm>
+
+static const char CHECKPOINT_MAGIC[8] = { 'P', 'T', 'C', 'K', 'P', 'T', 0, 0 };
+static const uint32_t CHECKPOINT_VERSION = 3;
+
+// Offsets of the pixel arrays inside the buffer (the same for heap and file storage)
+static size_t accum_offset() { return sizeof(CheckpointHeader); }
+static size_t counts_offset(uint32_t pixels) { return accum_offset() + (size_t)pixels * 3 * sizeof(float); }
+static size_t buffer_size(uint32_t pixels) { return counts_offset(pixels) + (size_t)pixels * sizeof(uint32_t); }
+
+static void write_header(void* memory, const Framebuffer& fb) {
+    CheckpointHeader* header = (CheckpointHeader*)memory;
+    memset(header, 0, sizeof(CheckpointHeader));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header->version = CHECKPOINT_VERSION;
+    header->width = fb.width;
+    header->height = fb.height;
+    header->samples = fb.samples;
+    header->bounces = fb.bounces;
+    header->seed = fb.seed;
+    header->first_sample = fb.first_sample;
+    header->split_index = fb.split_index;
+    header->split_count = fb.split_count;
+}
+
+void Framebuffer::assign_pointers() {
+    uint8_t* base = (uint8_t*)memory;
+    accum = (float*)(base + accum_offset());
+    counts = (uint32_t*)(base + counts_offset(pixel_count()));
+}
+
+void Framebuffer::reset_pixel(uint32_t index) {
+    accum[3 * index + 0] = 0.0f;
+    accum[3 * index + 1] = 0.0f;
+    accum[3 * index + 2] = 0.0f;
+    counts[index] = 0;
+}
+
+bool Framebuffer::create(uint32_t w, uint32_t h, uint32_t spp, uint32_t depth, uint64_t render_seed,
+    uint32_t first, uint32_t part, uint32_t parts) {
+    release();
+    width = w; height = h; samples = spp; bounces = depth; seed = render_seed;
+    first_sample = first; split_index = part; split_count = parts;
+
+    // Zero pages are already reset pixels. They are left untouched, so each page is placed
+    // on the NUMA node of the render thread that first writes one of its pixels.
+    size_t size = buffer_size(pixel_count());
+    bool huge;
+    memory = allocate_pages(size, false, huge);
+    if (!memory)
+        return false;
+    memory_size = size;
+
+    write_header(memory, *this);
+    assign_pointers();
+    return true;
+}
+
+bool Framebuffer::create_mapped(const char* path, uint32_t w, uint32_t h, uint32_t spp, uint32_t depth, uint64_t render_seed,
+    uint32_t first, uint32_t part, uint32_t parts) {
+    release();
+    width = w; height = h; samples = spp; bounces = depth; seed = render_seed;
+    first_sample = first; split_index = part; split_count = parts;
+
+    if (!file.open(path, MappedFile::CREATE, buffer_size(pixel_count())))
+        return false;
+    memory = file.data();
+
+    write_header(memory, *this);
+    assign_pointers();
+    for (uint32_t i = 0; i < pixel_count(); ++i)
+        reset_pixel(i);
+    flush();
+    return true;
+}
+
+bool Framebuffer::open_mapped(const char* path, bool read_only) {
+    release();
+
+    if (!file.open(path, read_only ? MappedFile::READ_ONLY : MappedFile::READ_WRITE))
+        return false;
+    memory = file.data();
+
+    const CheckpointHeader* header = (const CheckpointHeader*)memory;
+    if (file.size() < sizeof(CheckpointHeader) ||
+        memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header->version != CHECKPOINT_VERSION ||
+        file.size() < buffer_size(header->width * header->height)) {
+        release();
+        return false;
+    }
+
+    width = header->width;
+    height = header->height;
+    samples = header->samples;
+    bounces = header->bounces;
+    seed = header->seed;
+    first_sample = header->first_sample;
+    split_index = header->split_index;
+    split_count = header->split_count;
+    assign_pointers();
+    if (read_only)
+        return true;
+
+    // Pixels interrupted in the middle of an update are started over from their first sample
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        if (counts[i] & PIXEL_BUSY)
+            reset_pixel(i);
+    }
+    return true;
+}
+
+void Framebuffer::enable_cost_map(CostMetric metric) {
+    cost_storage.assign(pixel_count(), 0);
+    cost = cost_storage.data();
+    cost_metric = metric;
+}
+
+void Framebuffer::flush() {
+    file.flush();
+}
+
+void Framebuffer::release() {
+    if (!memory)
+        return;
+
+    if (file.is_open())
+        file.close(); // flushes the mapped pages
+    else
+        free_pages(memory, memory_size);
+
+    memory = nullptr;
+    accum = nullptr;
+    counts = nullptr;
+    cost = nullptr;
+    cost_storage.clear();
+}
+
+void Framebuffer::begin_pixel(uint32_t index) {
+    counts[index] |= PIXEL_BUSY;
+    // The busy mark has to reach memory before any of the pixel data does
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+void Framebuffer::end_pixel(uint32_t index, Vec3_simd sum, uint32_t new_samples) {
+    accum[3 * index + 0] += sum.x;
+    accum[3 * index + 1] += sum.y;
+    accum[3 * index + 2] += sum.z;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    counts[index] = (counts[index] & ~PIXEL_BUSY) + new_samples;
+}
+
+void Framebuffer::store_pixel(uint32_t index, const float* sum, uint32_t count) {
+    begin_pixel(index);
+    accum[3 * index + 0] = sum[0];
+    accum[3 * index + 1] = sum[1];
+    accum[3 * index + 2] = sum[2];
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    counts[index] = count & ~PIXEL_BUSY;
+}
+
+void Framebuffer::reset_pixels(const uint8_t* mask) {
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        if (!mask[i])
+            continue;
+        // Busy while the sums are cleared, like any other update
+        begin_pixel(i);
+        accum[3 * i + 0] = 0.0f;
+        accum[3 * i + 1] = 0.0f;
+        accum[3 * i + 2] = 0.0f;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        counts[i] = 0;
+    }
+}
+
+uint32_t Framebuffer::finished_pixels() const {
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        if (counts[i] >= samples && !(counts[i] & PIXEL_BUSY))
+            done++;
+    }
+    return done;
+}
+
+uint64_t Framebuffer::hash() const {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    const uint8_t* bytes = (const uint8_t*)accum;
+    size_t size = buffer_size(pixel_count()) - accum_offset(); // sums and counts are contiguous
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void Framebuffer::resolve(uint8_t* image, uint32_t stride) const {
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        uint32_t count = counts[i] & ~PIXEL_BUSY;
+        float inv_count = count ? 1.0f / count : 0.0f;
+        uint8_t* pixel = image + stride * i;
+
+        pixel[0] = static_cast<uint8_t>(saturate(accum[3 * i + 0] * inv_count) * 255.0f);
+        pixel[1] = static_cast<uint8_t>(saturate(accum[3 * i + 1] * inv_count) * 255.0f);
+        pixel[2] = static_cast<uint8_t>(saturate(accum[3 * i + 2] * inv_count) * 255.0f);
+    }
+}
+
+uint64_t Framebuffer::resolve_cost(uint8_t* image, uint32_t stride) const {
+    std::vector<uint64_t> sorted(cost, cost + pixel_count());
+    size_t percentile = sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+    uint64_t scale = std::max<uint64_t>(sorted[percentile], 1);
+
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        // 0..3 over the black - red - yellow - white ramp
+        float t = 3.0f * std::min(1.0f, (float)cost[i] / scale);
+        uint8_t* pixel = image + stride * i;
+        pixel[0] = static_cast<uint8_t>(saturate(t) * 255.0f);
+        pixel[1] = static_cast<uint8_t>(saturate(t - 1.0f) * 255.0f);
+        pixel[2] = static_cast<uint8_t>(saturate(t - 2.0f) * 255.0f);
+    }
+    return scale;
+}
+
+void Framebuffer::add(const Framebuffer& other) {
+    for (uint32_t i = 0; i < pixel_count(); ++i) {
+        uint32_t count = other.counts[i];
+        if (count & PIXEL_BUSY)
+            continue;
+        accum[3 * i + 0] += other.accum[3 * i + 0];
+        accum[3 * i + 1] += other.accum[3 * i + 1];
+        accum[3 * i + 2] += other.accum[3 * i + 2];
+        counts[i] += count;
+    }
+}
+
+uint32_t split_samples(uint32_t samples, uint32_t split_index, uint32_t split_count) {
+    return samples / split_count + (split_index < samples % split_count ? 1 : 0);
+}
+
+uint32_t split_first_sample(uint32_t samples, uint32_t split_index, uint32_t split_count) {
+    uint32_t extra = samples % split_count; // the first `extra` parts render one sample more
+    return split_index * (samples / split_count) + (split_index < extra ? split_index : extra);
+}
+
+bool merge_partials(const std::vector<std::string>& paths, const char* output_path, Framebuffer& merged) {
+    std::vector<Framebuffer> parts(paths.size());
+    uint32_t total_samples = 0;
+    uint32_t first_sample = 0xFFFFFFFFu;
+    std::vector<bool> seen;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        Framebuffer& part = parts[i];
+        if (!part.open_mapped(paths[i].c_str(), true)) {
+            printf("Nie mozna otworzyc czesciowego renderu: %s\n", paths[i].c_str());
+            return false;
+        }
+        if (part.width != parts[0].width || part.height != parts[0].height || part.split_count != parts[0].split_count) {
+            printf("%s: inna rozdzielczosc lub podzial niz %s\n", paths[i].c_str(), paths[0].c_str());
+            return false;
+        }
+        // Other bounces give another image, another seed overlapping random number streams
+        if (part.bounces != parts[0].bounces || part.seed != parts[0].seed) {
+            printf("%s: inna liczba odbic lub ziarno niz %s\n", paths[i].c_str(), paths[0].c_str());
+            return false;
+        }
+
+        // The same part twice would count its samples twice
+        seen.resize(part.split_count, false);
+        if (part.split_index >= part.split_count || seen[part.split_index]) {
+            printf("%s: czesc %u/%u powtorzona lub bledna\n", paths[i].c_str(), part.split_index + 1, part.split_count);
+            return false;
+        }
+        seen[part.split_index] = true;
+
+        uint32_t finished = part.finished_pixels();
+        if (finished < part.pixel_count())
+            printf("UWAGA: %s ma %u / %u gotowych pikseli\n", paths[i].c_str(), finished, part.pixel_count());
+        total_samples += part.samples;
+        first_sample = std::min(first_sample, part.first_sample);
+    }
+
+    if (parts.size() < parts[0].split_count)
+        printf("UWAGA: polaczono %u z %u czesci\n", (uint32_t)parts.size(), parts[0].split_count);
+
+    const Framebuffer& first = parts[0];
+    bool ready = output_path
+        ? merged.create_mapped(output_path, first.width, first.height, total_samples, first.bounces, first.seed, first_sample)
+        : merged.create(first.width, first.height, total_samples, first.bounces, first.seed, first_sample);
+    if (!ready)
+        return false;
+
+    for (const Framebuffer& part : parts)
+        merged.add(part);
+    return true;
+}
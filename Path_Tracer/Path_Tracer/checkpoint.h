@@ -0,0 +1,113 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include "mapped_file.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Set in a pixel's sample count while its accumulation is being updated.
+// A pixel still marked busy after a crash is reset and rendered again on resume.
+const uint32_t PIXEL_BUSY = 0x80000000u;
+
+// Header at the start of a checkpoint file
+struct CheckpointHeader {
+    char magic[8];          // "PTCKPT\0\0"
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;       // target samples per pixel
+    uint32_t bounces;
+    uint32_t first_sample;  // sample index of the first sample in this buffer (split parts)
+    uint64_t seed;          // render seed, random numbers are keyed on it
+    uint32_t split_index;   // which part of a frame split by sample index (--split)
+    uint32_t split_count;   // 1 for a whole frame
+    uint8_t _reserved[16];  // keeps the pixel arrays 64-byte aligned
+};
+
+// Float accumulation buffer with per-pixel sample counts.
+// Lives either in memory or in a memory-mapped checkpoint file, in which case
+// every finished pixel is already part of the checkpoint and flush() only makes it durable.
+class Framebuffer {
+public:
+    enum CostMetric { COST_CYCLES, COST_RAYS };
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t samples = 0;
+    uint32_t bounces = 0;
+    uint64_t seed = 0;
+    uint32_t first_sample = 0;
+    uint32_t split_index = 0;
+    uint32_t split_count = 1;
+
+    float* accum = nullptr;     // RGB sums, 3 floats per pixel
+    uint32_t* counts = nullptr; // completed samples per pixel
+    uint64_t* cost = nullptr;   // render cost per pixel, only after enable_cost_map()
+    CostMetric cost_metric = COST_CYCLES;
+
+    Framebuffer() = default;
+    Framebuffer(const Framebuffer&) = delete;
+    Framebuffer& operator=(const Framebuffer&) = delete;
+    ~Framebuffer() { release(); }
+
+    // In-memory buffer, no checkpointing
+    bool create(uint32_t width, uint32_t height, uint32_t samples, uint32_t bounces, uint64_t seed,
+        uint32_t first_sample = 0, uint32_t split_index = 0, uint32_t split_count = 1);
+    // New checkpoint file (overwrites an existing one)
+    bool create_mapped(const char* path, uint32_t width, uint32_t height, uint32_t samples, uint32_t bounces, uint64_t seed,
+        uint32_t first_sample = 0, uint32_t split_index = 0, uint32_t split_count = 1);
+    // Reopen a checkpoint file written by create_mapped() and continue from it.
+    // A read-only buffer is left as it is, pixels interrupted mid-update keep their busy mark.
+    bool open_mapped(const char* path, bool read_only = false);
+
+    // Measure what every pixel costs to render from now on (kept in memory, not in the checkpoint)
+    void enable_cost_map(CostMetric metric);
+
+    // Write the mapped pages to disk (no-op for in-memory buffers)
+    void flush();
+    void release();
+
+    // Pixel update protocol: begin_pixel() marks the pixel busy, end_pixel() adds the new
+    // samples and clears the mark, so an interrupted update is never mistaken for a finished one
+    void begin_pixel(uint32_t index);
+    void end_pixel(uint32_t index, Vec3_simd sum, uint32_t new_samples);
+    // Replace a pixel's state with one rendered elsewhere (distributed rendering)
+    void store_pixel(uint32_t index, const float* sum, uint32_t count);
+    // Drop the samples of every pixel whose `mask` entry is nonzero, so they are rendered again
+    void reset_pixels(const uint8_t* mask);
+
+    uint32_t pixel_count() const { return width * height; }
+    // Pixels that already have all their samples
+    uint32_t finished_pixels() const;
+    // 64-bit FNV-1a of the accumulated sums and sample counts, equal for equal renders
+    uint64_t hash() const;
+
+    // Add another render of the same frame: sums and sample counts add up, so the result is
+    // the sample-count weighted average of both. Busy pixels of `other` are skipped.
+    void add(const Framebuffer& other);
+
+    // Average the accumulated samples into an 8-bit RGB image
+    void resolve(uint8_t* image, uint32_t stride) const;
+    // Cost map as a heatmap (black - red - yellow - white), scaled to the 99th percentile
+    // so a few extreme pixels do not wash out the rest. Returns that scale.
+    uint64_t resolve_cost(uint8_t* image, uint32_t stride) const;
+
+private:
+    void* memory = nullptr;     // pages from the OS, or the data of `file`
+    size_t memory_size = 0;
+    MappedFile file;
+    std::vector<uint64_t> cost_storage;
+
+    void assign_pointers();
+    void reset_pixel(uint32_t index);
+};
+
+// Samples of part `split_index` of `split_count`: the parts cover consecutive sample index
+// ranges that add up to `samples`, so together they render exactly the unsplit frame
+uint32_t split_samples(uint32_t samples, uint32_t split_index, uint32_t split_count);
+uint32_t split_first_sample(uint32_t samples, uint32_t split_index, uint32_t split_count);
+
+// Combine partial renders of one frame split by sample index into `merged`
+// (in memory, or in a new checkpoint file when `output_path` is given)
+bool merge_partials(const std::vector<std::string>& paths, const char* output_path, Framebuffer& merged);
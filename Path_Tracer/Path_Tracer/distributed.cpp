@@ -0,0 +1,476 @@
+#include "distributed.h"
+#include "net.h"
+#include "render.h"
+#include "scene_cache.h"
+#include "arena.h"
+#include "topology.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#include <spawn.h>
+extern char** environ;
+#endif
+
+namespace {
+
+// ---------------------------------------------------------------------------
+// Protocol
+
+const uint32_t PROTOCOL_MAGIC = 0x57445450; // "PTDW"
+const uint32_t PROTOCOL_VERSION = 2;
+
+enum MessageType : uint32_t {
+    MSG_HELLO = 1,      // worker -> coordinator: HelloMessage
+    MSG_JOB,            // coordinator -> worker: JobMessage
+    MSG_TILE,           // coordinator -> worker: TileMessage
+    MSG_RESULT,         // worker -> coordinator: ResultHeader + sums + counts
+    MSG_DONE            // coordinator -> worker: no more work (or worker rejected)
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;      // payload bytes following the header
+};
+
+struct HelloMessage {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t scene_hash;
+};
+
+struct JobMessage {
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;
+    uint32_t bounces;
+    uint32_t tile_size;
+    uint32_t first_sample;
+    uint64_t seed;
+};
+
+struct TileMessage {
+    uint32_t tile_index;
+};
+
+struct ResultHeader {
+    uint32_t tile_index;
+    uint32_t pixel_count;
+};
+
+// ---------------------------------------------------------------------------
+// Messages
+
+bool send_message(socket_t s, uint32_t type, const void* payload, uint32_t size) {
+    MessageHeader header = { type, size };
+    return send_all(s, &header, sizeof(header)) && (size == 0 || send_all(s, payload, size));
+}
+
+// Receive a message with a fixed-size payload of the expected type
+bool recv_message(socket_t s, uint32_t type, void* payload, uint32_t size) {
+    MessageHeader header;
+    if (!recv_all(s, &header, sizeof(header)) || header.type != type || header.size != size)
+        return false;
+    return size == 0 || recv_all(s, payload, size);
+}
+
+// ---------------------------------------------------------------------------
+// Local worker processes
+
+#ifdef _WIN32
+typedef HANDLE process_t;
+#else
+typedef pid_t process_t;
+#endif
+
+bool spawn_process(const std::vector<std::string>& args, process_t& process) {
+#ifdef _WIN32
+    char executable[MAX_PATH];
+    GetModuleFileNameA(NULL, executable, MAX_PATH);
+    std::string command_line = std::string("\"") + executable + "\"";
+    for (size_t i = 1; i < args.size(); ++i)
+        command_line += " \"" + args[i] + "\"";
+
+    STARTUPINFOA startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION info;
+    if (!CreateProcessA(executable, &command_line[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &info))
+        return false;
+    CloseHandle(info.hThread);
+    process = info.hProcess;
+    return true;
+#else
+    std::vector<char*> argv;
+    for (const std::string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    return posix_spawnp(&process, argv[0], nullptr, nullptr, argv.data(), environ) == 0;
+#endif
+}
+
+void wait_process(process_t process) {
+#ifdef _WIN32
+    WaitForSingleObject(process, INFINITE);
+    CloseHandle(process);
+#else
+    int status;
+    waitpid(process, &status, 0);
+#endif
+}
+
+// Scene options of the coordinator's command line, passed on to local workers
+std::vector<std::string> scene_arguments(int argc, const char* argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "--scene") == 0 || strcmp(argv[i], "--scene-cache") == 0) && i + 1 < argc) {
+            args.push_back(argv[i]);
+            args.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--no-scene-cache") == 0) {
+            args.push_back(argv[i]);
+        }
+    }
+    return args;
+}
+
+// ---------------------------------------------------------------------------
+// Coordinator
+
+// Tiles waiting to be rendered. Tiles of lost workers go back to the front.
+class TileQueue {
+public:
+    explicit TileQueue(const std::vector<uint32_t>& tiles)
+        : pending(tiles.begin(), tiles.end()), remaining((uint32_t)tiles.size()) {}
+
+    // Wait for a tile; false once every tile is finished
+    bool pop(uint32_t& tile) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return !pending.empty() || remaining == 0; });
+        if (remaining == 0)
+            return false;
+        tile = pending.front();
+        pending.pop_front();
+        return true;
+    }
+
+    void requeue(uint32_t tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_front(tile);
+        changed.notify_one();
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining--;
+        if (remaining == 0)
+            changed.notify_all();
+    }
+
+    uint32_t left() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return remaining;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<uint32_t> pending;
+    uint32_t remaining;
+};
+
+struct Coordinator {
+    const RenderSettings& settings;
+    Framebuffer& framebuffer;
+    TileQueue queue;
+    JobMessage job;
+    uint64_t scene_hash;
+
+    std::mutex connections_mutex;
+    std::set<socket_t> connections;
+    std::atomic<uint32_t> workers_lost{ 0 };
+
+    Coordinator(const RenderSettings& s, Framebuffer& fb, const std::vector<uint32_t>& tiles)
+        : settings(s), framebuffer(fb), queue(tiles) {}
+
+    void serve(socket_t s);
+    bool receive_result(socket_t s, uint32_t tile_index, std::vector<uint8_t>& buffer);
+};
+
+bool Coordinator::receive_result(socket_t s, uint32_t tile_index, std::vector<uint8_t>& buffer) {
+    Tile tile = tile_rect(tile_index, framebuffer.width, framebuffer.height, job.tile_size);
+    uint32_t pixel_count = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    uint32_t payload = sizeof(ResultHeader) + pixel_count * (3 * sizeof(float) + sizeof(uint32_t));
+
+    MessageHeader header;
+    if (!recv_all(s, &header, sizeof(header)) || header.type != MSG_RESULT || header.size != payload)
+        return false;
+    buffer.resize(payload);
+    if (!recv_all(s, buffer.data(), payload))
+        return false;
+
+    ResultHeader result;
+    memcpy(&result, buffer.data(), sizeof(result));
+    if (result.tile_index != tile_index || result.pixel_count != pixel_count)
+        return false;
+
+    const uint8_t* data = buffer.data() + sizeof(ResultHeader);
+    const float* sums = (const float*)data;
+    const uint32_t* counts = (const uint32_t*)(data + pixel_count * 3 * sizeof(float));
+
+    // Store only after the whole tile arrived, a broken transfer leaves the framebuffer untouched
+    uint32_t i = 0;
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x, ++i) {
+            framebuffer.store_pixel(x + y * framebuffer.width, &sums[3 * i], counts[i]);
+        }
+    }
+    return true;
+}
+
+void Coordinator::serve(socket_t s) {
+    set_receive_timeout(s, settings.worker_timeout);
+
+    HelloMessage hello;
+    if (!recv_message(s, MSG_HELLO, &hello, sizeof(hello)) ||
+        hello.magic != PROTOCOL_MAGIC || hello.version != PROTOCOL_VERSION) {
+        return;
+    }
+    if (hello.scene_hash != scene_hash) {
+        printf("\nOdrzucono workera z inna scena\n");
+        send_message(s, MSG_DONE, nullptr, 0);
+        return;
+    }
+    if (!send_message(s, MSG_JOB, &job, sizeof(job)))
+        return;
+
+    std::vector<uint8_t> buffer;
+    uint32_t tile_index;
+    while (queue.pop(tile_index)) {
+        TileMessage tile = { tile_index };
+        if (!send_message(s, MSG_TILE, &tile, sizeof(tile)) || !receive_result(s, tile_index, buffer)) {
+            // Worker lost: somebody else renders the tile
+            queue.requeue(tile_index);
+            workers_lost++;
+            return;
+        }
+        queue.finish();
+    }
+    send_message(s, MSG_DONE, nullptr, 0);
+}
+
+} // namespace
+
+bool run_coordinator(const RenderSettings& settings, const Scene& scene, Framebuffer& framebuffer,
+    int argc, const char* argv[]) {
+    if (!net_startup())
+        return false;
+
+    // Only tiles with missing pixels are handed out (a resumed checkpoint may have some done)
+    std::vector<uint32_t> tiles;
+    uint32_t total_tiles = tile_count(framebuffer.width, framebuffer.height, settings.tile_size);
+    for (uint32_t t = 0; t < total_tiles; ++t) {
+        Tile tile = tile_rect(t, framebuffer.width, framebuffer.height, settings.tile_size);
+        bool missing = false;
+        for (uint32_t y = tile.y0; y < tile.y1 && !missing; ++y)
+            for (uint32_t x = tile.x0; x < tile.x1 && !missing; ++x)
+                missing = framebuffer.counts[x + y * framebuffer.width] < framebuffer.samples;
+        if (missing)
+            tiles.push_back(t);
+    }
+
+    Coordinator coordinator(settings, framebuffer, tiles);
+    coordinator.job = { framebuffer.width, framebuffer.height, framebuffer.samples, framebuffer.bounces, settings.tile_size, framebuffer.first_sample, framebuffer.seed };
+    coordinator.scene_hash = hash_scene(scene);
+
+    socket_t listener = open_socket(settings.coordinator_address, true);
+    if (listener == INVALID_SOCKET_HANDLE) {
+        printf("Nie mozna nasluchiwac na %s\n", settings.coordinator_address.c_str());
+        return false;
+    }
+    printf("Koordynator nasluchuje na %s (%u fragmentow do wyrenderowania)\n", settings.coordinator_address.c_str(), (uint32_t)tiles.size());
+
+    // Local workers split the machine's threads between them
+    std::vector<process_t> processes;
+    if (settings.local_workers > 0) {
+        uint32_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        uint32_t threads = settings.threads ? settings.threads : std::max(1u, hardware_threads / settings.local_workers);
+        std::vector<std::string> args = { argv[0], "--worker", local_address(settings.coordinator_address), "--threads", std::to_string(threads) };
+        for (const std::string& arg : scene_arguments(argc, argv))
+            args.push_back(arg);
+        if (settings.generic_kernel)
+            args.push_back("--generic-kernel");
+        if (settings.fast_math)
+            args.push_back("--fast-math");
+
+        for (uint32_t i = 0; i < settings.local_workers; ++i) {
+            process_t process;
+            if (spawn_process(args, process))
+                processes.push_back(process);
+            else
+                printf("Nie udalo sie uruchomic lokalnego workera\n");
+        }
+    }
+
+    std::vector<std::thread> handlers;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    uint32_t left;
+    while ((left = coordinator.queue.left()) > 0) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        timeval timeout = { 0, 200000 };
+        if (select((int)listener + 1, &readable, nullptr, nullptr, &timeout) > 0) {
+            socket_t s = accept(listener, nullptr, nullptr);
+            if (s != INVALID_SOCKET_HANDLE) {
+                std::lock_guard<std::mutex> lock(coordinator.connections_mutex);
+                coordinator.connections.insert(s);
+                handlers.emplace_back([&coordinator, s]() {
+                    coordinator.serve(s);
+                    std::lock_guard<std::mutex> lock(coordinator.connections_mutex);
+                    coordinator.connections.erase(s);
+                    close_socket(s);
+                });
+            }
+        }
+
+        if (settings.progress) {
+            uint32_t done = (uint32_t)tiles.size() - left;
+            printf("\rProgress: %.2f%% (%u / %u tiles)", 100.0f * done / std::max(1u, (uint32_t)tiles.size()), done, (uint32_t)tiles.size());
+            fflush(stdout);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (!settings.checkpoint_path.empty() && now - last_checkpoint >= std::chrono::seconds(settings.checkpoint_interval)) {
+            framebuffer.flush();
+            last_checkpoint = now;
+        }
+    }
+
+    close_socket(listener);
+    if (is_unix_address(settings.coordinator_address)) {
+#ifdef _WIN32
+        DeleteFileA(settings.coordinator_address.substr(5).c_str());
+#else
+        unlink(settings.coordinator_address.substr(5).c_str());
+#endif
+    }
+
+    // Idle handlers already got DONE, wake up the ones still waiting on a worker
+    {
+        std::lock_guard<std::mutex> lock(coordinator.connections_mutex);
+        for (socket_t s : coordinator.connections)
+            shutdown_socket(s);
+    }
+    for (std::thread& handler : handlers)
+        handler.join();
+    for (process_t process : processes)
+        wait_process(process);
+
+    if (coordinator.workers_lost > 0)
+        printf("\nUtracono %u polaczen z workerami, ich fragmenty zostaly przydzielone ponownie\n", coordinator.workers_lost.load());
+    return true;
+}
+
+bool run_worker(const RenderSettings& settings, Scene& scene) {
+    if (!net_startup())
+        return false;
+
+    const uint64_t scene_hash = hash_scene(scene);
+    const uint32_t num_threads = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<uint32_t> tiles_rendered(0);
+    std::atomic<bool> failed(false);
+    const ThreadPlacement placement(pin_policy(settings.pin), num_threads);
+
+    // One connection per render thread, each renders one tile at a time
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            char thread_name[32];
+            snprintf(thread_name, sizeof(thread_name), "worker %u", t);
+            trace_thread_name(thread_name);
+            placement.pin(t);
+
+            // The coordinator may still be starting up
+            socket_t s = INVALID_SOCKET_HANDLE;
+            for (int attempt = 0; attempt < 50 && s == INVALID_SOCKET_HANDLE; ++attempt) {
+                s = open_socket(settings.worker_address, false);
+                if (s == INVALID_SOCKET_HANDLE)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (s == INVALID_SOCKET_HANDLE) {
+                failed = true;
+                return;
+            }
+
+            HelloMessage hello = { PROTOCOL_MAGIC, PROTOCOL_VERSION, scene_hash };
+            MessageHeader header;
+            JobMessage job;
+            if (!send_message(s, MSG_HELLO, &hello, sizeof(hello)) ||
+                !recv_all(s, &header, sizeof(header)) || header.type != MSG_JOB || header.size != sizeof(job) ||
+                !recv_all(s, &job, sizeof(job))) {
+                failed = true;
+                close_socket(s);
+                return;
+            }
+
+            const Camera camera(scene.camera, job.width, job.height);
+            const RenderKernel kernel = render_kernel(scene);
+            TileMessage message;
+            while (recv_all(s, &header, sizeof(header)) && header.type == MSG_TILE && header.size == sizeof(message) &&
+                recv_all(s, &message, sizeof(message))) {
+                Tile tile = tile_rect(message.tile_index, job.width, job.height, job.tile_size);
+                uint32_t pixel_count = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+                uint32_t message_size = sizeof(ResultHeader) + pixel_count * (3 * sizeof(float) + sizeof(uint32_t));
+                ScratchScope scratch;   // the result message, given back after it is sent
+                uint8_t* buffer = scratch.allocate<uint8_t>(message_size);
+
+                ResultHeader result = { message.tile_index, pixel_count };
+                memcpy(buffer, &result, sizeof(result));
+                uint8_t* data = buffer + sizeof(ResultHeader);
+                float* sums = (float*)data;
+                uint32_t* counts = (uint32_t*)(data + pixel_count * 3 * sizeof(float));
+
+                // Same samples as a local render of the pixel
+                TraceScope trace("tile", (int32_t)tile.x0, (int32_t)tile.y0);
+                RenderStats stats_before = stats_snapshot();
+                uint32_t i = 0;
+                for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+                    for (uint32_t x = tile.x0; x < tile.x1; ++x, ++i) {
+                        Vec3_simd color = kernel(x, y, camera, job.bounces, job.first_sample, job.samples, scene, job.seed);
+                        sums[3 * i + 0] = color.x;
+                        sums[3 * i + 1] = color.y;
+                        sums[3 * i + 2] = color.z;
+                        counts[i] = job.samples;
+                    }
+                }
+                stats_record_tile(tile.x0, tile.y0, tile.x1, tile.y1, stats_before);
+
+                if (!send_message(s, MSG_RESULT, buffer, message_size))
+                    break;
+                tiles_rendered++;
+            }
+            close_socket(s);
+        });
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    printf("Worker zakonczyl prace: %u fragmentow wyrenderowanych\n", tiles_rendered.load());
+    return !failed;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "objects.h"
+#include "checkpoint.h"
+#include "settings.h"
+
+// Distributed tile rendering.
+//
+// The coordinator listens on a TCP port ("<port>" or "<host>:<port>") or a Unix socket
+// ("unix:<path>") and hands out tiles. Every worker connection renders one tile at a time
+// and streams back the float accumulation and sample counts of its pixels, which the
+// coordinator stores in its framebuffer. A tile whose worker
+// disconnects or stops answering is put back in the queue and given to another worker.
+//
+// Workers render the scene from their own command line; the coordinator checks that it
+// hashes to the same contents before handing out any work. Both sides must be little-endian.
+
+// Render the framebuffer's missing tiles on remote workers. With `local_workers` > 0 that
+// many worker processes of this executable are started on this machine (argv is used to
+// pass the scene options on to them). Returns when every tile is done.
+bool run_coordinator(const RenderSettings& settings, const Scene& scene, Framebuffer& framebuffer,
+    int argc, const char* argv[]);
+
+// Connect to a coordinator and render tiles until it has no work left.
+// Opens one connection per render thread.
+bool run_worker(const RenderSettings& settings, Scene& scene);
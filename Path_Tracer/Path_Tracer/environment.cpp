@@ -0,0 +1,291 @@
+#include "environment.h"
+#include "mapped_file.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+static const float ENV_PI = 3.14159265f;
+
+namespace {
+
+// Reads the scanlines of a Radiance picture: flat RGBE, old-style run-length ("1 1 1 n")
+// and the usual adaptive run-length encoding, which stores the four channels separately
+class HdrReader {
+public:
+    HdrReader(const uint8_t* data, size_t size) : pos(data), end(data + size) {}
+
+    // Header lines up to the empty line, then the resolution string
+    bool read_header(uint32_t& width, uint32_t& height) {
+        std::string line;
+        if (!read_line(line) || line.compare(0, 2, "#?") != 0)
+            return false;
+        while (read_line(line) && !line.empty()) {
+            if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+                return false;   // XYZE and other formats
+        }
+        int h, w;
+        char extra;
+        if (!read_line(line) || sscanf(line.c_str(), "-Y %d +X %d %c", &h, &w, &extra) != 2 || w <= 0 || h <= 0)
+            return false;   // only the standard orientation, top to bottom, left to right
+        width = (uint32_t)w;
+        height = (uint32_t)h;
+        return true;
+    }
+
+    bool read_scanline(uint8_t* rgbe, uint32_t width) {
+        if (end - pos < 4)
+            return false;
+        bool adaptive = width >= 8 && width < 0x8000 && pos[0] == 2 && pos[1] == 2 && ((pos[2] << 8) | pos[3]) == (int)width;
+        if (!adaptive)
+            return read_flat(rgbe, width);
+
+        pos += 4;
+        for (uint32_t channel = 0; channel < 4; ++channel) {
+            for (uint32_t x = 0; x < width;) {
+                if (pos >= end)
+                    return false;
+                uint32_t count = *pos++;
+                if (count > 128) {
+                    count -= 128;
+                    if (count > width - x || pos >= end)
+                        return false;
+                    uint8_t value = *pos++;
+                    for (; count; --count)
+                        rgbe[4 * x++ + channel] = value;
+                }
+                else {
+                    if (count == 0 || count > width - x || (size_t)(end - pos) < count)
+                        return false;
+                    for (; count; --count)
+                        rgbe[4 * x++ + channel] = *pos++;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    bool read_line(std::string& line) {
+        line.clear();
+        while (pos < end && *pos != '\n')
+            line += (char)*pos++;
+        if (pos >= end)
+            return false;
+        pos++;
+        return true;
+    }
+
+    bool read_flat(uint8_t* rgbe, uint32_t width) {
+        uint32_t shift = 0;
+        for (uint32_t x = 0; x < width;) {
+            if (end - pos < 4)
+                return false;
+            if (pos[0] == 1 && pos[1] == 1 && pos[2] == 1) {
+                // Repeat the previous pixel, counts of consecutive repeats are shifted
+                uint32_t count = (uint32_t)pos[3] << shift;
+                if (x == 0 || count > width - x)
+                    return false;
+                for (; count; --count, ++x)
+                    memcpy(rgbe + 4 * x, rgbe + 4 * (x - 1), 4);
+                shift += 8;
+            }
+            else {
+                memcpy(rgbe + 4 * x++, pos, 4);
+                shift = 0;
+            }
+            pos += 4;
+        }
+        return true;
+    }
+
+    const uint8_t* pos;
+    const uint8_t* end;
+};
+
+inline float luminance(Vec3_simd c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+} // namespace
+
+bool EnvironmentMap::load(const char* path, float scale) {
+    MappedFile file;
+    if (!file.open(path, MappedFile::READ_ONLY)) {
+        printf("Nie mozna otworzyc mapy otoczenia: %s\n", path);
+        return false;
+    }
+
+    HdrReader reader((const uint8_t*)file.data(), file.size());
+    uint32_t width, height;
+    if (!reader.read_header(width, height)) {
+        printf("Nieobslugiwany format mapy otoczenia (oczekiwany Radiance .hdr, -Y h +X w): %s\n", path);
+        return false;
+    }
+
+    std::vector<uint8_t> rgbe(4 * (size_t)width);
+    texels.assign((size_t)(width + 1) * height, Vec3_simd());
+    for (uint32_t y = 0; y < height; ++y) {
+        if (!reader.read_scanline(rgbe.data(), width)) {
+            printf("Uszkodzona mapa otoczenia: %s\n", path);
+            return false;
+        }
+        Vec3_simd* row = &texels[(size_t)y * (width + 1)];
+        for (uint32_t x = 0; x < width; ++x) {
+            const uint8_t* p = &rgbe[4 * x];
+            if (p[3] == 0)
+                continue;
+            float f = ldexpf(scale, (int)p[3] - (128 + 8));
+            row[x] = Vec3_simd((p[0] + 0.5f) * f, (p[1] + 0.5f) * f, (p[2] + 0.5f) * f);
+        }
+        row[width] = row[0];
+    }
+
+    map_width = width;
+    map_height = height;
+    build_distribution();
+    return true;
+}
+
+void EnvironmentMap::build_distribution() {
+    const uint32_t w = map_width, h = map_height;
+    const size_t count = (size_t)w * h;
+
+    // Bilinear lookups blend a texel with its neighbours, so a texel is weighted by the
+    // brightest texel around it: wherever the filtered map is not black, the density is not 0
+    std::vector<float> lum(count);
+    for (uint32_t y = 0; y < h; ++y)
+        for (uint32_t x = 0; x < w; ++x)
+            lum[(size_t)y * w + x] = luminance(texels[(size_t)y * (w + 1) + x]);
+
+    std::vector<double> weight(count);
+    double total = 0.0;
+    for (uint32_t y = 0; y < h; ++y) {
+        // Texels near the poles cover less solid angle
+        double sin_theta = sin(ENV_PI * (y + 0.5) / h);
+        uint32_t y0 = y > 0 ? y - 1 : 0;
+        uint32_t y1 = y + 1 < h ? y + 1 : h - 1;
+        for (uint32_t x = 0; x < w; ++x) {
+            uint32_t xs[3] = { x > 0 ? x - 1 : w - 1, x, x + 1 < w ? x + 1 : 0 };
+            float brightest = 0.0f;
+            for (uint32_t ny = y0; ny <= y1; ++ny)
+                for (uint32_t nx : xs)
+                    brightest = std::max(brightest, lum[(size_t)ny * w + nx]);
+            weight[(size_t)y * w + x] = brightest * sin_theta;
+            total += weight[(size_t)y * w + x];
+        }
+    }
+
+    table.clear();
+    if (!(total > 0.0))
+        return;     // black map, nothing to sample
+
+    // Vose's alias method: split the texels into under- and overfull ones and let every
+    // underfull texel take the rest of its slot from an overfull one
+    table.resize(count);
+    std::vector<double> scaled(count);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < count; ++i) {
+        scaled[i] = weight[i] * count / total;
+        table[i].pdf = (float)scaled[i];    // probability * count = density over the unit square
+        (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();
+        small.pop_back();
+        uint32_t l = large.back();
+        table[s].threshold = (float)scaled[s];
+        table[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is full up to rounding
+    for (uint32_t i : large) {
+        table[i].threshold = 1.0f;
+        table[i].alias = i;
+    }
+    for (uint32_t i : small) {
+        table[i].threshold = 1.0f;
+        table[i].alias = i;
+    }
+    for (AliasEntry& entry : table)
+        entry.alias_pdf = table[entry.alias].pdf;
+}
+
+Vec3_simd EnvironmentMap::filtered(float u, float v) const {
+    float fx = u * map_width - 0.5f;
+    float fy = v * map_height - 0.5f;
+    float x_floor = floorf(fx);
+    float y_floor = floorf(fy);
+    float tx = fx - x_floor;
+    float ty = fy - y_floor;
+
+    int x0 = (int)x_floor;
+    if (x0 < 0)
+        x0 += map_width;    // left of the first texel center: blend with the last column
+    else if (x0 >= (int)map_width)
+        x0 = map_width - 1;
+    int y0 = (int)y_floor;
+    int y1 = y0 + 1;
+    if (y0 < 0)
+        y0 = 0;
+    if (y1 >= (int)map_height)
+        y1 = map_height - 1;
+    if (y0 >= (int)map_height)
+        y0 = map_height - 1;
+
+    // x0 + 1 is at most map_width, the padding copy of the first column
+    const Vec3_simd* row0 = &texels[(size_t)y0 * (map_width + 1) + x0];
+    const Vec3_simd* row1 = &texels[(size_t)y1 * (map_width + 1) + x0];
+    __m128 wx1 = _mm_set1_ps(tx);
+    __m128 top = _mm_fmadd_ps(_mm_sub_ps(row0[1].simd, row0[0].simd), wx1, row0[0].simd);
+    __m128 bottom = _mm_fmadd_ps(_mm_sub_ps(row1[1].simd, row1[0].simd), wx1, row1[0].simd);
+    return Vec3_simd(_mm_fmadd_ps(_mm_sub_ps(bottom, top), _mm_set1_ps(ty), top));
+}
+
+Vec3_simd EnvironmentMap::eval(Vec3_simd dir, float& pdf) const {
+    float cos_theta = -dir.y;
+    cos_theta = cos_theta > 1.0f ? 1.0f : (cos_theta < -1.0f ? -1.0f : cos_theta);
+    float u = 0.5f + atan2f(dir.x, dir.z) * (0.5f / ENV_PI);
+    float v = acosf(cos_theta) * (1.0f / ENV_PI);
+
+    pdf = 0.0f;
+    float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+    if (!table.empty() && sin_theta > 0.0f) {
+        uint32_t x = std::min((uint32_t)(u * map_width), map_width - 1);
+        uint32_t y = std::min((uint32_t)(v * map_height), map_height - 1);
+        // Unit square of image coordinates to solid angle: d(omega) = 2 pi^2 sin(theta) du dv
+        pdf = table[(size_t)y * map_width + x].pdf / (2.0f * ENV_PI * ENV_PI * sin_theta);
+    }
+    return filtered(u, v);
+}
+
+bool EnvironmentMap::sample(Sampler& sampler, Vec3_simd& dir, Vec3_simd& radiance, float& pdf) const {
+    if (table.empty())
+        return false;
+
+    // 32 random bits for the slot, enough for maps beyond the 24 bits of randf()
+    uint32_t slot = (uint32_t)(((uint64_t)sampler_next(sampler) * table.size()) >> 32);
+    const AliasEntry& entry = table[slot];
+    bool keep = randf(sampler) < entry.threshold;
+    uint32_t index = keep ? slot : entry.alias;
+    float texel_pdf = keep ? entry.pdf : entry.alias_pdf;
+
+    // Uniform point inside the texel
+    float u = (index % map_width + randf(sampler)) / map_width;
+    float v = (index / map_width + randf(sampler)) / map_height;
+    float phi = (u - 0.5f) * 2.0f * ENV_PI;
+    float theta = v * ENV_PI;
+    float sin_theta = sinf(theta);
+    if (sin_theta <= 0.0f)
+        return false;
+    dir = Vec3_simd(sin_theta * sinf(phi), -cosf(theta), sin_theta * cosf(phi));
+
+    pdf = texel_pdf / (2.0f * ENV_PI * ENV_PI * sin_theta);
+    radiance = filtered(u, v);
+    return true;
+}
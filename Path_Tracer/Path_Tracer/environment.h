@@ -0,0 +1,45 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include <stdint.h>
+#include <vector>
+
+// HDR environment light from an equirectangular (latitude-longitude) Radiance .hdr image.
+// The top row is straight up (world -y, as the image y axis points down the world y axis),
+// the middle column looks along +z.
+//
+// Escaping rays look the map up with bilinear filtering. Texels are 16-byte rows padded with
+// a copy of the first column, so a lookup is four aligned loads from two rows without any
+// wrap-around branches. For light sampling every texel gets a probability proportional to
+// its brightness and the solid angle it covers, drawn in O(1) from an alias table whose
+// entries also carry the densities, so a sample touches one cache line of the table.
+class EnvironmentMap {
+public:
+    // Load `path`, every texel multiplied by `scale`. Prints the reason and returns false on failure.
+    bool load(const char* path, float scale);
+
+    uint32_t width() const { return map_width; }
+    uint32_t height() const { return map_height; }
+
+    // Radiance arriving from direction `dir` (unit length) and the density per solid angle
+    // with which sample() picks it
+    Vec3_simd eval(Vec3_simd dir, float& pdf) const;
+
+    // Pick a direction towards bright parts of the map. False when the map is black.
+    bool sample(Sampler& sampler, Vec3_simd& dir, Vec3_simd& radiance, float& pdf) const;
+
+private:
+    struct AliasEntry {
+        float threshold;    // keep this texel when a uniform number is below, otherwise take `alias`
+        uint32_t alias;
+        float pdf;          // density of this texel over the unit square of image coordinates
+        float alias_pdf;    // the same for `alias`
+    };
+
+    Vec3_simd filtered(float u, float v) const;
+    void build_distribution();
+
+    uint32_t map_width = 0, map_height = 0;
+    std::vector<Vec3_simd> texels;      // map_height rows of map_width + 1 texels
+    std::vector<AliasEntry> table;      // one per texel, empty for a black map
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include <math.h>
+#include <immintrin.h>
+
+// The square roots, reciprocals, normalizations and sines the render kernels use, in two
+// versions picked at compile time. PreciseMath is the IEEE arithmetic the renderer always
+// used. FastMath (--fast-math) replaces square roots and divisions with the hardware
+// estimates (12 bits), refined by one Newton-Raphson step to about 22 bits, and sine and
+// cosine with polynomials. Its worst errors are measured by --bench-accuracy.
+
+struct PreciseMath {
+    static float sqrt(float x) { return sqrtf(x); }
+    static float rsqrt(float x) { return 1.0f / sqrtf(x); }
+    static float rcp(float x) { return 1.0f / x; }
+    static __m128 rcp(__m128 x) { return _mm_div_ps(_mm_set1_ps(1.0f), x); }
+    static float div(float a, float b) { return a / b; }
+    static Vec3_simd norm(Vec3_simd a) { return ::norm(a); }
+    static void sincos(float x, float& s, float& c) {
+        s = sinf(x);
+        c = cosf(x);
+    }
+};
+
+struct FastMath {
+    // 1/sqrt(x) for x > 0: y' = y * (1.5 - 0.5 * x * y * y)
+    static __m128 rsqrt(__m128 x) {
+        __m128 y = _mm_rsqrt_ps(x);
+        __m128 half_x = _mm_mul_ps(x, _mm_set1_ps(0.5f));
+        return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half_x, _mm_mul_ps(y, y))));
+    }
+    // 1/x: y' = y * (2 - x * y). Zeros keep the infinite estimate, which the slab test needs.
+    static __m128 rcp(__m128 x) {
+        __m128 y = _mm_rcp_ps(x);
+        __m128 refined = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, y)));
+        return _mm_blendv_ps(refined, y, _mm_cmpeq_ps(x, _mm_setzero_ps()));
+    }
+
+    static float rsqrt(float x) { return _mm_cvtss_f32(rsqrt(_mm_set_ss(x))); }
+    static float rcp(float x) { return _mm_cvtss_f32(rcp(_mm_set_ss(x))); }
+    static float div(float a, float b) { return a * rcp(b); }
+
+    // x * 1/sqrt(x); 0 for x <= 0, where the estimate is infinite
+    static float sqrt(float x) {
+        __m128 v = _mm_set_ss(x);
+        __m128 root = _mm_mul_ss(v, rsqrt(v));
+        return _mm_cvtss_f32(_mm_and_ps(root, _mm_cmpgt_ss(v, _mm_setzero_ps())));
+    }
+
+    // Same zero-length handling as norm()
+    static Vec3_simd norm(Vec3_simd a) {
+        __m128 len_sq = _mm_dp_ps(a.simd, a.simd, 0x77);
+        __m128 mask = _mm_cmpgt_ps(len_sq, _mm_setzero_ps());
+        return Vec3_simd(_mm_mul_ps(a.simd, _mm_and_ps(rsqrt(len_sq), mask)));
+    }
+
+    // Reduced to [-pi/4, pi/4] around the nearest multiple of pi/2, then Taylor polynomials
+    // to x^9 and x^8; meant for angles of a few turns at most (sampled directions)
+    static void sincos(float x, float& s, float& c) {
+        float quadrant = floorf(x * 0.636619772f + 0.5f);
+        // pi/2 in two parts, so the reduction stays exact for small quadrants
+        float r = (x - quadrant * 1.5703125f) - quadrant * 4.83826794e-4f;
+        float r2 = r * r;
+        float sin_r = r + r * r2 * (-1.0f / 6.0f + r2 * (1.0f / 120.0f + r2 * (-1.0f / 5040.0f + r2 * (1.0f / 362880.0f))));
+        float cos_r = 1.0f + r2 * (-0.5f + r2 * (1.0f / 24.0f + r2 * (-1.0f / 720.0f + r2 * (1.0f / 40320.0f))));
+        switch ((int)quadrant & 3) {
+        case 0: s = sin_r; c = cos_r; break;
+        case 1: s = cos_r; c = -sin_r; break;
+        case 2: s = -sin_r; c = -cos_r; break;
+        default: s = -cos_r; c = sin_r; break;
+        }
+    }
+};
@@ -1,4 +1,7 @@
 #include "gaussian_filter.h"
+#include "arena.h"
+#include <math.h>
+#include <algorithm>
 
 // generowanie jadra filtra Gaussowskiego zeby ukryc szum
 void generate_gaussian_kernel(std::vector<float>& kernel, int radius, float sigma)
@@ -27,7 +30,9 @@ void apply_gaussian_filter(uint8_t* image, int width, int height, int stride, in
 	std::vector<float> kernel;
 	generate_gaussian_kernel(kernel, radius, sigma);
 
-	std::vector<uint8_t> temp_image(width * height * stride);
+	// obraz posredni z pamieci tymczasowej watku, bez alokacji przy kazdym wywolaniu
+	ScratchScope scratch;
+	uint8_t* temp_image = scratch.allocate<uint8_t>((size_t)width * height * stride);
 
 	// w poziomie dla kadego wiersza
 	for (int y = 0; y < height; ++y)
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <vector>
 
 void generate_gaussian_kernel(std::vector<float>& kernel, int radius, float sigma);
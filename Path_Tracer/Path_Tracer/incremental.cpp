@@ -0,0 +1,343 @@
+#include "incremental.h"
+#include "intersections.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static const char GBUFFER_MAGIC[8] = { 'P', 'T', 'G', 'B', 'U', 'F', 0, 0 };
+static const uint32_t GBUFFER_VERSION = 1;
+
+// Header at the start of a G-buffer file, followed by the pixel keys and the primitive rectangles
+struct GBufferHeader {
+    char magic[8];          // "PTGBUF\0\0"
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t primitive_count;
+    uint64_t frame_hash;
+};
+
+static void hash_bytes(uint64_t& hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+}
+
+static void hash_vec3(uint64_t& hash, const Vec3_simd& v) {
+    float xyz[3] = { v.x, v.y, v.z };
+    hash_bytes(hash, xyz, sizeof(xyz));
+}
+
+// Material by its properties rather than its index, which moves when materials are added.
+// A texture by its file name, like the scene cache hash.
+static void hash_material(uint64_t& hash, const Scene& scene, uint32_t index) {
+    const Material& material = scene.materials[index];
+    hash_vec3(hash, material.color);
+    hash_vec3(hash, material.emission);
+    hash_bytes(hash, &material.roughness, sizeof(float));
+    if (material.texture != Material::NO_TEXTURE && material.texture < scene.texture_paths.size()) {
+        const std::string& path = scene.texture_paths[material.texture];
+        size_t slash = path.find_last_of("/\\");
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        hash_bytes(hash, name.data(), name.size() + 1);
+        hash_bytes(hash, &material.texture_scale, sizeof(float));
+    }
+}
+
+// 0 is kept for pixels that hit nothing
+static uint64_t finish_key(uint64_t hash) {
+    return hash ? hash : 1;
+}
+
+static uint64_t sphere_key(const Scene& scene, const Sphere& sphere) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint32_t kind = Hit::SPHERE;
+    hash_bytes(hash, &kind, sizeof(kind));
+    hash_vec3(hash, sphere.pos);
+    hash_bytes(hash, &sphere.radius, sizeof(float));
+    hash_material(hash, scene, sphere.material);
+    return finish_key(hash);
+}
+
+static uint64_t plane_key(const Scene& scene, const Plane& plane) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint32_t kind = Hit::PLANE;
+    hash_bytes(hash, &kind, sizeof(kind));
+    hash_vec3(hash, plane.normal);
+    hash_bytes(hash, &plane.distance, sizeof(float));
+    hash_material(hash, scene, plane.material);
+    return finish_key(hash);
+}
+
+static uint64_t triangle_key(const Scene& scene, const Triangle& triangle) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint32_t kind = Hit::TRIANGLE;
+    hash_bytes(hash, &kind, sizeof(kind));
+    hash_vec3(hash, triangle.v0);
+    hash_vec3(hash, triangle.edge1);
+    hash_vec3(hash, triangle.edge2);
+    if (triangle.uv != Triangle::NO_UV)
+        hash_bytes(hash, &scene.triangle_uvs[triangle.uv], sizeof(TriangleUV));
+    hash_material(hash, scene, triangle.material);
+    return finish_key(hash);
+}
+
+uint64_t frame_hash(const Scene& scene, const Framebuffer& framebuffer, bool fast_math) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint32_t settings[6] = { framebuffer.width, framebuffer.height, framebuffer.samples, framebuffer.bounces,
+        framebuffer.first_sample, fast_math ? 1u : 0u };
+    hash_bytes(hash, settings, sizeof(settings));
+    hash_bytes(hash, &framebuffer.seed, sizeof(uint64_t));
+
+    const CameraSettings& camera = scene.camera;
+    hash_vec3(hash, camera.position);
+    hash_vec3(hash, camera.look_at);
+    hash_vec3(hash, camera.up);
+    float lens[4] = { camera.fov, camera.aspect, camera.aperture, camera.focus_distance };
+    hash_bytes(hash, lens, sizeof(lens));
+
+    for (const Light& light : scene.lights) {
+        hash_vec3(hash, light.position);
+        hash_vec3(hash, light.intensity);
+        hash_bytes(hash, &light.type, sizeof(uint32_t));
+    }
+    if (scene.environment) {
+        size_t slash = scene.environment_path.find_last_of("/\\");
+        std::string name = slash == std::string::npos ? scene.environment_path : scene.environment_path.substr(slash + 1);
+        hash_bytes(hash, name.data(), name.size() + 1);
+        hash_bytes(hash, &scene.environment_scale, sizeof(float));
+    }
+
+    // Emitting spheres light everything. Sorted, because their order follows the BVH build.
+    std::vector<uint64_t> emitters;
+    for (uint32_t index : scene.emitters)
+        emitters.push_back(sphere_key(scene, scene.spheres[index]));
+    std::sort(emitters.begin(), emitters.end());
+    if (!emitters.empty())
+        hash_bytes(hash, emitters.data(), emitters.size() * sizeof(uint64_t));
+    return hash;
+}
+
+// Pixels the box may cover, a pixel wider on every side. With a lens, or when part of the box
+// is behind the camera, that is the whole frame.
+static void screen_rect(const Camera& camera, const Aabb& box, PrimitiveRect& rect) {
+    rect.x0 = rect.y0 = 0;
+    rect.x1 = camera.width;
+    rect.y1 = camera.height;
+    if (camera.has_lens())
+        return;
+
+    float min_x = 3.4e38f, min_y = 3.4e38f, max_x = -3.4e38f, max_y = -3.4e38f;
+    for (uint32_t corner = 0; corner < 8; ++corner) {
+        Vec3_simd point((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y,
+            (corner & 4) ? box.max.z : box.min.z);
+        float px, py;
+        if (!camera.project(point, px, py))
+            return;
+        min_x = std::min(min_x, px);
+        min_y = std::min(min_y, py);
+        max_x = std::max(max_x, px);
+        max_y = std::max(max_y, py);
+    }
+
+    float x0 = std::max(floorf(min_x) - 1.0f, 0.0f), y0 = std::max(floorf(min_y) - 1.0f, 0.0f);
+    float x1 = std::min(ceilf(max_x) + 1.0f, (float)camera.width), y1 = std::min(ceilf(max_y) + 1.0f, (float)camera.height);
+    if (x1 <= x0 || y1 <= y0) {
+        rect.x0 = rect.y0 = rect.x1 = rect.y1 = 0;     // off screen
+        return;
+    }
+    rect.x0 = (uint32_t)x0;
+    rect.y0 = (uint32_t)y0;
+    rect.x1 = (uint32_t)x1;
+    rect.y1 = (uint32_t)y1;
+}
+
+void build_gbuffer(const Scene& scene, const Camera& camera, uint64_t frame_hash, GBuffer& gbuffer) {
+    gbuffer.width = camera.width;
+    gbuffer.height = camera.height;
+    gbuffer.frame_hash = frame_hash;
+
+    std::vector<uint64_t> sphere_keys(scene.spheres.size), plane_keys(scene.planes.size), triangle_keys(scene.triangles.size);
+    gbuffer.primitives.clear();
+    PrimitiveRect rect;
+    for (uint32_t i = 0; i < scene.spheres.size; ++i) {
+        rect.key = sphere_keys[i] = sphere_key(scene, scene.spheres[i]);
+        screen_rect(camera, scene.spheres[i].bounds(), rect);
+        gbuffer.primitives.push_back(rect);
+    }
+    for (uint32_t i = 0; i < scene.planes.size; ++i) {
+        // Unbounded: with a pinhole its pixels are the ones it is the first hit of
+        rect.key = plane_keys[i] = plane_key(scene, scene.planes[i]);
+        rect.x0 = rect.y0 = 0;
+        rect.x1 = camera.has_lens() ? camera.width : 0;
+        rect.y1 = camera.has_lens() ? camera.height : 0;
+        gbuffer.primitives.push_back(rect);
+    }
+    for (uint32_t i = 0; i < scene.triangles.size; ++i) {
+        rect.key = triangle_keys[i] = triangle_key(scene, scene.triangles[i]);
+        screen_rect(camera, scene.triangles[i].bounds(), rect);
+        gbuffer.primitives.push_back(rect);
+    }
+    std::sort(gbuffer.primitives.begin(), gbuffer.primitives.end(),
+        [](const PrimitiveRect& a, const PrimitiveRect& b) { return a.key < b.key; });
+
+    // Rays through the pixel centers and the middle of the lens
+    gbuffer.keys.assign((size_t)camera.width * camera.height, 0);
+    std::vector<CameraSample> samples(camera.width);
+    std::vector<Ray> rays(camera.width);
+    for (uint32_t y = 0; y < camera.height; ++y) {
+        for (uint32_t x = 0; x < camera.width; ++x) {
+            samples[x].px = x + 0.5f;
+            samples[x].py = y + 0.5f;
+            samples[x].lens_u = samples[x].lens_v = 0.5f;
+        }
+        camera.generate_rays(samples.data(), camera.width, rays.data());
+        for (uint32_t x = 0; x < camera.width; ++x) {
+            Hit hit = {};
+            if (!intersect(rays[x], scene, hit))
+                continue;
+            const std::vector<uint64_t>& keys = hit.shape == Hit::SPHERE ? sphere_keys : hit.shape == Hit::PLANE ? plane_keys : triangle_keys;
+            gbuffer.keys[(size_t)y * camera.width + x] = keys[hit.shape_index];
+        }
+    }
+}
+
+bool read_gbuffer(const std::string& path, GBuffer& gbuffer) {
+    MappedFile file;
+    if (!file.open(path.c_str(), MappedFile::READ_ONLY))
+        return false;
+    const GBufferHeader* header = (const GBufferHeader*)file.data();
+    if (file.size() < sizeof(GBufferHeader) || memcmp(header->magic, GBUFFER_MAGIC, sizeof(GBUFFER_MAGIC)) != 0 ||
+        header->version != GBUFFER_VERSION)
+        return false;
+    size_t pixels = (size_t)header->width * header->height;
+    if (file.size() < sizeof(GBufferHeader) + pixels * sizeof(uint64_t) + header->primitive_count * sizeof(PrimitiveRect))
+        return false;
+
+    gbuffer.width = header->width;
+    gbuffer.height = header->height;
+    gbuffer.frame_hash = header->frame_hash;
+    const uint8_t* data = (const uint8_t*)file.data() + sizeof(GBufferHeader);
+    gbuffer.keys.resize(pixels);
+    memcpy(gbuffer.keys.data(), data, pixels * sizeof(uint64_t));
+    gbuffer.primitives.resize(header->primitive_count);
+    if (header->primitive_count)
+        memcpy(gbuffer.primitives.data(), data + pixels * sizeof(uint64_t), header->primitive_count * sizeof(PrimitiveRect));
+    return true;
+}
+
+bool write_gbuffer(const std::string& path, const GBuffer& gbuffer) {
+    GBufferHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GBUFFER_MAGIC, sizeof(GBUFFER_MAGIC));
+    header.version = GBUFFER_VERSION;
+    header.width = gbuffer.width;
+    header.height = gbuffer.height;
+    header.primitive_count = (uint32_t)gbuffer.primitives.size();
+    header.frame_hash = gbuffer.frame_hash;
+    size_t keys_size = gbuffer.keys.size() * sizeof(uint64_t);
+    size_t primitives_size = gbuffer.primitives.size() * sizeof(PrimitiveRect);
+
+    // Replaced only when complete, like the scene cache
+    std::string temp_path = path + ".tmp";
+    MappedFile file;
+    if (!file.open(temp_path.c_str(), MappedFile::CREATE, sizeof(header) + keys_size + primitives_size))
+        return false;
+    uint8_t* base = (uint8_t*)file.data();
+    memcpy(base, &header, sizeof(header));
+    if (keys_size) memcpy(base + sizeof(header), gbuffer.keys.data(), keys_size);
+    if (primitives_size) memcpy(base + sizeof(header) + keys_size, gbuffer.primitives.data(), primitives_size);
+    file.close();
+
+    remove(path.c_str());
+    return rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+static void mark_rect(const PrimitiveRect& rect, uint32_t width, std::vector<uint8_t>& dirty) {
+    for (uint32_t y = rect.y0; y < rect.y1; ++y)
+        memset(&dirty[(size_t)y * width + rect.x0], 1, rect.x1 - rect.x0);
+}
+
+// Rectangles of the primitives of `from` that `other` does not have
+static void mark_missing(const std::vector<PrimitiveRect>& from, const std::vector<PrimitiveRect>& other, uint32_t width,
+    std::vector<uint8_t>& dirty) {
+    for (const PrimitiveRect& rect : from) {
+        auto found = std::lower_bound(other.begin(), other.end(), rect.key,
+            [](const PrimitiveRect& a, uint64_t key) { return a.key < key; });
+        if (found == other.end() || found->key != rect.key)
+            mark_rect(rect, width, dirty);
+    }
+}
+
+uint32_t dirty_pixels(const GBuffer& before, const GBuffer& after, std::vector<uint8_t>& dirty) {
+    const uint32_t width = after.width, height = after.height;
+    const size_t pixels = (size_t)width * height;
+    if (before.width != width || before.height != height || before.frame_hash != after.frame_hash) {
+        dirty.assign(pixels, 1);
+        return (uint32_t)pixels;
+    }
+
+    // Pixels whose first hit changed, and their neighbours, which the edge may partly cover
+    dirty.assign(pixels, 0);
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            size_t i = (size_t)y * width + x;
+            if (before.keys[i] == after.keys[i])
+                continue;
+            PrimitiveRect around = { 0, x > 0 ? x - 1 : 0, y > 0 ? y - 1 : 0, std::min(x + 2, width), std::min(y + 2, height) };
+            mark_rect(around, width, dirty);
+        }
+    }
+
+    // Where changed primitives were and are now, also where they are hidden at pixel centers
+    mark_missing(before.primitives, after.primitives, width, dirty);
+    mark_missing(after.primitives, before.primitives, width, dirty);
+
+    uint32_t count = 0;
+    for (uint8_t d : dirty)
+        count += d;
+    return count;
+}
+
+// Once pixels were cleared for a new scene, the G-buffer no longer describes the checkpoint.
+// Until the render finishes and writes the new one, an interrupted run leaves no G-buffer and
+// the next run renders everything, instead of diffing against a scene the pixels may not show.
+static void forget_gbuffer(const std::string& path) {
+    remove((path + ".gbuf").c_str());
+}
+
+bool open_incremental(const std::string& path, const Scene& scene, uint32_t width, uint32_t height, uint32_t samples,
+    uint32_t bounces, uint64_t seed, bool seed_set, bool fast_math, Framebuffer& framebuffer, GBuffer& current) {
+    const Camera camera(scene.camera, width, height);
+    if (framebuffer.open_mapped(path.c_str())) {
+        if (framebuffer.width == width && framebuffer.height == height && framebuffer.samples == samples &&
+            framebuffer.bounces == bounces && framebuffer.split_count == 1 && framebuffer.first_sample == 0 &&
+            (!seed_set || framebuffer.seed == seed)) {
+            // The earlier render's seed, so kept pixels and new ones come from the same samples
+            build_gbuffer(scene, camera, frame_hash(scene, framebuffer, fast_math), current);
+            GBuffer before;
+            std::vector<uint8_t> dirty;
+            uint32_t count = framebuffer.pixel_count();
+            if (read_gbuffer(path + ".gbuf", before))
+                count = dirty_pixels(before, current, dirty);
+            else
+                dirty.assign(count, 1);     // no record of what the checkpoint shows
+            framebuffer.reset_pixels(dirty.data());
+            forget_gbuffer(path);
+            printf("Renderowanie przyrostowe: %u / %u pikseli do ponownego renderowania\n", count, framebuffer.pixel_count());
+            return true;
+        }
+        framebuffer.release();
+    }
+
+    if (!framebuffer.create_mapped(path.c_str(), width, height, samples, bounces, seed))
+        return false;
+    forget_gbuffer(path);
+    build_gbuffer(scene, camera, frame_hash(scene, framebuffer, fast_math), current);
+    printf("Renderowanie przyrostowe: nowy checkpoint %s\n", path.c_str());
+    return true;
+}
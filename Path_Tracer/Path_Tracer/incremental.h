@@ -0,0 +1,59 @@
+#pragma once
+
+#include "objects.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Incremental re-rendering after scene edits (--incremental <checkpoint>).
+//
+// Next to the checkpoint a G-buffer file (<checkpoint>.gbuf) keeps what the last render saw:
+// for every pixel the primitive hit first through its center, and for every primitive its
+// rectangle on screen. Primitives are identified by a hash of their geometry and material, so
+// the identity survives BVH reordering and edits elsewhere in the scene file. When the scene
+// changes, a primitive that was moved, edited, added or removed shows up as a key present in
+// only one of the two G-buffers; its old and new rectangles, and every pixel whose first hit
+// changed (grown by a pixel for partly covered edges), are rendered again. The other pixels
+// keep their accumulated samples.
+//
+// Anything that reaches every pixel (camera, lights, emitting spheres, the environment map,
+// render settings) is folded into one frame hash; when it changes the whole frame is redone.
+// Light a change sends elsewhere indirectly (a moved sphere's shadow or its reflections)
+// is not tracked.
+
+// Screen rectangle of a primitive, x1/y1 exclusive, empty when x0 == x1
+struct PrimitiveRect {
+    uint64_t key;
+    uint32_t x0, y0, x1, y1;
+};
+
+struct GBuffer {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint64_t frame_hash = 0;
+    std::vector<uint64_t> keys;             // per pixel, 0 where the center ray hits nothing
+    std::vector<PrimitiveRect> primitives;  // sorted by key
+};
+
+// Hash of everything that affects all pixels: camera, lights, emitters, environment and the
+// render settings of `framebuffer`. `fast_math`: rendered with --fast-math.
+uint64_t frame_hash(const Scene& scene, const Framebuffer& framebuffer, bool fast_math);
+
+// First hits and primitive rectangles of `scene` seen through `camera`
+void build_gbuffer(const Scene& scene, const Camera& camera, uint64_t frame_hash, GBuffer& gbuffer);
+
+bool read_gbuffer(const std::string& path, GBuffer& gbuffer);
+bool write_gbuffer(const std::string& path, const GBuffer& gbuffer);
+
+// Pixels to render again when the scene seen in `before` became the one in `after`
+// (nonzero entries). Returns how many there are.
+uint32_t dirty_pixels(const GBuffer& before, const GBuffer& after, std::vector<uint8_t>& dirty);
+
+// Framebuffer for an incremental render into the checkpoint at `path`. A checkpoint of the same
+// size, samples, bounces and seed (any seed unless `seed_set`) is reopened and only its dirty
+// pixels cleared; otherwise a new one is created and everything rendered. `current` receives
+// the G-buffer of `scene`, to be written with write_gbuffer() once the render is done.
+bool open_incremental(const std::string& path, const Scene& scene, uint32_t width, uint32_t height, uint32_t samples,
+    uint32_t bounces, uint64_t seed, bool seed_set, bool fast_math, Framebuffer& framebuffer, GBuffer& current);
@@ -1,9 +1,17 @@
 ﻿#include "intersections.h"
+#include "fast_math.h"
+#include "stats.h"
 #include <math.h>
 #include <limits>
+#include <utility>
 #include <immintrin.h>
 
-bool Sphere::intersect(const Ray& ray, Hit& hit) const {
+// Hit tests are split in two: hit_distance() only finds the distance, which is all the
+// traversal needs to pick the closest candidate; complete_hit() builds the hit record once,
+// for the primitive that is finally hit.
+
+template <typename Math>
+bool Sphere::hit_distance(const Ray& ray, float& t) const {
     // Vector from ray origin to sphere center
     Vec3_simd c = sub(pos, ray.pos);
 
@@ -21,25 +29,48 @@ bool Sphere::intersect(const Ray& ray, Hit& hit) const {
     }
 
     // Calculate intersection distance
-    float t2 = sqrt(radius_sq - (c_sq - t1 * t1));
-    hit.distance = t1 - t2;
+    float t2 = Math::sqrt(radius_sq - (c_sq - t1 * t1));
+    t = t1 - t2;
+    return true;
+}
+
+template <typename Math>
+void Sphere::complete_hit(const Ray& ray, float t, Hit& hit) const {
+    hit.distance = t;
 
     // Calculate hit position
     hit.pos = add(ray.pos, mul(ray.dir, hit.distance));
 
     // Calculate normal (with backface check)
-    hit.normal = norm(sub(hit.pos, pos));
+    hit.normal = Math::norm(sub(hit.pos, pos));
     __m128 normal_dot = _mm_dp_ps(ray.dir.simd, hit.normal.simd, 0x71);
     __m128 mask = _mm_cmpgt_ss(normal_dot, _mm_setzero_ps());
     hit.normal.simd = _mm_xor_ps(hit.normal.simd,
         _mm_and_ps(mask, _mm_set1_ps(-0.0f))); // Flip if needed
 
-    hit.color = color;
-    hit.roughness = roughness;
+    hit.material = material;
+    hit.sphere = this;
+}
+
+void Sphere::surface_uv(Hit& hit) const {
+    const float pi = 3.14159265f;
+    Vec3_simd local = mul(sub(hit.pos, pos), 1.0f / radius);
+    float up = -local.y > 1.0f ? 1.0f : (-local.y < -1.0f ? -1.0f : -local.y);
+    hit.u = 0.5f + atan2f(local.x, local.z) * (0.5f / pi);
+    hit.v = acosf(up) * (1.0f / pi);
+    hit.uv_density = 1.0f / (2.0f * pi * radius);  // around the equator
+}
+
+bool Sphere::intersect(const Ray& ray, Hit& hit) const {
+    float t;
+    if (!hit_distance(ray, t))
+        return false;
+    complete_hit(ray, t, hit);
     return true;
 }
 
-bool Plane::intersect(const Ray& ray, Hit& hit) const {
+template <typename Math>
+bool Plane::hit_distance(const Ray& ray, float& t) const {
     // Calculate denominator using SIMD dot product
     float denom = dot(normal, ray.dir);
 
@@ -50,41 +81,399 @@ bool Plane::intersect(const Ray& ray, Hit& hit) const {
     }
 
     // Calculate distance
-    float dist = -(dot(ray.pos, normal) + distance) / denom;
+    float dist = Math::div(-(dot(ray.pos, normal) + distance), denom);
 
     // Reject if behind ray
     if (dist < 0.0f) {
         return false;
     }
 
-    hit.distance = dist;
+    t = dist;
+    return true;
+}
+
+template <typename Math>
+void Plane::complete_hit(const Ray& ray, float t, Hit& hit) const {
+    hit.distance = t;
     hit.pos = add(ray.pos, mul(ray.dir, hit.distance));
     hit.normal = normal;
-    hit.color = color;
-    hit.roughness = roughness;
+    hit.material = material;
+    hit.sphere = nullptr;
+}
+
+void Plane::surface_uv(Hit& hit) const {
+    // u along the x axis on floors and ceilings, v down the world y axis on walls, like the image
+    Vec3_simd reference = fabsf(normal.y) > 0.9f ? Vec3_simd(0.0f, 0.0f, 1.0f) : Vec3_simd(0.0f, 1.0f, 0.0f);
+    Vec3_simd t = norm(cross(normal, reference));
+    Vec3_simd b = cross(t, normal);
+    hit.u = dot(hit.pos, t);
+    hit.v = dot(hit.pos, b);
+    hit.uv_density = 1.0f;
+}
+
+bool Plane::intersect(const Ray& ray, Hit& hit) const {
+    float t;
+    if (!hit_distance(ray, t))
+        return false;
+    complete_hit(ray, t, hit);
+    return true;
+}
+
+template <typename Math>
+bool Triangle::hit_distance(const Ray& ray, float& t) const {
+    // Moller-Trumbore: barycentric coordinates and distance from three dot products
+    Vec3_simd p = cross(ray.dir, edge2);
+    float det = dot(edge1, p);
+
+    // Ray parallel to the triangle plane
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_set_ss(det));
+    if (_mm_comile_ss(abs_det, _mm_set_ss(1e-9f))) {
+        return false;
+    }
+
+    float inv_det = Math::rcp(det);
+    Vec3_simd s = sub(ray.pos, v0);
+    float u = dot(s, p) * inv_det;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+
+    Vec3_simd q = cross(s, edge1);
+    float v = dot(ray.dir, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+
+    float dist = dot(edge2, q) * inv_det;
+    if (dist <= 0.0f) {
+        return false;
+    }
+
+    t = dist;
     return true;
 }
 
+template <typename Math>
+void Triangle::complete_hit(const Ray& ray, float t, Hit& hit) const {
+    hit.distance = t;
+    hit.pos = add(ray.pos, mul(ray.dir, hit.distance));
+
+    // Two-sided: the normal faces the incoming ray
+    hit.normal = Math::norm(cross(edge1, edge2));
+    __m128 normal_dot = _mm_dp_ps(ray.dir.simd, hit.normal.simd, 0x71);
+    __m128 mask = _mm_cmpgt_ss(normal_dot, _mm_setzero_ps());
+    hit.normal.simd = _mm_xor_ps(hit.normal.simd,
+        _mm_and_ps(_mm_shuffle_ps(mask, mask, 0), _mm_set1_ps(-0.0f)));
+
+    hit.material = material;
+    hit.sphere = nullptr;
+}
+
+void Triangle::surface_uv(const Span<TriangleUV>& uvs, Hit& hit) const {
+    // Barycentric coordinates of the hit position: p - v0 = b1 * edge1 + b2 * edge2
+    Vec3_simd p = sub(hit.pos, v0);
+    float d00 = dot(edge1, edge1), d01 = dot(edge1, edge2), d11 = dot(edge2, edge2);
+    float d20 = dot(p, edge1), d21 = dot(p, edge2);
+    float inv_denom = 1.0f / (d00 * d11 - d01 * d01);
+    float b1 = (d11 * d20 - d01 * d21) * inv_denom;
+    float b2 = (d00 * d21 - d01 * d20) * inv_denom;
+    float world_area = 0.5f * fast_mag(cross(edge1, edge2));
+
+    float uv_area = 0.5f;
+    if (uv == NO_UV) {
+        hit.u = b1;
+        hit.v = b2;
+    }
+    else {
+        const TriangleUV& c = uvs[uv];
+        hit.u = c.u0 + b1 * (c.u1 - c.u0) + b2 * (c.u2 - c.u0);
+        hit.v = c.v0 + b1 * (c.v1 - c.v0) + b2 * (c.v2 - c.v0);
+        uv_area = 0.5f * fabsf((c.u1 - c.u0) * (c.v2 - c.v0) - (c.u2 - c.u0) * (c.v1 - c.v0));
+    }
+    hit.uv_density = world_area > 0.0f ? sqrtf(uv_area / world_area) : 0.0f;
+}
+
+bool Triangle::intersect(const Ray& ray, Hit& hit) const {
+    float t;
+    if (!hit_distance(ray, t))
+        return false;
+    complete_hit(ray, t, hit);
+    return true;
+}
+
+// Occlusion tests: only whether there is a hit in (0, max_distance), no hit record.
+// From inside a sphere the exit point counts, so a light inside a closed sphere stays hidden.
+template <typename Math>
+bool Sphere::occludes(const Ray& ray, float max_distance) const {
+    Vec3_simd c = sub(pos, ray.pos);
+    float t1 = dot(ray.dir, c);
+    float offset_sq = dot(c, c) - t1 * t1;
+    float radius_sq = radius * radius;
+    if (offset_sq > radius_sq)
+        return false;
+
+    float t2 = Math::sqrt(radius_sq - offset_sq);
+    float dist = t1 - t2 > 0.0f ? t1 - t2 : t1 + t2;
+    return dist > 0.0f && dist < max_distance;
+}
+
+template <typename Math>
+bool Plane::occludes(const Ray& ray, float max_distance) const {
+    float denom = dot(normal, ray.dir);
+    if (fabsf(denom) <= 1e-6f)
+        return false;
+    float dist = Math::div(-(dot(ray.pos, normal) + distance), denom);
+    return dist >= 0.0f && dist < max_distance;
+}
+
+template <typename Math>
+bool Triangle::occludes(const Ray& ray, float max_distance) const {
+    Vec3_simd p = cross(ray.dir, edge2);
+    float det = dot(edge1, p);
+    if (fabsf(det) <= 1e-9f)
+        return false;
+
+    float inv_det = Math::rcp(det);
+    Vec3_simd s = sub(ray.pos, v0);
+    float u = dot(s, p) * inv_det;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    Vec3_simd q = cross(s, edge1);
+    float v = dot(ray.dir, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    float dist = dot(edge2, q) * inv_det;
+    return dist > 0.0f && dist < max_distance;
+}
+
+// Closest candidate so far: only its distance and which primitive it is
+struct ClosestHit {
+    enum Kind : uint32_t { NONE, PLANE, SPHERE, TRIANGLE };
+    float distance = std::numeric_limits<float>::max();
+    uint32_t kind = NONE;
+    uint32_t index = 0;
+};
+
+// Keep primitive `index` if its distance `t` is closer than the current closest hit
+static inline void compare_and_set(float t, uint32_t kind, uint32_t index, ClosestHit& closest) {
+    // Use SIMD comparison for distance check
+    __m128 cmp = _mm_cmplt_ss(_mm_set_ss(t), _mm_set_ss(closest.distance));
+    if (_mm_movemask_ps(cmp) & 1) {
+        closest.distance = t;
+        closest.kind = kind;
+        closest.index = index;
+    }
+}
+
+// Slab test of a ray against a node's bounds, returns the entry distance (or max float on a miss)
+static inline float intersect_bounds(const Aabb& box, __m128 origin, __m128 inv_dir, float max_distance) {
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(box.min.simd, origin), inv_dir);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(box.max.simd, origin), inv_dir);
+    __m128 t_near = _mm_min_ps(t0, t1);
+    __m128 t_far = _mm_max_ps(t0, t1);
+
+    // Horizontal max of the entry and min of the exit distances over x, y, z
+    __m128 near_yzx = _mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 near_zxy = _mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 far_yzx = _mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 far_zxy = _mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(3, 1, 0, 2));
+    float entry = _mm_cvtss_f32(_mm_max_ss(t_near, _mm_max_ss(near_yzx, near_zxy)));
+    float exit = _mm_cvtss_f32(_mm_min_ss(t_far, _mm_min_ss(far_yzx, far_zxy)));
+
+    if (exit < entry || exit < 0.0f || entry >= max_distance)
+        return std::numeric_limits<float>::max();
+    return entry;
+}
+
+// Closest hit among `shapes` through their BVH, or all of them when no BVH is built
+template <typename Math, typename T>
+static void intersect_shapes(const Ray& ray, Span<BVHNode> nodes, Span<T> shapes, uint32_t kind, ClosestHit& closest) {
+    float t;
+    if (nodes.size == 0) {
+        for (uint32_t i = 0; i < shapes.size; ++i) {
+            PT_STAT(primitive_tests);
+            if (shapes[i].template hit_distance<Math>(ray, t))
+                compare_and_set(t, kind, i, closest);
+        }
+        return;
+    }
+
+    const __m128 origin = ray.pos.simd;
+    const __m128 inv_dir = Math::rcp(ray.dir.simd);
+
+    // Front-to-back traversal, the nearer child is visited first
+    uint32_t stack[64];
+    uint32_t stack_size = 0;
+    uint32_t node_index = 0;
+    if (intersect_bounds(nodes[0].bounds, origin, inv_dir, closest.distance) == std::numeric_limits<float>::max())
+        return;
+
+    while (true) {
+        const BVHNode& node = nodes[node_index];
+        PT_STAT(bvh_node_visits);
+        if (node.count > 0) {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                PT_STAT(primitive_tests);
+                if (shapes[i].template hit_distance<Math>(ray, t))
+                    compare_and_set(t, kind, i, closest);
+            }
+        }
+        else {
+            uint32_t near_child = node.first;
+            uint32_t far_child = node.first + 1;
+            float near_t = intersect_bounds(nodes[near_child].bounds, origin, inv_dir, closest.distance);
+            float far_t = intersect_bounds(nodes[far_child].bounds, origin, inv_dir, closest.distance);
+            if (far_t < near_t) {
+                std::swap(near_child, far_child);
+                std::swap(near_t, far_t);
+            }
+
+            if (near_t != std::numeric_limits<float>::max()) {
+                if (far_t != std::numeric_limits<float>::max())
+                    stack[stack_size++] = far_child;
+                node_index = near_child;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        node_index = stack[--stack_size];
+    }
+}
+
+template <uint32_t Features>
 bool intersect(const Ray& ray, const Scene& scene, Hit& hit) {
-    Hit temp_hit;
-    float min_distance = std::numeric_limits<float>::max();
-    bool any_hit = false;
-
-    // Process shapes in chunks of 4 for better SIMD utilization (optional)
-    size_t i = 0;
-    const size_t count = scene.shapes.size();
-
-    for (; i < count; ++i) {
-        if (scene.shapes[i]->intersect(ray, temp_hit)) {
-            // Use SIMD comparison for distance check
-            __m128 cmp = _mm_cmplt_ss(_mm_set_ss(temp_hit.distance), _mm_set_ss(min_distance));
-                if (_mm_movemask_ps(cmp) & 1) {
-                    hit = temp_hit;
-                        min_distance = temp_hit.distance;
-                        any_hit = true;
-                }
+    typedef KernelMath<Features> Math;
+    ClosestHit closest;
+    float t;
+
+    // Planes are unbounded and stay outside the BVH
+    if (Features & FEATURE_PLANES) {
+        for (uint32_t i = 0; i < scene.planes.size; ++i) {
+            PT_STAT(primitive_tests);
+            if (scene.planes[i].hit_distance<Math>(ray, t))
+                compare_and_set(t, ClosestHit::PLANE, i, closest);
+        }
+    }
+
+    // Spheres and triangles have a BVH each, the closest distance so far prunes the second one
+    if (Features & FEATURE_SPHERES)
+        intersect_shapes<Math>(ray, scene.bvh, scene.spheres, ClosestHit::SPHERE, closest);
+    if ((Features & FEATURE_TRIANGLES) && scene.triangles.size)
+        intersect_shapes<Math>(ray, scene.triangle_bvh, scene.triangles, ClosestHit::TRIANGLE, closest);
+
+    // Position, normal and material only for the hit that was kept, texture coordinates
+    // only when the material needs them
+    const bool textures = (Features & FEATURE_TEXTURES) != 0;
+    switch (closest.kind) {
+    case ClosestHit::PLANE: {
+        const Plane& plane = scene.planes[closest.index];
+        plane.complete_hit<Math>(ray, closest.distance, hit);
+        hit.shape = Hit::PLANE;
+        hit.shape_index = closest.index;
+        if (textures && scene.materials[hit.material].texture != Material::NO_TEXTURE)
+            plane.surface_uv(hit);
+        return true;
+    }
+    case ClosestHit::SPHERE: {
+        const Sphere& sphere = scene.spheres[closest.index];
+        sphere.complete_hit<Math>(ray, closest.distance, hit);
+        hit.shape = Hit::SPHERE;
+        hit.shape_index = closest.index;
+        if (textures && scene.materials[hit.material].texture != Material::NO_TEXTURE)
+            sphere.surface_uv(hit);
+        return true;
+    }
+    case ClosestHit::TRIANGLE: {
+        const Triangle& triangle = scene.triangles[closest.index];
+        triangle.complete_hit<Math>(ray, closest.distance, hit);
+        hit.shape = Hit::TRIANGLE;
+        hit.shape_index = closest.index;
+        if (textures && scene.materials[hit.material].texture != Material::NO_TEXTURE)
+            triangle.surface_uv(scene.triangle_uvs, hit);
+        return true;
+    }
+    default: return false;
+    }
+}
+
+bool intersect(const Ray& ray, const Scene& scene, Hit& hit) {
+    return intersect<FEATURE_ALL>(ray, scene, hit);
+}
+
+// Any hit among `shapes` closer than `max_distance`, through their BVH when one is built
+template <typename Math, typename T>
+static bool occluded_shapes(const Ray& ray, Span<BVHNode> nodes, Span<T> shapes, float max_distance) {
+    if (nodes.size == 0) {
+        for (const T& shape : shapes) {
+            PT_STAT(primitive_tests);
+            if (shape.template occludes<Math>(ray, max_distance))
+                return true;
+        }
+        return false;
+    }
+
+    const __m128 origin = ray.pos.simd;
+    const __m128 inv_dir = Math::rcp(ray.dir.simd);
+
+    // No closest hit to look for, so children are visited in node order without sorting
+    uint32_t stack[64];
+    uint32_t stack_size = 0;
+    uint32_t node_index = 0;
+    if (intersect_bounds(nodes[0].bounds, origin, inv_dir, max_distance) == std::numeric_limits<float>::max())
+        return false;
+
+    while (true) {
+        const BVHNode& node = nodes[node_index];
+        PT_STAT(bvh_node_visits);
+        if (node.count > 0) {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                PT_STAT(primitive_tests);
+                if (shapes[i].template occludes<Math>(ray, max_distance))
+                    return true;
+            }
         }
+        else {
+            bool left = intersect_bounds(nodes[node.first].bounds, origin, inv_dir, max_distance) != std::numeric_limits<float>::max();
+            bool right = intersect_bounds(nodes[node.first + 1].bounds, origin, inv_dir, max_distance) != std::numeric_limits<float>::max();
+            if (left || right) {
+                if (left && right)
+                    stack[stack_size++] = node.first + 1;
+                node_index = left ? node.first : node.first + 1;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            return false;
+        node_index = stack[--stack_size];
     }
+}
+
+template <uint32_t Features>
+bool occluded(const Ray& ray, const Scene& scene, float max_distance) {
+    typedef KernelMath<Features> Math;
+    if (Features & FEATURE_PLANES) {
+        for (const Plane& plane : scene.planes) {
+            PT_STAT(primitive_tests);
+            if (plane.occludes<Math>(ray, max_distance))
+                return true;
+        }
+    }
+    if ((Features & FEATURE_SPHERES) && occluded_shapes<Math>(ray, scene.bvh, scene.spheres, max_distance))
+        return true;
+    return (Features & FEATURE_TRIANGLES) && scene.triangles.size &&
+        occluded_shapes<Math>(ray, scene.triangle_bvh, scene.triangles, max_distance);
+}
+
+bool occluded(const Ray& ray, const Scene& scene, float max_distance) {
+    return occluded<FEATURE_ALL>(ray, scene, max_distance);
+}
 
-    return any_hit;
-}
\ No newline at end of file
+#define PT_INSTANTIATE_INTERSECT(F) \
+    template bool intersect<F>(const Ray& ray, const Scene& scene, Hit& hit); \
+    template bool occluded<F>(const Ray& ray, const Scene& scene, float max_distance);
+PT_FEATURE_SETS(PT_INSTANTIATE_INTERSECT)
@@ -1,5 +1,24 @@
 #pragma once
 #include "objects.h"
+#include "fast_math.h"
+#include <type_traits>
 
 // Use const references to avoid copying aligned objects
-bool intersect(const Ray& ray, const Scene& scene, Hit& hit);
\ No newline at end of file
+bool intersect(const Ray& ray, const Scene& scene, Hit& hit);
+
+// Whether anything is hit closer than `max_distance`, for shadow rays. Stops at the first
+// hit found in any order and never builds a hit record.
+bool occluded(const Ray& ray, const Scene& scene, float max_distance);
+
+// Arithmetic of the kernel for `Features`: FastMath with FEATURE_FAST_MATH, PreciseMath otherwise
+template <uint32_t Features>
+using KernelMath = typename std::conditional<(Features & FEATURE_FAST_MATH) != 0, FastMath, PreciseMath>::type;
+
+// The same, compiled for scenes with only the SceneFeature bits in `Features`: absent primitive
+// types are not tested and texture coordinates are not computed. FEATURE_FAST_MATH selects
+// the approximate square roots and divisions. The scene must not have more than `Features`
+// (Scene::features()); the functions above are the FEATURE_ALL versions.
+template <uint32_t Features>
+bool intersect(const Ray& ray, const Scene& scene, Hit& hit);
+template <uint32_t Features>
+bool occluded(const Ray& ray, const Scene& scene, float max_distance);
@@ -0,0 +1,112 @@
+#include "mapped_file.h"
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const char* path, Mode mode, size_t size) {
+    close();
+    writable = mode != READ_ONLY;
+
+#ifdef _WIN32
+    DWORD access = writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+    HANDLE file = CreateFileA(path, access, FILE_SHARE_READ, NULL,
+        mode == CREATE ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    if (mode != CREATE) {
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file, &file_size);
+        size = (size_t)file_size.QuadPart;
+    }
+    if (size == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    void* view = mapping ? MapViewOfFile(mapping, writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size) : NULL;
+    if (!view) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    memory = view;
+#else
+    int flags = mode == CREATE ? (O_RDWR | O_CREAT | O_TRUNC) : (writable ? O_RDWR : O_RDONLY);
+    int fd = ::open(path, flags, 0644);
+    if (fd < 0)
+        return false;
+
+    if (mode == CREATE) {
+        if (ftruncate(fd, (off_t)size) != 0) {
+            ::close(fd);
+            return false;
+        }
+    }
+    else {
+        struct stat st;
+        fstat(fd, &st);
+        size = (size_t)st.st_size;
+    }
+    if (size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* view = mmap(NULL, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+
+    file_descriptor = fd;
+    memory = view;
+#endif
+    memory_size = size;
+    return true;
+}
+
+void MappedFile::flush() {
+    if (!memory || !writable)
+        return;
+#ifdef _WIN32
+    FlushViewOfFile(memory, memory_size);
+    FlushFileBuffers((HANDLE)file_handle);
+#else
+    msync(memory, memory_size, MS_SYNC);
+#endif
+}
+
+void MappedFile::close() {
+    if (!memory)
+        return;
+
+    flush();
+#ifdef _WIN32
+    UnmapViewOfFile(memory);
+    CloseHandle((HANDLE)mapping_handle);
+    CloseHandle((HANDLE)file_handle);
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+#else
+    munmap(memory, memory_size);
+    ::close(file_descriptor);
+    file_descriptor = -1;
+#endif
+    memory = nullptr;
+    memory_size = 0;
+}
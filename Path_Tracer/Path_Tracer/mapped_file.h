@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+// File mapped into memory (MapViewOfFile on Windows, mmap elsewhere)
+class MappedFile {
+public:
+    enum Mode {
+        READ_ONLY,      // existing file, whole file mapped read-only
+        READ_WRITE,     // existing file, whole file mapped writable
+        CREATE          // new file of the given size (overwrites an existing one)
+    };
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const char* path, Mode mode, size_t size = 0);
+    // Write dirty pages to disk
+    void flush();
+    void close();
+
+    void* data() const { return memory; }
+    size_t size() const { return memory_size; }
+    bool is_open() const { return memory != nullptr; }
+
+private:
+    void* memory = nullptr;
+    size_t memory_size = 0;
+    bool writable = false;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#else
+    int file_descriptor = -1;
+#endif
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include "fast_math.h"
+
+// GGX microfacet reflection (Trowbridge-Reitz distribution, Smith height-correlated shadowing,
+// Schlick Fresnel with the material color as the reflectance at normal incidence).
+// Directions are sampled from the distribution of normals visible from the outgoing direction
+// (Heitz 2018, "Sampling the GGX Distribution of Visible Normals"): closed form, two random
+// numbers, and a sample weight of F * G2 / G1 that never exceeds 1.
+// Functions with a `Math` parameter take their square roots and sines from it (fast_math.h).
+
+static const float GGX_PI = 3.14159265f;
+
+// Orthonormal basis t, b around the unit vector n (Duff et al. 2017, branchless)
+inline void make_basis(Vec3_simd n, Vec3_simd& t, Vec3_simd& b) {
+    float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = Vec3_simd(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = Vec3_simd(c, sign + n.y * n.y * a, -n.y);
+}
+
+// Reflection lobe at one surface point. Vectors ending in _local are in the t, b, n frame.
+struct alignas(16) GGXLobe {
+    Vec3_simd t, b, n;      // shading frame, n on the side of the outgoing direction
+    Vec3_simd wo_local;     // direction towards the viewer
+    Vec3_simd f0;           // reflectance at normal incidence
+    float alpha;            // roughness squared
+    float lambda_wo;        // Smith Lambda of wo
+};
+
+inline Vec3_simd to_local(const GGXLobe& lobe, Vec3_simd v) {
+    return Vec3_simd(dot(v, lobe.t), dot(v, lobe.b), dot(v, lobe.n));
+}
+
+inline Vec3_simd to_world(const GGXLobe& lobe, Vec3_simd v) {
+    return add(add(mul(lobe.t, v.x), mul(lobe.b, v.y)), mul(lobe.n, v.z));
+}
+
+// Normal distribution D(m)
+inline float ggx_d(float alpha, float cos_m) {
+    float a2 = alpha * alpha;
+    float d = cos_m * cos_m * (a2 - 1.0f) + 1.0f;
+    return a2 / (GGX_PI * d * d);
+}
+
+// Smith Lambda; G1 = 1 / (1 + Lambda), G2 = 1 / (1 + Lambda(wo) + Lambda(wi))
+template <typename Math = PreciseMath>
+inline float ggx_lambda(float alpha, float cos_theta) {
+    float cos2 = cos_theta * cos_theta;
+    float tan2 = (1.0f - cos2) / cos2;
+    return 0.5f * (Math::sqrt(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+inline Vec3_simd fresnel_schlick(Vec3_simd f0, float cos_theta) {
+    float m = 1.0f - cos_theta;
+    float m5 = m * m * m * m * m;
+    return add(f0, mul(sub(splat(1.0f), f0), m5));
+}
+
+// `n` is the geometric normal (either side), `dir` the incoming ray direction
+template <typename Math = PreciseMath>
+inline GGXLobe ggx_lobe(Vec3_simd n, Vec3_simd dir, Vec3_simd color, float roughness) {
+    GGXLobe lobe;
+    Vec3_simd wo = mul(dir, -1.0f);
+    lobe.n = dot(n, wo) < 0.0f ? mul(n, -1.0f) : n;
+    make_basis(lobe.n, lobe.t, lobe.b);
+    lobe.wo_local = to_local(lobe, wo);
+    if (lobe.wo_local.z < 1e-6f)
+        lobe.wo_local.z = 1e-6f;    // grazing: keep the frame valid
+    lobe.f0 = color;
+    lobe.alpha = roughness * roughness > 1e-4f ? roughness * roughness : 1e-4f;
+    lobe.lambda_wo = ggx_lambda<Math>(lobe.alpha, lobe.wo_local.z);
+    return lobe;
+}
+
+// Reflected radiance factor f * cos(wi) towards world direction `wi`, and the density
+// (per solid angle) with which ggx_sample() picks `wi`. Zero below the surface.
+template <typename Math = PreciseMath>
+inline Vec3_simd ggx_eval(const GGXLobe& lobe, Vec3_simd wi, float& pdf) {
+    Vec3_simd wi_local = to_local(lobe, wi);
+    pdf = 0.0f;
+    if (wi_local.z <= 0.0f)
+        return Vec3_simd();
+
+    Vec3_simd m = Math::norm(add(lobe.wo_local, wi_local));
+    float cos_om = dot(lobe.wo_local, m);
+    if (cos_om <= 0.0f)
+        return Vec3_simd();
+
+    float d = ggx_d(lobe.alpha, m.z);
+    float g1 = 1.0f / (1.0f + lobe.lambda_wo);
+    float g2 = 1.0f / (1.0f + lobe.lambda_wo + ggx_lambda<Math>(lobe.alpha, wi_local.z));
+    pdf = g1 * d / (4.0f * lobe.wo_local.z);
+    return mul(fresnel_schlick(lobe.f0, cos_om), d * g2 / (4.0f * lobe.wo_local.z));
+}
+
+// Sample a reflected direction from the visible normals. Returns false when the reflection
+// points below the surface (the path ends); otherwise `weight` = f * cos / pdf.
+template <typename Math = PreciseMath>
+inline bool ggx_sample(const GGXLobe& lobe, float u1, float u2, Vec3_simd& wi, Vec3_simd& weight, float& pdf) {
+    const float alpha = lobe.alpha;
+    const Vec3_simd& wo = lobe.wo_local;
+
+    // Stretch to the hemisphere configuration, sample a point on the projected disk
+    Vec3_simd vh = Math::norm(Vec3_simd(alpha * wo.x, alpha * wo.y, wo.z));
+    float len_sq = vh.x * vh.x + vh.y * vh.y;
+    Vec3_simd t1 = len_sq > 0.0f ? mul(Vec3_simd(-vh.y, vh.x, 0.0f), Math::rsqrt(len_sq)) : Vec3_simd(1.0f, 0.0f, 0.0f);
+    Vec3_simd t2 = cross(vh, t1);
+    float r = Math::sqrt(u1);
+    float sin_phi, cos_phi;
+    Math::sincos(2.0f * GGX_PI * u2, sin_phi, cos_phi);
+    float p1 = r * cos_phi;
+    float p2 = r * sin_phi;
+    float s = 0.5f * (1.0f + vh.z);
+    p2 = (1.0f - s) * Math::sqrt(1.0f - p1 * p1) + s * p2;
+    float pz = 1.0f - p1 * p1 - p2 * p2;
+    Vec3_simd nh = add(add(mul(t1, p1), mul(t2, p2)), mul(vh, Math::sqrt(pz > 0.0f ? pz : 0.0f)));
+
+    // Unstretch to the microfacet normal and reflect about it
+    Vec3_simd m = Math::norm(Vec3_simd(alpha * nh.x, alpha * nh.y, nh.z > 0.0f ? nh.z : 0.0f));
+    float cos_om = dot(wo, m);
+    Vec3_simd wi_local = sub(mul(m, 2.0f * cos_om), wo);
+    if (wi_local.z <= 0.0f || cos_om <= 0.0f)
+        return false;
+
+    float lambda_wi = ggx_lambda<Math>(alpha, wi_local.z);
+    weight = mul(fresnel_schlick(lobe.f0, cos_om), (1.0f + lobe.lambda_wo) / (1.0f + lobe.lambda_wo + lambda_wi));
+    // From the half vector like ggx_eval(), so both give the same density for MIS weights
+    Vec3_simd h = Math::norm(add(wo, wi_local));
+    pdf = ggx_d(alpha, h.z) / ((1.0f + lobe.lambda_wo) * 4.0f * wo.z);
+    wi = to_world(lobe, wi_local);
+    return true;
+}
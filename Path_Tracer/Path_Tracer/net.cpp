@@ -0,0 +1,166 @@
+#include "net.h"
+#include <string.h>
+#include <algorithm>
+
+bool net_startup() {
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+void close_socket(socket_t s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+void shutdown_socket(socket_t s) {
+#ifdef _WIN32
+    shutdown(s, SD_BOTH);
+#else
+    shutdown(s, SHUT_RDWR);
+#endif
+}
+
+void set_receive_timeout(socket_t s, uint32_t seconds) {
+#ifdef _WIN32
+    DWORD timeout = seconds * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#else
+    timeval timeout = { (time_t)seconds, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+}
+
+bool send_all(socket_t s, const void* data, size_t size) {
+    const char* bytes = (const char*)data;
+    while (size > 0) {
+#ifdef _WIN32
+        int sent = send(s, bytes, (int)std::min(size, (size_t)1 << 30), 0);
+#else
+        ssize_t sent = send(s, bytes, size, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool recv_all(socket_t s, void* data, size_t size) {
+    char* bytes = (char*)data;
+    while (size > 0) {
+#ifdef _WIN32
+        int received = recv(s, bytes, (int)std::min(size, (size_t)1 << 30), 0);
+#else
+        ssize_t received = recv(s, bytes, size, 0);
+#endif
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+bool is_unix_address(const std::string& address) {
+    return address.compare(0, 5, "unix:") == 0;
+}
+
+// "<port>" or "<host>:<port>"
+static void split_host_port(const std::string& address, std::string& host, std::string& port) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        host.clear();
+        port = address;
+    }
+    else {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+}
+
+socket_t open_socket(const std::string& address, bool listening) {
+    if (is_unix_address(address)) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.size() >= sizeof(addr.sun_path))
+            return INVALID_SOCKET_HANDLE;
+        memcpy(addr.sun_path, path.c_str(), path.size());
+
+        socket_t s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET_HANDLE)
+            return s;
+        bool ok;
+        if (listening) {
+#ifdef _WIN32
+            DeleteFileA(path.c_str());
+#else
+            unlink(path.c_str());
+#endif
+            ok = bind(s, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(s, 64) == 0;
+        }
+        else {
+            ok = connect(s, (sockaddr*)&addr, sizeof(addr)) == 0;
+        }
+        if (!ok) {
+            close_socket(s);
+            return INVALID_SOCKET_HANDLE;
+        }
+        return s;
+    }
+
+    std::string host, port;
+    split_host_port(address, host, port);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* results = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0)
+        return INVALID_SOCKET_HANDLE;
+
+    socket_t s = INVALID_SOCKET_HANDLE;
+    for (addrinfo* ai = results; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET_HANDLE)
+            continue;
+
+        int one = 1;
+        bool ok;
+        if (listening) {
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+            ok = bind(s, ai->ai_addr, (int)ai->ai_addrlen) == 0 && listen(s, 64) == 0;
+        }
+        else {
+            ok = connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+        }
+        if (ok)
+            break;
+        close_socket(s);
+        s = INVALID_SOCKET_HANDLE;
+    }
+    freeaddrinfo(results);
+    return s;
+}
+
+std::string local_address(const std::string& listen_address) {
+    if (is_unix_address(listen_address))
+        return listen_address;
+    std::string host, port;
+    split_host_port(listen_address, host, port);
+    if (host.empty() || host == "0.0.0.0" || host == "::" || host == "*")
+        host = "127.0.0.1";
+    return host + ":" + port;
+}
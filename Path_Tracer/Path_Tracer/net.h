@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET socket_t;
+static const socket_t INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+static const socket_t INVALID_SOCKET_HANDLE = -1;
+#endif
+
+// Blocking stream sockets for distributed rendering and the preview server. Addresses are
+// "<port>", "<host>:<port>" or "unix:<path>" (a Unix domain socket).
+
+// Once per process before any other call (WSAStartup on Windows)
+bool net_startup();
+void close_socket(socket_t s);
+// Wake up a thread blocked on the socket
+void shutdown_socket(socket_t s);
+void set_receive_timeout(socket_t s, uint32_t seconds);
+// Send or receive exactly `size` bytes; false if the connection broke first
+bool send_all(socket_t s, const void* data, size_t size);
+bool recv_all(socket_t s, void* data, size_t size);
+
+bool is_unix_address(const std::string& address);
+// Listening socket bound to `address`, or a connection to it; INVALID_SOCKET_HANDLE on failure
+socket_t open_socket(const std::string& address, bool listening);
+// Address a client on this machine connects to, for a socket listening on `listen_address`
+std::string local_address(const std::string& listen_address);
@@ -0,0 +1,328 @@
+#include "objects.h"
+#include "mapped_file.h"
+#include "environment.h"
+#include "texture.h"
+#include <algorithm>
+
+Aabb Sphere::bounds() const {
+    Aabb box;
+    box.min = sub(pos, splat(radius));
+    box.max = add(pos, splat(radius));
+    return box;
+}
+
+Aabb Triangle::bounds() const {
+    Vec3_simd v1 = add(v0, edge1);
+    Vec3_simd v2 = add(v0, edge2);
+    Aabb box;
+    box.min = _mm_min_ps(v0.simd, _mm_min_ps(v1.simd, v2.simd));
+    box.max = _mm_max_ps(v0.simd, _mm_max_ps(v1.simd, v2.simd));
+    return box;
+}
+
+Scene::Scene() = default;
+Scene::~Scene() = default;
+
+bool Scene::load_environment(const std::string& path, float scale) {
+    std::unique_ptr<EnvironmentMap> map(new EnvironmentMap());
+    if (!map->load(path.c_str(), scale))
+        return false;
+    environment = std::move(map);
+    environment_path = path;
+    environment_scale = scale;
+    return true;
+}
+
+void Scene::update_spans() {
+    spheres.data = sphere_storage.data();
+    spheres.size = (uint32_t)sphere_storage.size();
+    planes.data = plane_storage.data();
+    planes.size = (uint32_t)plane_storage.size();
+    bvh.data = bvh_storage.data();
+    bvh.size = (uint32_t)bvh_storage.size();
+    triangles.data = triangle_storage.data();
+    triangles.size = (uint32_t)triangle_storage.size();
+    triangle_bvh.data = triangle_bvh_storage.data();
+    triangle_bvh.size = (uint32_t)triangle_bvh_storage.size();
+    triangle_uvs.data = triangle_uv_storage.data();
+    triangle_uvs.size = (uint32_t)triangle_uv_storage.size();
+    lights.data = light_storage.data();
+    lights.size = (uint32_t)light_storage.size();
+    materials.data = material_storage.data();
+    materials.size = (uint32_t)material_storage.size();
+    find_emitters();
+}
+
+void Scene::find_emitters() {
+    emitter_storage.clear();
+    for (uint32_t i = 0; i < spheres.size; ++i) {
+        const Vec3_simd& emission = materials[spheres[i].material].emission;
+        if (emission.x > 0.0f || emission.y > 0.0f || emission.z > 0.0f)
+            emitter_storage.push_back(i);
+    }
+    emitters.data = emitter_storage.data();
+    emitters.size = (uint32_t)emitter_storage.size();
+}
+
+uint32_t Scene::add_material(Vec3_simd color, float roughness, Vec3_simd emission, uint32_t texture, float texture_scale) {
+    std::array<float, 9> key = { { color.x, color.y, color.z, roughness, emission.x, emission.y, emission.z,
+        texture == Material::NO_TEXTURE ? -1.0f : (float)texture, texture_scale } };
+    std::map<std::array<float, 9>, uint32_t>::iterator found = material_lookup.find(key);
+    if (found != material_lookup.end())
+        return found->second;
+
+    unpack();
+    Material material;
+    material.color = color;
+    material.emission = emission;
+    material.roughness = roughness;
+    material.texture = texture;
+    material.texture_scale = texture_scale;
+    material_storage.push_back(material);
+    material_lookup[key] = (uint32_t)material_storage.size() - 1;
+    update_spans();
+    return (uint32_t)material_storage.size() - 1;
+}
+
+void Scene::add_sphere(Vec3_simd pos, float radius, uint32_t material) {
+    unpack();
+    Sphere sphere;
+    sphere.pos = pos;
+    sphere.radius = radius;
+    sphere.material = material;
+    sphere_storage.push_back(sphere);
+    bvh_storage.clear(); // stale until the next build_bvh()
+    update_spans();
+}
+
+void Scene::add_plane(Vec3_simd normal, float distance, uint32_t material) {
+    unpack();
+    Plane plane;
+    plane.normal = normal;
+    plane.distance = distance;
+    plane.material = material;
+    plane_storage.push_back(plane);
+    update_spans();
+}
+
+void Scene::set_material(uint32_t index, Vec3_simd color, float roughness, Vec3_simd emission) {
+    bool was_packed = packed;
+    unpack();
+    Material& material = material_storage[index];
+    for (std::map<std::array<float, 9>, uint32_t>::iterator entry = material_lookup.begin(); entry != material_lookup.end();) {
+        if (entry->second == index)
+            entry = material_lookup.erase(entry);
+        else
+            ++entry;
+    }
+    material.color = color;
+    material.emission = emission;
+    material.roughness = roughness;
+    std::array<float, 9> key = { { color.x, color.y, color.z, roughness, emission.x, emission.y, emission.z,
+        material.texture == Material::NO_TEXTURE ? -1.0f : (float)material.texture, material.texture_scale } };
+    material_lookup.insert(std::make_pair(key, index));
+    update_spans();
+    if (was_packed)
+        pack();
+}
+
+uint32_t Scene::add_texture(const std::string& path) {
+    for (size_t i = 0; i < texture_paths.size(); ++i) {
+        if (texture_paths[i] == path)
+            return (uint32_t)i;
+    }
+    std::unique_ptr<Texture> texture(new Texture());
+    if (!texture->open(path))
+        return Material::NO_TEXTURE;
+    textures.push_back(std::move(texture));
+    texture_paths.push_back(path);
+    return (uint32_t)textures.size() - 1;
+}
+
+void Scene::add_triangle(Vec3_simd v0, Vec3_simd v1, Vec3_simd v2, uint32_t material, const TriangleUV* uv) {
+    unpack();
+    Triangle triangle;
+    triangle.v0 = v0;
+    triangle.edge1 = sub(v1, v0);
+    triangle.edge2 = sub(v2, v0);
+    triangle.material = material;
+    triangle.uv = Triangle::NO_UV;
+    if (uv) {
+        triangle.uv = (uint32_t)triangle_uv_storage.size();
+        triangle_uv_storage.push_back(*uv);
+    }
+    triangle_storage.push_back(triangle);
+    triangle_bvh_storage.clear(); // stale until the next build_bvh()
+    update_spans();
+}
+
+void Scene::add_point_light(Vec3_simd pos, Vec3_simd intensity) {
+    unpack();
+    Light light;
+    light.position = pos;
+    light.intensity = intensity;
+    light.type = Light::POINT;
+    light_storage.push_back(light);
+    update_spans();
+}
+
+void Scene::add_directional_light(Vec3_simd dir, Vec3_simd irradiance) {
+    unpack();
+    Light light;
+    light.position = norm(dir);
+    light.intensity = irradiance;
+    light.type = Light::DIRECTIONAL;
+    light_storage.push_back(light);
+    update_spans();
+}
+
+// Build a BVH over `shapes` and store them in leaf order, so every leaf is a contiguous range
+template <typename T>
+static void build_shape_bvh(std::vector<T>& shapes, std::vector<BVHNode>& nodes) {
+    std::vector<Aabb> bounds(shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i)
+        bounds[i] = shapes[i].bounds();
+
+    std::vector<uint32_t> order;
+    ::build_bvh(bounds, nodes, order);
+
+    std::vector<T> ordered(shapes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        ordered[i] = shapes[order[i]];
+    shapes.swap(ordered);
+}
+
+void Scene::build_bvh() {
+    unpack();
+    build_shape_bvh(sphere_storage, bvh_storage);
+    build_shape_bvh(triangle_storage, triangle_bvh_storage);
+    update_spans();
+    pack();
+}
+
+static size_t packed_size(size_t count, size_t element_size) {
+    return (count * element_size + 63) / 64 * 64;
+}
+
+uint32_t Scene::features() const {
+    uint32_t result = 0;
+    if (spheres.size) result |= FEATURE_SPHERES;
+    if (planes.size) result |= FEATURE_PLANES;
+    if (triangles.size) result |= FEATURE_TRIANGLES;
+    if (environment) result |= FEATURE_ENVIRONMENT;
+    for (const Material& material : materials) {
+        if (material.texture != Material::NO_TEXTURE)
+            result |= FEATURE_TEXTURES;
+    }
+    return result;
+}
+
+size_t Scene::render_data_bytes() const {
+    return packed_size(bvh.size, sizeof(BVHNode)) + packed_size(spheres.size, sizeof(Sphere)) +
+        packed_size(triangle_bvh.size, sizeof(BVHNode)) + packed_size(triangles.size, sizeof(Triangle)) +
+        packed_size(triangle_uvs.size, sizeof(TriangleUV)) + packed_size(planes.size, sizeof(Plane)) +
+        packed_size(materials.size, sizeof(Material)) + packed_size(emitters.size, sizeof(uint32_t)) +
+        packed_size(lights.size, sizeof(Light));
+}
+
+// Copy `source` into the arena and point `span` at the copy
+template <typename T>
+static void copy_to_arena(Arena& arena, const Span<T>& source, Span<T>& span) {
+    T* data = source.size ? arena.allocate_array<T>(source.size) : nullptr;
+    if (data)
+        std::copy(source.begin(), source.end(), data);
+    span.data = data;
+    span.size = source.size;
+}
+
+// Copy `storage` into the arena, point `span` at the copy and free the vector
+template <typename T>
+static void move_to_arena(Arena& arena, std::vector<T>& storage, Span<T>& span) {
+    Span<T> source;
+    source.data = storage.data();
+    source.size = (uint32_t)storage.size();
+    copy_to_arena(arena, source, span);
+    std::vector<T>().swap(storage);
+}
+
+void Scene::pack() {
+    // One block, each BVH followed by the shapes its leaves point into
+    arena.release();
+    arena.reserve(render_data_bytes() + 64);
+    move_to_arena(arena, bvh_storage, bvh);
+    move_to_arena(arena, sphere_storage, spheres);
+    move_to_arena(arena, triangle_bvh_storage, triangle_bvh);
+    move_to_arena(arena, triangle_storage, triangles);
+    move_to_arena(arena, triangle_uv_storage, triangle_uvs);
+    move_to_arena(arena, plane_storage, planes);
+    move_to_arena(arena, material_storage, materials);
+    move_to_arena(arena, emitter_storage, emitters);
+    move_to_arena(arena, light_storage, lights);
+    packed = true;
+}
+
+void Scene::replicate(Scene& replica) const {
+    // Same layout as pack()
+    replica.arena.release();
+    replica.arena.reserve(render_data_bytes() + 64);
+    copy_to_arena(replica.arena, bvh, replica.bvh);
+    copy_to_arena(replica.arena, spheres, replica.spheres);
+    copy_to_arena(replica.arena, triangle_bvh, replica.triangle_bvh);
+    copy_to_arena(replica.arena, triangles, replica.triangles);
+    copy_to_arena(replica.arena, triangle_uvs, replica.triangle_uvs);
+    copy_to_arena(replica.arena, planes, replica.planes);
+    copy_to_arena(replica.arena, materials, replica.materials);
+    copy_to_arena(replica.arena, emitters, replica.emitters);
+    copy_to_arena(replica.arena, lights, replica.lights);
+    replica.packed = true;
+
+    replica.camera = camera;
+    replica.environment = environment;
+    replica.environment_path = environment_path;
+    replica.environment_scale = environment_scale;
+    replica.textures = textures;
+    replica.texture_paths = texture_paths;
+}
+
+void Scene::unpack() {
+    if (!packed)
+        return;
+    sphere_storage.assign(spheres.begin(), spheres.end());
+    plane_storage.assign(planes.begin(), planes.end());
+    bvh_storage.assign(bvh.begin(), bvh.end());
+    triangle_storage.assign(triangles.begin(), triangles.end());
+    triangle_bvh_storage.assign(triangle_bvh.begin(), triangle_bvh.end());
+    triangle_uv_storage.assign(triangle_uvs.begin(), triangle_uvs.end());
+    light_storage.assign(lights.begin(), lights.end());
+    material_storage.assign(materials.begin(), materials.end());
+    arena.release();
+    cache_file.reset();
+    packed = false;
+    update_spans();
+}
+
+void Scene::attach(std::unique_ptr<MappedFile> file, Span<Sphere> cached_spheres, Span<Plane> cached_planes, Span<BVHNode> cached_bvh,
+    Span<Triangle> cached_triangles, Span<BVHNode> cached_triangle_bvh, Span<TriangleUV> cached_triangle_uvs, Span<Light> cached_lights,
+    Span<Material> cached_materials) {
+    sphere_storage.clear();
+    plane_storage.clear();
+    bvh_storage.clear();
+    triangle_storage.clear();
+    triangle_bvh_storage.clear();
+    triangle_uv_storage.clear();
+    light_storage.clear();
+    material_storage.clear();
+    material_lookup.clear();
+    arena.release();
+    cache_file = std::move(file);
+    packed = true;
+    spheres = cached_spheres;
+    planes = cached_planes;
+    bvh = cached_bvh;
+    triangles = cached_triangles;
+    triangle_bvh = cached_triangle_bvh;
+    triangle_uvs = cached_triangle_uvs;
+    lights = cached_lights;
+    materials = cached_materials;
+    find_emitters();
+}
@@ -1,8 +1,18 @@
 #pragma once
 #include "vec3_simd.h"
+#include "bvh.h"
+#include "arena.h"
+#include <array>
+#include <map>
 #include <memory>
+#include <string>
 #include <vector>
 
+class MappedFile;
+class EnvironmentMap;
+class Texture;
+struct PreciseMath;
+
 // Ray with SIMD-aligned members
 struct alignas(16) Ray {
     Vec3_simd pos;      // Origin (16-byte aligned)
@@ -14,56 +24,224 @@ struct alignas(16) Ray {
 struct alignas(16) Hit {
     Vec3_simd pos;      // Intersection point (16-byte aligned)
     float distance;     // Ray distance to hit
+    float u, v;         // Texture coordinates, only set when the material has a texture
+    float uv_density;   // Texture coordinate units per world unit around the hit (filter size)
     Vec3_simd normal;   // Surface normal (16-byte aligned)
-    Vec3_simd color;    // Color (16-byte aligned)
-    float roughness;    // 0.0 (smooth) to 0.9 (rough)
+    uint32_t material;  // Index into Scene::materials
+    const class Sphere* sphere; // Sphere that was hit (for light sampling weights), null for other shapes
+    // Which shape was hit, set by the scene intersect(): its type and index in the scene array
+    enum Shape : uint32_t { SPHERE, PLANE, TRIANGLE };
+    uint32_t shape;
+    uint32_t shape_index;
 };
 
-// Base class for all shapes
-class alignas(16) Shape {
-public:
+// Surface properties, shared by any number of shapes through an index
+struct alignas(16) Material {
     Vec3_simd color;    // Color (16-byte aligned)
+    Vec3_simd emission; // Emitted radiance, zero for surfaces that are not lights
     float roughness;    // 0.0 (smooth) to 0.9 (rough)
-    virtual ~Shape() = default;
-    virtual bool intersect(const Ray& ray, Hit& hit) const = 0;
+    uint32_t texture;   // Index into Scene::textures multiplying `color`, or NO_TEXTURE
+    float texture_scale;    // Texture repeats per texture coordinate unit
+
+    static const uint32_t NO_TEXTURE = 0xFFFFFFFFu;
 };
 
+// Read-only view of a contiguous array, either owned by the scene or inside a mapped scene cache
+template <typename T>
+struct Span {
+    const T* data = nullptr;
+    uint32_t size = 0;
+
+    const T& operator[](uint32_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+};
+
+// Texture coordinates of a triangle's corners
+struct TriangleUV {
+    float u0, v0, u1, v1, u2, v2;
+};
+
+// Shapes are plain data without virtual functions, so the scene arrays can be
+// written to the binary scene cache and mapped back without any fix-ups.
+// The material index sits in the padding after the geometry, so it costs no space.
+
 // Sphere with SIMD-aligned members
-class alignas(16) Sphere : public Shape {
+class alignas(16) Sphere {
 public:
     Vec3_simd pos;      // Center (16-byte aligned)
     float radius;       // Sphere radius
-    bool intersect(const Ray& ray, Hit& hit) const override;
+    uint32_t material;  // Index into Scene::materials
+    bool intersect(const Ray& ray, Hit& hit) const;
+    // `Math`: PreciseMath or FastMath (fast_math.h), chosen by the render kernel
+    template <typename Math = PreciseMath>
+    bool hit_distance(const Ray& ray, float& t) const;     // distance only, for picking the closest hit
+    template <typename Math = PreciseMath>
+    void complete_hit(const Ray& ray, float t, Hit& hit) const;
+    template <typename Math = PreciseMath>
+    bool occludes(const Ray& ray, float max_distance) const;
+    Aabb bounds() const;
+    // Longitude and latitude, the seam facing -z and v = 0 at the top (world -y)
+    void surface_uv(Hit& hit) const;
 };
 
 // Plane with SIMD-aligned members
-class alignas(16) Plane : public Shape {
+class alignas(16) Plane {
 public:
     Vec3_simd normal;   // Surface normal (16-byte aligned)
     float distance;     // Distance from origin
-    bool intersect(const Ray& ray, Hit& hit) const override;
+    uint32_t material;  // Index into Scene::materials
+    bool intersect(const Ray& ray, Hit& hit) const;
+    template <typename Math = PreciseMath>
+    bool hit_distance(const Ray& ray, float& t) const;     // distance only, for picking the closest hit
+    template <typename Math = PreciseMath>
+    void complete_hit(const Ray& ray, float t, Hit& hit) const;
+    template <typename Math = PreciseMath>
+    bool occludes(const Ray& ray, float max_distance) const;
+    // World position along two axes in the plane, one texture repeat per world unit
+    void surface_uv(Hit& hit) const;
+};
+
+// Triangle with SIMD-aligned members, stored as a vertex and two edges (two-sided)
+class alignas(16) Triangle {
+public:
+    Vec3_simd v0;       // First vertex (16-byte aligned)
+    Vec3_simd edge1;    // v1 - v0
+    Vec3_simd edge2;    // v2 - v0
+    uint32_t material;  // Index into Scene::materials
+    uint32_t uv;        // Index into Scene::triangle_uvs, or NO_UV (barycentric coordinates are used)
+    bool intersect(const Ray& ray, Hit& hit) const;
+    template <typename Math = PreciseMath>
+    bool hit_distance(const Ray& ray, float& t) const;     // distance only, for picking the closest hit
+    template <typename Math = PreciseMath>
+    void complete_hit(const Ray& ray, float t, Hit& hit) const;
+    template <typename Math = PreciseMath>
+    bool occludes(const Ray& ray, float max_distance) const;
+    Aabb bounds() const;
+    void surface_uv(const Span<TriangleUV>& uvs, Hit& hit) const;
+
+    static const uint32_t NO_UV = 0xFFFFFFFFu;
+};
+
+// Light without a surface: not hit by rays, only reached by shadow rays from every bounce
+struct alignas(16) Light {
+    enum Type : uint32_t { POINT, DIRECTIONAL };
+    Vec3_simd position;     // POINT: position, DIRECTIONAL: unit direction the light travels in
+    Vec3_simd intensity;    // POINT: radiant intensity (falls off with distance squared), DIRECTIONAL: irradiance
+    uint32_t type;
 };
 
+// Camera placement and optics, as given by the scene (see Camera for the per-frame setup)
+struct alignas(16) CameraSettings {
+    Vec3_simd position = { 0.0f, 0.0f, -3.0f };
+    Vec3_simd look_at = { 0.0f, 0.0f, -2.0f };
+    Vec3_simd up = { 0.0f, -1.0f, 0.0f };     // world +y points down the image
+    float fov = 90.0f;                  // vertical field of view in degrees
+    float aspect = 0.0f;                // image plane width / height, 0 = from the resolution
+    float aperture = 0.0f;              // lens radius, 0 = pinhole (everything sharp)
+    float focus_distance = 0.0f;        // distance to the sharp plane, 0 = distance to look_at
+};
+
+// Parts of a scene the renderer can be compiled without. Every combination has its own
+// instantiation of the intersection and path tracing code (render_kernel() in render.h), so a
+// scene without, say, planes or textures never runs their loops and branches.
+enum SceneFeature : uint32_t {
+    FEATURE_SPHERES = 1,
+    FEATURE_PLANES = 2,
+    FEATURE_TRIANGLES = 4,
+    FEATURE_ENVIRONMENT = 8,
+    FEATURE_TEXTURES = 16,      // some material has a texture
+    FEATURE_ALL = 31,
+    FEATURE_FAST_MATH = 32      // not part of the scene: approximate math (--fast-math, fast_math.h)
+};
+
+// X(features) for every combination of SceneFeature bits, to instantiate the kernels
+#define PT_FEATURE_SETS(X) \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) \
+    X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+    X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)
+
 class alignas(16) Scene {
 public:
-    std::vector<std::unique_ptr<Shape>> shapes;
+    Span<Sphere> spheres;
+    Span<Plane> planes;     // unbounded, tested outside the BVH
+    Span<BVHNode> bvh;      // over `spheres`, empty until build_bvh()
+    Span<Triangle> triangles;
+    Span<BVHNode> triangle_bvh; // over `triangles`, empty until build_bvh()
+    Span<TriangleUV> triangle_uvs;  // per-corner texture coordinates of the triangles that have them
+    Span<Light> lights;
+    Span<Material> materials;
+    Span<uint32_t> emitters;    // indices of the spheres with emission, sampled as area lights
+    CameraSettings camera;
+    std::shared_ptr<EnvironmentMap> environment;    // light from outside the scene, null = sky gradient
+    std::string environment_path;   // where `environment` was loaded from, kept for the scene cache
+    float environment_scale = 1.0f;
+    std::vector<std::shared_ptr<Texture>> textures;
+    std::vector<std::string> texture_paths;     // where `textures` were opened from, kept for the scene cache
+
+    Scene();
+    ~Scene();
+
+    // Index of a material with these properties, added if the scene does not have one yet
+    uint32_t add_material(Vec3_simd color, float roughness, Vec3_simd emission = Vec3_simd(),
+        uint32_t texture = Material::NO_TEXTURE, float texture_scale = 1.0f);
+    // Change material `index` in place (its texture stays), e.g. from the preview server.
+    // Shapes using it follow; emitters are found again. Not while the scene is being rendered.
+    void set_material(uint32_t index, Vec3_simd color, float roughness, Vec3_simd emission);
+    // Index of the texture opened from `path`, or Material::NO_TEXTURE when it can not be opened
+    uint32_t add_texture(const std::string& path);
 
     // Helper functions to add shapes
-    void add_sphere(Vec3_simd pos, float radius, Vec3_simd color, float roughness) {
-        auto sphere = std::make_unique<Sphere>();
-        sphere->pos = pos;
-        sphere->radius = radius;
-        sphere->color = color;
-        sphere->roughness = roughness;
-        shapes.push_back(std::move(sphere));
-    }
-
-    void add_plane(Vec3_simd normal, float distance, Vec3_simd color, float roughness) {
-        auto plane = std::make_unique<Plane>();
-        plane->normal = normal;
-        plane->distance = distance;
-        plane->color = color;
-        plane->roughness = roughness;
-        shapes.push_back(std::move(plane));
-    }
-};
\ No newline at end of file
+    void add_sphere(Vec3_simd pos, float radius, uint32_t material);
+    void add_plane(Vec3_simd normal, float distance, uint32_t material);
+    void add_triangle(Vec3_simd v0, Vec3_simd v1, Vec3_simd v2, uint32_t material, const TriangleUV* uv = nullptr);
+    void add_point_light(Vec3_simd pos, Vec3_simd intensity);
+    void add_directional_light(Vec3_simd dir, Vec3_simd irradiance);
+
+    // Load an equirectangular .hdr image as the environment light, scaled by `scale`
+    bool load_environment(const std::string& path, float scale);
+
+    // Build the acceleration structures after all shapes are added (reorders `spheres` and `triangles`)
+    // and pack everything the renderer reads into the scene arena
+    void build_bvh();
+
+    // Bytes of the packed scene and whether they sit on huge pages (0 before build_bvh() or for a mapped cache)
+    size_t arena_bytes() const { return packed ? arena.used() : 0; }
+    bool arena_huge_pages() const { return packed && arena.huge_pages(); }
+
+    // SceneFeature bits of what the scene contains
+    uint32_t features() const;
+
+    // Bytes of the arrays the renderer reads: shapes, BVHs, lights and materials
+    size_t render_data_bytes() const;
+    // Make `replica` a copy of this built scene, its arrays in an arena of pages the calling
+    // thread touches first (a NUMA node's own copy). The environment map and textures are shared.
+    void replicate(Scene& replica) const;
+
+    // Use arrays stored in a mapped scene cache instead of the scene's own storage
+    void attach(std::unique_ptr<MappedFile> file, Span<Sphere> spheres, Span<Plane> planes, Span<BVHNode> bvh,
+        Span<Triangle> triangles, Span<BVHNode> triangle_bvh, Span<TriangleUV> triangle_uvs, Span<Light> lights,
+        Span<Material> materials);
+
+private:
+    std::vector<Sphere> sphere_storage;
+    std::vector<Plane> plane_storage;
+    std::vector<BVHNode> bvh_storage;
+    std::vector<Triangle> triangle_storage;
+    std::vector<BVHNode> triangle_bvh_storage;
+    std::vector<TriangleUV> triangle_uv_storage;
+    std::vector<Light> light_storage;
+    std::vector<Material> material_storage;
+    std::map<std::array<float, 9>, uint32_t> material_lookup;  // properties -> index, for sharing
+    std::vector<uint32_t> emitter_storage;  // derived from `spheres`, also when they are mapped
+    std::unique_ptr<MappedFile> cache_file;
+    Arena arena;            // shapes, BVHs, lights and materials in one block once built, in traversal order
+    bool packed = false;    // the spans point into `arena` or `cache_file`, the storage vectors are empty
+
+    void pack();
+    // Back to the storage vectors, before the scene changes again
+    void unpack();
+    void update_spans();
+    void find_emitters();
+};
@@ -0,0 +1,525 @@
+#include "preview.h"
+#include "net.h"
+#include "render.h"
+#include "camera.h"
+#include "scene_file.h"
+#include "topology.h"
+#include "trace.h"
+#include "png.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+namespace {
+
+// ---------------------------------------------------------------------------
+// Shared state
+
+// The framebuffer after one pass, read by any number of requests
+struct Snapshot {
+    Framebuffer frame;
+    uint32_t pass = 0;          // samples per pixel in `frame`
+    uint32_t restarts = 0;      // edits so far
+    double seconds = 0.0;       // since accumulation last (re)started
+    uint64_t rays = 0;          // traced in that time
+
+    // PNG of the tone-mapped frame, encoded by the first request that asks for it
+    const std::string& encoded();
+
+private:
+    std::once_flag encode_once;
+    std::string png;
+};
+
+void append_png(void* context, void* data, int size) {
+    ((std::string*)context)->append((const char*)data, size);
+}
+
+const std::string& Snapshot::encoded() {
+    std::call_once(encode_once, [this]() {
+        std::vector<uint8_t> image((size_t)frame.pixel_count() * 3);
+        frame.resolve(image.data(), 3);
+        stbi_write_png_to_func(append_png, &png, frame.width, frame.height, 3, image.data(), frame.width * 3);
+    });
+    return png;
+}
+
+struct MaterialEdit {
+    uint32_t index;
+    float color[3];
+    float roughness;
+    float emission[3];
+};
+
+// Between the HTTP thread and the render loop
+struct PreviewState {
+    std::mutex mutex;
+    std::condition_variable changed;    // an edit or /stop arrived
+    CameraSettings camera;              // camera to render with, edits applied
+    bool camera_changed = false;
+    std::vector<MaterialEdit> material_edits;
+    uint32_t material_count = 0;
+    bool stop = false;
+    std::shared_ptr<Snapshot> latest;
+    std::atomic<bool> interrupt{ false };   // an edit or /stop is waiting, drop the rest of the pass
+};
+
+// ---------------------------------------------------------------------------
+// Render threads
+
+// Threads kept for the whole preview. A pass renders one sample of every pixel, the tiles
+// handed out through a shared counter as in render_local().
+class PassPool {
+public:
+    PassPool(const RenderSettings& settings, Framebuffer& framebuffer, Scene& scene, uint32_t threads,
+        const std::atomic<bool>& interrupt);
+    ~PassPool();
+
+    // Add sample `sample` to every pixel; false if interrupted before every tile was done
+    bool run(const Camera& camera, uint32_t sample);
+    // Rays traced by the pool so far
+    uint64_t rays() const { return rays_total.load(); }
+
+private:
+    void work(uint32_t thread);
+
+    Framebuffer& framebuffer;
+    Scene& scene;
+    const std::atomic<bool>& interrupt;
+    const ThreadPlacement placement;
+    const uint32_t tile_size;
+    const uint32_t total_tiles;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable start, finished;
+    uint64_t pass_id = 0;
+    uint32_t running = 0;
+    bool quit = false;
+    // The current pass, set before it starts
+    const Camera* camera = nullptr;
+    RenderKernel kernel = nullptr;
+    uint32_t sample = 0;
+
+    std::atomic<uint32_t> next_tile{ 0 };
+    std::atomic<uint64_t> rays_total{ 0 };
+};
+
+PassPool::PassPool(const RenderSettings& settings, Framebuffer& fb, Scene& s, uint32_t thread_count,
+    const std::atomic<bool>& interrupted)
+    : framebuffer(fb), scene(s), interrupt(interrupted), placement(pin_policy(settings.pin), thread_count),
+      tile_size(settings.tile_size), total_tiles(tile_count(fb.width, fb.height, settings.tile_size)) {
+    for (uint32_t t = 0; t < thread_count; ++t)
+        threads.emplace_back([this, t]() { work(t); });
+}
+
+PassPool::~PassPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        start.notify_all();
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+bool PassPool::run(const Camera& pass_camera, uint32_t pass_sample) {
+    std::unique_lock<std::mutex> lock(mutex);
+    camera = &pass_camera;
+    kernel = render_kernel(scene);  // edits may have changed what the scene contains
+    sample = pass_sample;
+    next_tile = 0;
+    running = (uint32_t)threads.size();
+    pass_id++;
+    start.notify_all();
+    finished.wait(lock, [&]() { return running == 0; });
+    return next_tile.load() >= total_tiles;
+}
+
+void PassPool::work(uint32_t thread) {
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "preview %u", thread);
+    trace_thread_name(thread_name);
+    placement.pin(thread);
+
+    const uint32_t width = framebuffer.width;
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]() { return quit || pass_id != seen; });
+            if (quit)
+                return;
+            seen = pass_id;
+        }
+
+        uint64_t rays_before = rays_traced;
+        while (!interrupt.load(std::memory_order_relaxed)) {
+            uint32_t tile_index = next_tile.fetch_add(1);
+            if (tile_index >= total_tiles)
+                break;
+            Tile tile = tile_rect(tile_index, width, framebuffer.height, tile_size);
+            for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+                for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+                    uint32_t index = x + y * width;
+                    framebuffer.begin_pixel(index);
+                    Vec3_simd sum = kernel(x, y, *camera, framebuffer.bounces, sample, 1, scene, framebuffer.seed);
+                    framebuffer.end_pixel(index, sum, 1);
+                }
+            }
+        }
+        rays_total += rays_traced - rays_before;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0)
+            finished.notify_one();
+    }
+}
+
+// Copy the framebuffer for the HTTP thread; the only pause the preview adds to rendering
+void publish(PreviewState& state, const Framebuffer& framebuffer, uint32_t pass, uint32_t restarts, double seconds, uint64_t rays) {
+    std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+    if (!snapshot->frame.create(framebuffer.width, framebuffer.height, framebuffer.samples, framebuffer.bounces, framebuffer.seed))
+        return;
+    memcpy(snapshot->frame.accum, framebuffer.accum, (size_t)framebuffer.pixel_count() * 3 * sizeof(float));
+    memcpy(snapshot->frame.counts, framebuffer.counts, (size_t)framebuffer.pixel_count() * sizeof(uint32_t));
+    snapshot->pass = pass;
+    snapshot->restarts = restarts;
+    snapshot->seconds = seconds;
+    snapshot->rays = rays;
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.latest = snapshot;
+}
+
+// ---------------------------------------------------------------------------
+// HTTP
+
+const char PAGE[] =
+    "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Path Tracer - podglad</title></head>\n"
+    "<body style=\"background:#202020;color:#d0d0d0;font-family:sans-serif\">\n"
+    "<img id=\"frame\" src=\"/frame.png\" style=\"max-width:100%\"><pre id=\"stats\"></pre>\n"
+    "<p>Kamera (polecenia pliku sceny: camera, look_at, up, fov, aspect, lens)<br>\n"
+    "<textarea id=\"camera\" rows=\"6\" cols=\"48\"></textarea><br>\n"
+    "<button onclick=\"post('/camera', 'camera')\">Zastosuj</button></p>\n"
+    "<p>Material: indeks r g b chropowatosc [emisja r g b]<br>\n"
+    "<input id=\"material\" size=\"48\" value=\"0 0.8 0.8 0.8 0.9\">\n"
+    "<button onclick=\"post('/material', 'material')\">Zastosuj</button></p>\n"
+    "<p><button onclick=\"fetch('/stop', {method: 'POST'})\">Zakoncz i zapisz obraz</button> <span id=\"answer\"></span></p>\n"
+    "<script>\n"
+    "function post(path, id) {\n"
+    "  fetch(path, {method: 'POST', body: document.getElementById(id).value})\n"
+    "    .then(r => r.text()).then(t => document.getElementById('answer').textContent = t);\n"
+    "}\n"
+    "var shown = '';\n"
+    "function refresh() {\n"
+    "  fetch('/stats').then(r => r.json()).then(s => {\n"
+    "    document.getElementById('stats').textContent = 'probki: ' + s.pass + ' / ' + s.samples + ', zmiany: ' + s.restarts +\n"
+    "      ', ' + s.seconds.toFixed(1) + ' s, ' + (s.rays_per_second / 1e6).toFixed(2) + ' M promieni/s';\n"
+    "    var camera = document.getElementById('camera');\n"
+    "    if (!camera.value) camera.value = s.camera;\n"
+    "    var key = s.restarts + '-' + s.pass;\n"
+    "    if (key != shown) { shown = key; document.getElementById('frame').src = '/frame.png?' + key; }\n"
+    "  }).finally(() => setTimeout(refresh, 250));\n"
+    "}\n"
+    "refresh();\n"
+    "</script></body></html>\n";
+
+struct HttpRequest {
+    std::string method;
+    std::string path;   // without the query string
+    std::string body;
+};
+
+const size_t MAX_REQUEST = 64 * 1024;
+
+bool read_request(socket_t s, HttpRequest& request) {
+    std::string data;
+    char buffer[4096];
+    size_t header_end;
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+        if (data.size() > MAX_REQUEST)
+            return false;
+        int received = (int)recv(s, buffer, (int)sizeof(buffer), 0);
+        if (received <= 0)
+            return false;
+        data.append(buffer, received);
+    }
+
+    std::istringstream head(data.substr(0, header_end));
+    std::string line;
+    std::getline(head, line);
+    std::istringstream request_line(line);
+    if (!(request_line >> request.method >> request.path))
+        return false;
+    size_t query = request.path.find('?');
+    if (query != std::string::npos)
+        request.path.erase(query);
+
+    // Header names are case-insensitive
+    size_t content_length = 0;
+    while (std::getline(head, line)) {
+        std::string name = line.substr(0, line.find(':'));
+        for (char& c : name)
+            c = (char)tolower((unsigned char)c);
+        if (name == "content-length" && name.size() < line.size())
+            content_length = strtoul(line.c_str() + name.size() + 1, nullptr, 10);
+    }
+    if (content_length > MAX_REQUEST)
+        return false;
+    request.body = data.substr(header_end + 4);
+    size_t have = request.body.size();
+    if (have < content_length) {
+        request.body.resize(content_length);
+        if (!recv_all(s, &request.body[have], content_length - have))
+            return false;
+    }
+    request.body.resize(content_length);
+    return true;
+}
+
+void send_response(socket_t s, const char* status, const char* content_type, const std::string& body) {
+    char header[256];
+    int size = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nCache-Control: no-store\r\nConnection: close\r\n\r\n",
+        status, content_type, (uint32_t)body.size());
+    if (send_all(s, header, (size_t)size))
+        send_all(s, body.data(), body.size());
+}
+
+// Camera settings as scene file statements, the starting text of the page's camera box
+std::string camera_statements(const CameraSettings& camera) {
+    char text[512];
+    snprintf(text, sizeof(text), "camera %g %g %g\\nlook_at %g %g %g\\nup %g %g %g\\nfov %g\\nlens %g %g",
+        camera.position.x, camera.position.y, camera.position.z, camera.look_at.x, camera.look_at.y, camera.look_at.z,
+        camera.up.x, camera.up.y, camera.up.z, camera.fov, camera.aperture, camera.focus_distance);
+    return text;
+}
+
+std::string stats_json(const Snapshot& snapshot, const std::string& camera) {
+    char text[1024];
+    snprintf(text, sizeof(text),
+        "{\"width\": %u, \"height\": %u, \"pass\": %u, \"samples\": %u, \"restarts\": %u, \"seconds\": %.3f, "
+        "\"rays_per_second\": %.0f, \"camera\": \"%s\"}",
+        snapshot.frame.width, snapshot.frame.height, snapshot.pass, snapshot.frame.samples, snapshot.restarts,
+        snapshot.seconds, snapshot.seconds > 0.0 ? snapshot.rays / snapshot.seconds : 0.0, camera.c_str());
+    return text;
+}
+
+// <index> <r> <g> <b> <roughness> [<emission r> <g> <b>]
+bool parse_material_edit(const std::string& text, uint32_t material_count, MaterialEdit& edit) {
+    std::istringstream line(text);
+    long long index;
+    if (!(line >> index) || index < 0 || index >= material_count)
+        return false;
+    edit.index = (uint32_t)index;
+    float values[7];
+    int count = 0;
+    std::string token;
+    while (line >> token) {
+        char* end;
+        if (count == 7)
+            return false;
+        values[count++] = strtof(token.c_str(), &end);
+        if (*end)
+            return false;
+    }
+    if (count != 4 && count != 7)
+        return false;
+    memcpy(edit.color, values, sizeof(edit.color));
+    edit.roughness = values[3];
+    for (int i = 0; i < 3; ++i)
+        edit.emission[i] = count == 7 ? values[4 + i] : 0.0f;
+    return true;
+}
+
+// One request per connection. Returns false after /stop.
+bool handle_request(socket_t s, PreviewState& state) {
+    HttpRequest request;
+    if (!read_request(s, request)) {
+        send_response(s, "400 Bad Request", "text/plain", "zle zapytanie\n");
+        return true;
+    }
+
+    if (request.method == "GET" && (request.path == "/" || request.path == "/index.html")) {
+        send_response(s, "200 OK", "text/html; charset=utf-8", PAGE);
+    }
+    else if (request.method == "GET" && (request.path == "/frame.png" || request.path == "/stats")) {
+        std::shared_ptr<Snapshot> snapshot;
+        std::string camera;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            snapshot = state.latest;
+            camera = camera_statements(state.camera);
+        }
+        if (!snapshot)
+            send_response(s, "503 Service Unavailable", "text/plain", "brak obrazu\n");
+        else if (request.path == "/frame.png")
+            send_response(s, "200 OK", "image/png", snapshot->encoded());   // outside the lock
+        else
+            send_response(s, "200 OK", "application/json", stats_json(*snapshot, camera));
+    }
+    else if (request.method == "POST" && request.path == "/camera") {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        if (apply_camera_statements(request.body, state.camera)) {
+            state.camera_changed = true;
+            state.interrupt = true;
+            state.changed.notify_all();
+            lock.unlock();
+            send_response(s, "200 OK", "text/plain", "ok\n");
+        }
+        else {
+            lock.unlock();
+            send_response(s, "400 Bad Request", "text/plain", "bledne polecenia kamery\n");
+        }
+    }
+    else if (request.method == "POST" && request.path == "/material") {
+        MaterialEdit edit;
+        std::unique_lock<std::mutex> lock(state.mutex);
+        if (parse_material_edit(request.body, state.material_count, edit)) {
+            state.material_edits.push_back(edit);
+            state.interrupt = true;
+            state.changed.notify_all();
+            lock.unlock();
+            send_response(s, "200 OK", "text/plain", "ok\n");
+        }
+        else {
+            lock.unlock();
+            send_response(s, "400 Bad Request", "text/plain", "bledny material\n");
+        }
+    }
+    else if (request.method == "POST" && request.path == "/stop") {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.stop = true;
+            state.interrupt = true;
+            state.changed.notify_all();
+        }
+        send_response(s, "200 OK", "text/plain", "zakonczono\n");
+        return false;
+    }
+    else {
+        send_response(s, "404 Not Found", "text/plain", "nie znaleziono\n");
+    }
+    return true;
+}
+
+// Requests one at a time; a slow client only delays other clients
+void serve_http(socket_t listener, PreviewState& state) {
+    trace_thread_name("preview http");
+    while (true) {
+        socket_t s = accept(listener, nullptr, nullptr);
+        if (s == INVALID_SOCKET_HANDLE)
+            return;
+        set_receive_timeout(s, 5);
+        bool more = handle_request(s, state);
+        close_socket(s);
+        if (!more)
+            return;
+    }
+}
+
+} // namespace
+
+bool run_preview(const RenderSettings& settings, Framebuffer& framebuffer, Scene& scene, uint32_t num_threads) {
+    if (!net_startup())
+        return false;
+
+    // A bare port is served on this machine only
+    std::string address = settings.preview_address;
+    if (address.find(':') == std::string::npos)
+        address = "127.0.0.1:" + address;
+    socket_t listener = open_socket(address, true);
+    if (listener == INVALID_SOCKET_HANDLE) {
+        printf("Nie mozna nasluchiwac na %s\n", address.c_str());
+        return false;
+    }
+    printf("Podglad: http://%s/ (POST /stop konczy renderowanie)\n", address.c_str());
+
+    PreviewState state;
+    state.camera = scene.camera;
+    state.material_count = scene.materials.size;
+    std::unique_ptr<Camera> camera(new Camera(scene.camera, framebuffer.width, framebuffer.height));
+    std::vector<uint8_t> all_pixels(framebuffer.pixel_count(), 1);
+
+    uint32_t pass = 0, restarts = 0;
+    uint64_t rays_at_start = 0;
+    auto started = std::chrono::steady_clock::now();
+    publish(state, framebuffer, pass, restarts, 0.0, 0);
+
+    std::thread server(serve_http, listener, std::ref(state));
+    {
+        PassPool pool(settings, framebuffer, scene, num_threads, state.interrupt);
+        while (true) {
+            bool restart = false;
+            {
+                // With every sample done, wait for the next edit
+                std::unique_lock<std::mutex> lock(state.mutex);
+                state.changed.wait(lock, [&]() {
+                    return state.stop || state.camera_changed || !state.material_edits.empty() || pass < framebuffer.samples;
+                });
+                if (state.stop)
+                    break;
+                // The render threads are idle between passes, the scene can change
+                if (state.camera_changed) {
+                    scene.camera = state.camera;
+                    state.camera_changed = false;
+                    restart = true;
+                }
+                for (const MaterialEdit& edit : state.material_edits) {
+                    scene.set_material(edit.index, Vec3_simd(edit.color[0], edit.color[1], edit.color[2]), edit.roughness,
+                        Vec3_simd(edit.emission[0], edit.emission[1], edit.emission[2]));
+                    restart = true;
+                }
+                state.material_edits.clear();
+                state.interrupt = false;
+            }
+
+            if (restart) {
+                camera.reset(new Camera(scene.camera, framebuffer.width, framebuffer.height));
+                framebuffer.reset_pixels(all_pixels.data());
+                pass = 0;
+                restarts++;
+                rays_at_start = pool.rays();
+                started = std::chrono::steady_clock::now();
+                publish(state, framebuffer, pass, restarts, 0.0, 0);
+            }
+
+            bool complete;
+            {
+                TraceScope trace("pass");
+                complete = pool.run(*camera, framebuffer.first_sample + pass);
+            }
+            if (complete) {
+                pass++;
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                publish(state, framebuffer, pass, restarts, seconds, pool.rays() - rays_at_start);
+                if (settings.progress) {
+                    printf("\rPodglad: %u / %u probek, zmian: %u", pass, framebuffer.samples, restarts);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    server.join();
+    close_socket(listener);
+    if (is_unix_address(address)) {
+#ifdef _WIN32
+        DeleteFileA(address.substr(5).c_str());
+#else
+        unlink(address.substr(5).c_str());
+#endif
+    }
+    return true;
+}
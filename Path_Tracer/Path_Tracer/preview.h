@@ -0,0 +1,28 @@
+#pragma once
+
+#include "objects.h"
+#include "checkpoint.h"
+#include "settings.h"
+#include <stdint.h>
+
+// Progressive preview over HTTP (--preview <port>).
+//
+// The frame is rendered in passes of one sample per pixel on a pool of threads that lives as
+// long as the preview, so after n passes the framebuffer holds n samples of every pixel. After
+// each pass the accumulation is copied into a snapshot and the threads go straight on; the
+// HTTP thread tone-maps and encodes snapshots itself, once per pass however many requests
+// come, so a browser never holds up rendering.
+//
+//   GET  /            page showing the image as it converges
+//   GET  /frame.png   latest pass, tone-mapped like the final image
+//   GET  /stats       JSON: pass, samples, restarts, seconds, rays per second
+//   POST /camera      camera statements of the scene file (camera, look_at, up, fov, aspect, lens)
+//   POST /material    <index> <r> <g> <b> <roughness> [<emission r> <g> <b>]
+//   POST /stop        finish; the framebuffer is saved as usual
+//
+// A camera or material change cancels the pass in flight, applies the change while the
+// threads wait, and restarts accumulation from sample 0.
+
+// Render `framebuffer` progressively until it has all its samples and /stop is posted.
+// `scene` is changed by the edits posted meanwhile.
+bool run_preview(const RenderSettings& settings, Framebuffer& framebuffer, Scene& scene, uint32_t num_threads);
@@ -1,5 +1,17 @@
 #include "render.h"
+#include "microfacet.h"
+#include "environment.h"
+#include "texture.h"
+#include "stats.h"
+#include "trace.h"
 #include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+thread_local uint64_t rays_traced = 0;
 
 // Adjust ray origin to avoid self-intersection
 inline void adjust(Ray& r) {
@@ -7,106 +19,342 @@ inline void adjust(Ray& r) {
     r.pos.simd = _mm_add_ps(r.pos.simd, _mm_mul_ps(r.dir.simd, offset));
 }
 
-// Perturb ray direction with random sphere sampling
-inline void perturb(Ray& r, float degree) {
-    Vec3_simd v = mul(rand_in_sphere(), degree);
-    r.dir = norm(add(r.dir, v));
-}
-
-// Recursive path tracing function with SIMD optimizations
-Vec3_simd path_tracing(Ray ray, Scene& scene, uint32_t bounces) {
-    Hit hit = {};
-    if (bounces == 0 || !intersect(ray, scene, hit)) {
-        // Background gradient using SIMD
-        const __m128 white = _mm_set_ps(0.0f, 1.0f, 1.0f, 1.0f);
-        const __m128 blue = _mm_set_ps(0.0f, 1.0f, 0.7f, 0.5f);
-
-        // Calculate t factor
-        __m128 dir_y = _mm_shuffle_ps(ray.dir.simd, ray.dir.simd, _MM_SHUFFLE(1, 1, 1, 1));
-        __m128 t = _mm_mul_ps(_mm_add_ps(dir_y, _mm_set1_ps(1.0f)), _mm_set1_ps(0.5f));
-        t = saturate__m128(t);
-
-        // Lerp between white and blue
-        __m128 one_minus_t = _mm_sub_ps(_mm_set1_ps(1.0f), t);
-        __m128 result = _mm_add_ps(
-            _mm_mul_ps(white, t),
-            _mm_mul_ps(blue, one_minus_t)
-        );
-        return Vec3_simd(result);
+static const float PI = 3.14159265f;
+
+// Sky gradient seen by rays that leave the scene
+static inline Vec3_simd background(const Ray& ray) {
+    // Background gradient using SIMD
+    const __m128 white = _mm_set_ps(0.0f, 1.0f, 1.0f, 1.0f);
+    const __m128 blue = _mm_set_ps(0.0f, 1.0f, 0.7f, 0.5f);
+
+    // Calculate t factor
+    __m128 dir_y = _mm_shuffle_ps(ray.dir.simd, ray.dir.simd, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 t = _mm_mul_ps(_mm_add_ps(dir_y, _mm_set1_ps(1.0f)), _mm_set1_ps(0.5f));
+    t = saturate__m128(t);
+
+    // Lerp between white and blue
+    __m128 one_minus_t = _mm_sub_ps(_mm_set1_ps(1.0f), t);
+    __m128 result = _mm_add_ps(
+        _mm_mul_ps(white, t),
+        _mm_mul_ps(blue, one_minus_t)
+    );
+    return Vec3_simd(result);
+}
+
+// Cone of directions from `from` towards a sphere: cosine of its half angle and the density
+// of sampling it uniformly. The density is 0 from inside the sphere.
+template <typename Math>
+static inline float sphere_cone_pdf(const Sphere& sphere, Vec3_simd from, float& cos_max) {
+    Vec3_simd to_center = sub(sphere.pos, from);
+    float dist_sq = dot(to_center, to_center);
+    float radius_sq = sphere.radius * sphere.radius;
+    if (dist_sq <= radius_sq)
+        return 0.0f;
+    cos_max = Math::sqrt(1.0f - radius_sq / dist_sq);
+    // 1 - cos_max without the cancellation for small or distant spheres
+    float one_minus_cos = (radius_sq / dist_sq) / (1.0f + cos_max);
+    return 1.0f / (2.0f * PI * one_minus_cos);
+}
+
+// Power heuristic weight of a strategy with density `pdf` against one with density `other`
+static inline float mis_weight(float pdf, float other) {
+    return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// Light arriving along a ray that left the scene: the environment map, weighted against
+// having sampled it in sample_lights() (`bsdf_pdf` 0: not weighted), or the sky gradient
+template <uint32_t Features>
+static inline Vec3_simd escaped(const Ray& ray, const Scene& scene, float bsdf_pdf) {
+    if (!(Features & FEATURE_ENVIRONMENT) || !scene.environment)
+        return background(ray);
+    float light_pdf;
+    Vec3_simd radiance = scene.environment->eval(ray.dir, light_pdf);
+    return bsdf_pdf > 0.0f ? mul(radiance, mis_weight(bsdf_pdf, light_pdf)) : radiance;
+}
+
+// Albedo of the surface at the hit: the material color, times its texture when it has one.
+// `cone_width` is the width of the ray cone at the hit, which the texture filters over.
+template <uint32_t Features>
+static inline Vec3_simd surface_color(const Scene& scene, const Material& material, const Hit& hit, float cone_width) {
+    if (!(Features & FEATURE_TEXTURES) || material.texture == Material::NO_TEXTURE)
+        return material.color;
+    float scale = material.texture_scale;
+    float footprint = cone_width * hit.uv_density * scale;
+    Vec3_simd texel = scene.textures[material.texture]->sample(hit.u * scale, hit.v * scale, footprint);
+    return Vec3_simd(_mm_mul_ps(material.color.simd, texel.simd));
+}
+
+// Whether anything lies on the ray closer than `distance`
+template <uint32_t Features>
+static inline bool shadowed(const Ray& ray, const Scene& scene, float distance) {
+    rays_traced++;
+    PT_STAT(shadow_rays);
+    return occluded<Features>(ray, scene, distance);
+}
+
+// Light reflected by a rough surface directly, through shadow rays (next-event estimation):
+// every point and directional light, one direction of the environment map picked by
+// brightness, and one emissive sphere picked at random, sampled over the cone it covers.
+template <uint32_t Features>
+static Vec3_simd sample_lights(const Scene& scene, const Hit& hit, const GGXLobe& lobe, Sampler& sampler) {
+    typedef KernelMath<Features> Math;
+    Vec3_simd result;
+    Ray shadow;
+
+    for (const Light& light : scene.lights) {
+        float distance = 3.4e38f;
+        float falloff = 1.0f;
+        if (light.type == Light::POINT) {
+            Vec3_simd to_light = sub(light.position, hit.pos);
+            float dist_sq = dot(to_light, to_light);
+            distance = Math::sqrt(dist_sq);
+            falloff = 1.0f / dist_sq;
+            shadow.dir = mul(to_light, Math::rcp(distance));
+        }
+        else {
+            shadow.dir = mul(light.position, -1.0f);
+        }
+
+        // Lights are points in direction space, only this strategy can find them
+        float bsdf_pdf;
+        Vec3_simd f = ggx_eval<Math>(lobe, shadow.dir, bsdf_pdf);
+        if (bsdf_pdf == 0.0f)
+            continue;
+        shadow.pos = hit.pos;
+        adjust(shadow);
+        if (!shadowed<Features>(shadow, scene, distance))
+            result = add(result, mul(mul(f, light.intensity), falloff));
     }
 
-    bounces--;
+    if ((Features & FEATURE_ENVIRONMENT) && scene.environment) {
+        Vec3_simd radiance;
+        float light_pdf;
+        if (scene.environment->sample(sampler, shadow.dir, radiance, light_pdf)) {
+            float bsdf_pdf;
+            Vec3_simd f = ggx_eval<Math>(lobe, shadow.dir, bsdf_pdf);
+            shadow.pos = hit.pos;
+            adjust(shadow);
+            if (bsdf_pdf > 0.0f && !shadowed<Features>(shadow, scene, 3.4e38f))
+                result = add(result, mul(mul(f, radiance), mis_weight(light_pdf, bsdf_pdf) / light_pdf));
+        }
+    }
+
+    // Emitters are spheres
+    if ((Features & FEATURE_SPHERES) && scene.emitters.size > 0) {
+        uint32_t pick = (uint32_t)(randf(sampler) * scene.emitters.size);
+        if (pick >= scene.emitters.size)
+            pick = scene.emitters.size - 1;
+        const Sphere& sphere = scene.spheres[scene.emitters[pick]];
+        float u1 = randf(sampler);
+        float u2 = randf(sampler);
+
+        float cos_max;
+        float cone_pdf = sphere_cone_pdf<Math>(sphere, hit.pos, cos_max);
+        if (cone_pdf == 0.0f)
+            return result;
 
-    // Calculate reflection with SIMD
-    Vec3_simd reflected = reflect(ray.dir, hit.normal);
+        // Uniform direction in the cone, in a basis around the direction to the center
+        float cos_theta = 1.0f - u1 * (1.0f - cos_max);
+        float sin_theta = Math::sqrt(1.0f - cos_theta * cos_theta > 0.0f ? 1.0f - cos_theta * cos_theta : 0.0f);
+        float sin_phi, cos_phi;
+        Math::sincos(2.0f * PI * u2, sin_phi, cos_phi);
+        Vec3_simd w = Math::norm(sub(sphere.pos, hit.pos));
+        Vec3_simd t, bt;
+        make_basis(w, t, bt);
+        shadow.dir = add(add(mul(t, sin_theta * cos_phi), mul(bt, sin_theta * sin_phi)), mul(w, cos_theta));
 
-    // Prepare bounced ray
-    Ray ray_bounce;
-    ray_bounce.pos = hit.pos;
-    ray_bounce.dir = reflected;
-    adjust(ray_bounce);
-    perturb(ray_bounce, hit.roughness);
+        float bsdf_pdf;
+        Vec3_simd f = ggx_eval<Math>(lobe, shadow.dir, bsdf_pdf);
+        if (bsdf_pdf == 0.0f)
+            return result;
+        shadow.pos = hit.pos;
+        adjust(shadow);
 
-    // Recursive call with SIMD color multiplication
-    Vec3_simd bounce_color = path_tracing(ray_bounce, scene, bounces);
-    return mul(hit.color, bounce_color);
+        // Distance to the near side of the sphere; the sphere itself is not closer than that
+        Vec3_simd to_center = sub(sphere.pos, shadow.pos);
+        float along = dot(shadow.dir, to_center);
+        float offset_sq = dot(to_center, to_center) - along * along;
+        float radius_sq = sphere.radius * sphere.radius;
+        if (offset_sq >= radius_sq)
+            return result;  // grazing direction at the edge of the cone
+        float distance = along - Math::sqrt(radius_sq - offset_sq);
+
+        if (!shadowed<Features>(shadow, scene, distance * (1.0f - 1e-4f))) {
+            // f * emission / light_pdf, weighted against finding the sphere by BSDF sampling
+            float light_pdf = cone_pdf / scene.emitters.size;
+            result = add(result, mul(mul(f, scene.materials[sphere.material].emission), mis_weight(light_pdf, bsdf_pdf) / light_pdf));
+        }
+    }
+    return result;
 }
 
-// Render function with SIMD optimizations
-Vec3_simd render(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t bounces, uint32_t samples, Scene& scene) {
-    // Camera setup with SIMD
-    Vec3_simd camera_pos = { 0.0f, 0.0f, -3.0f };
-    float camera_near = 0.5f;
-    float aspect_ratio = width / (float)height;
+// Path tracing with next-event estimation over GGX reflection (microfacet.h), the material
+// roughness being the GGX roughness and 0 a perfect mirror. Light is gathered at every rough
+// bounce from shadow rays and where a path hits an emitter or escapes to the sky; emitters
+// and the environment map, which are also light sampled, are weighted with multiple importance sampling, so each light
+// path is counted once. The ray leaving the last bounce is still traced, but only for the
+// light it reaches, which keeps light sampling at the last bounce matched by its BSDF counterpart.
+//
+// Textures are filtered over the width of a ray cone (Akenine-Moller et al.) that starts at
+// the pixel (`pixel_spread`, the angle the camera ray's pixel covers) and widens with the roughness of
+// every surface it bounces off, so textures seen through rough reflections are read from small
+// mip levels.
+template <uint32_t Features>
+static Vec3_simd trace_path(Ray ray, Scene& scene, uint32_t bounces, Sampler& sampler, float pixel_spread) {
+    typedef KernelMath<Features> Math;
+    Vec3_simd radiance;
+    Vec3_simd throughput = splat(1.0f);
+    float bsdf_pdf = 0.0f;      // density the current ray was sampled with, 0 for camera and mirror rays
+    Vec3_simd previous_pos;
+    float cone_width = 0.0f;
+    float cone_spread = pixel_spread;
 
-    // Base pixel position calculation
-    __m128 x_coord = _mm_sub_ps(
-        _mm_mul_ps(_mm_set1_ps(aspect_ratio), _mm_div_ps(_mm_set1_ps((float)x), _mm_set1_ps((float)width))),
-        _mm_mul_ps(_mm_set1_ps((aspect_ratio - 1.0f) * 0.5f + 0.5f), _mm_set1_ps(1.0f))
-    );
+    while (true) {
+        Hit hit = {};
+        rays_traced++;
+        PT_STAT(rays);
+        if (!intersect<Features>(ray, scene, hit)) {
+            PT_STAT(escaped_rays);
+            return add(radiance, mul(throughput, escaped<Features>(ray, scene, bsdf_pdf)));
+        }
 
-    __m128 y_coord = _mm_sub_ps(
-        _mm_div_ps(_mm_set1_ps((float)y), _mm_set1_ps((float)height)),
-        _mm_set1_ps(0.5f)
-    );
+        const Material& material = scene.materials[hit.material];
+        cone_width += cone_spread * hit.distance;
+        if (_mm_movemask_ps(_mm_cmpgt_ps(material.emission.simd, _mm_setzero_ps())) & 7) {
+            float weight = 1.0f;
+            float cos_max;
+            if ((Features & FEATURE_SPHERES) && bsdf_pdf > 0.0f && hit.sphere) {
+                float light_pdf = sphere_cone_pdf<Math>(*hit.sphere, previous_pos, cos_max) / scene.emitters.size;
+                weight = mis_weight(bsdf_pdf, light_pdf);
+            }
+            radiance = add(radiance, mul(mul(throughput, material.emission), weight));
+        }
 
-    __m128 z_coord = _mm_add_ps(camera_pos.simd, _mm_set1_ps(camera_near));
+        if (bounces == 0)
+            return radiance;
+        bounces--;
+        PT_STAT(bounces);
 
-    Vec3_simd pixel_pos;
-    pixel_pos.simd = _mm_blend_ps(
-        _mm_blend_ps(x_coord, y_coord, 0b0010),
-        z_coord,
-        0b0100
-    );
+        if (material.roughness > 0.0f) {
+            GGXLobe lobe = ggx_lobe<Math>(hit.normal, ray.dir, surface_color<Features>(scene, material, hit, cone_width), material.roughness);
+            if (scene.lights.size > 0 || ((Features & FEATURE_SPHERES) && scene.emitters.size > 0) ||
+                ((Features & FEATURE_ENVIRONMENT) && scene.environment))
+                radiance = add(radiance, mul(throughput, sample_lights<Features>(scene, hit, lobe, sampler)));
 
-    // Sub-pixel calculations
-    float sub_x = aspect_ratio / width;
-    float sub_y = 1.0f / height;
+            // Importance sampled reflection, the path ends when it would go below the surface
+            Vec3_simd weight;
+            float u1 = randf(sampler);
+            float u2 = randf(sampler);
+            if (!ggx_sample<Math>(lobe, u1, u2, ray.dir, weight, bsdf_pdf))
+                return radiance;
+            throughput = mul(throughput, weight);
+            cone_spread += material.roughness;
+        }
+        else {
+            // Mirror: only reaches lights by reflection
+            Vec3_simd reflected = reflect(ray.dir, hit.normal);
+            float cos_theta = fabsf(dot(ray.dir, hit.normal));
+            throughput = mul(throughput, fresnel_schlick(surface_color<Features>(scene, material, hit, cone_width), cos_theta));
+            ray.dir = reflected;
+            bsdf_pdf = 0.0f;
+        }
 
-    // Accumulate color with SIMD
+        // Prepare bounced ray
+        ray.pos = hit.pos;
+        adjust(ray);
+        previous_pos = hit.pos;
+    }
+}
+
+template <uint32_t Features>
+static Vec3_simd render_pixel(uint32_t x, uint32_t y, const Camera& camera, uint32_t bounces,
+    uint32_t first_sample, uint32_t samples, Scene& scene, uint64_t seed) {
+    const uint32_t pixel = x + y * camera.width;
     __m128 color_acc = _mm_setzero_ps();
-    __m128 inv_samples = _mm_set1_ps(1.0f / samples);
 
-    for (uint32_t i = 0; i < samples; ++i) {
-        // Random offset within pixel
-        Vec3_simd rand_pixel_pos = pixel_pos;
-        float rand_x = randf() * sub_x - 0.5f * sub_x;
-        float rand_y = randf() * sub_y - 0.5f * sub_y;
+    // Camera rays are generated four samples at a time
+    for (uint32_t first = 0; first < samples; first += 4) {
+        uint32_t count = samples - first < 4 ? samples - first : 4;
+        Sampler samplers[4];
+        CameraSample camera_samples[4];
+        for (uint32_t i = 0; i < count; ++i) {
+            samplers[i] = sampler_start(seed, pixel, first_sample + first + i);
+            // Random position within the pixel, then on the lens
+            camera_samples[i].px = x + randf(samplers[i]);
+            camera_samples[i].py = y + randf(samplers[i]);
+            camera_samples[i].lens_u = randf(samplers[i]);
+            camera_samples[i].lens_v = randf(samplers[i]);
+        }
 
-        rand_pixel_pos.x += rand_x;
-        rand_pixel_pos.y += rand_y;
+        Ray rays[4];
+        camera.generate_rays(camera_samples, count, rays);
+        for (uint32_t i = 0; i < count; ++i) {
+            PT_STAT(samples);
+            color_acc = _mm_add_ps(color_acc, trace_path<Features>(rays[i], scene, bounces, samplers[i], camera.pixel_spread()).simd);
+        }
+    }
 
-        // Create ray
-        Ray ray;
-        ray.pos = rand_pixel_pos;
-        ray.dir = norm(sub(rand_pixel_pos, camera_pos));
+    // Sum of samples, averaged by the caller over all accumulated samples
+    return Vec3_simd(color_acc);
+}
 
-        // Accumulate color
-        color_acc = _mm_add_ps(color_acc, path_tracing(ray, scene, bounces).simd);
-    }
+#define PT_KERNEL_ENTRY(F) &render_pixel<F>,
+static const RenderKernel KERNELS[] = { PT_FEATURE_SETS(PT_KERNEL_ENTRY) };
+static bool specialized_kernels = true;
+static bool fast_math = false;
 
-    // Average samples
-    Vec3_simd result;
-    result.simd = _mm_mul_ps(color_acc, inv_samples);
-    return result;
-}
\ No newline at end of file
+void set_specialized_kernels(bool enabled) {
+    specialized_kernels = enabled;
+}
+
+void set_fast_math(bool enabled) {
+    fast_math = enabled;
+}
+
+RenderKernel render_kernel(const Scene& scene) {
+    uint32_t features = specialized_kernels ? scene.features() : FEATURE_ALL;
+    return KERNELS[fast_math ? features | FEATURE_FAST_MATH : features];
+}
+
+uint32_t tile_count(uint32_t width, uint32_t height, uint32_t tile_size) {
+    return ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+}
+
+Tile tile_rect(uint32_t tile_index, uint32_t width, uint32_t height, uint32_t tile_size) {
+    uint32_t num_tiles_x = (width + tile_size - 1) / tile_size;
+    Tile tile;
+    tile.x0 = (tile_index % num_tiles_x) * tile_size;
+    tile.y0 = (tile_index / num_tiles_x) * tile_size;
+    tile.x1 = tile.x0 + tile_size < width ? tile.x0 + tile_size : width;
+    tile.y1 = tile.y0 + tile_size < height ? tile.y0 + tile_size : height;
+    return tile;
+}
+
+// Current value of the counter a cost map is measured in
+static inline uint64_t cost_counter(Framebuffer::CostMetric metric) {
+    return metric == Framebuffer::COST_CYCLES ? __rdtsc() : rays_traced;
+}
+
+void render_tile(const Tile& tile, Framebuffer& framebuffer, Scene& scene, const Camera& camera) {
+    TraceScope trace("tile", (int32_t)tile.x0, (int32_t)tile.y0);
+    RenderStats stats_before = stats_snapshot();
+    const RenderKernel kernel = render_kernel(scene);
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+            uint32_t pixel_index = x + y * framebuffer.width;
+            uint32_t count = framebuffer.counts[pixel_index];
+            if (count >= framebuffer.samples)
+                continue; // already rendered (resumed or re-issued tile)
+
+            framebuffer.begin_pixel(pixel_index);
+            uint32_t new_samples = framebuffer.samples - count;
+            uint64_t cost_start = framebuffer.cost ? cost_counter(framebuffer.cost_metric) : 0;
+            Vec3_simd color = kernel(x, y, camera, framebuffer.bounces,
+                framebuffer.first_sample + count, new_samples, scene, framebuffer.seed);
+            if (framebuffer.cost)
+                framebuffer.cost[pixel_index] += cost_counter(framebuffer.cost_metric) - cost_start;
+            framebuffer.end_pixel(pixel_index, color, new_samples);
+        }
+    }
+    stats_record_tile(tile.x0, tile.y0, tile.x1, tile.y1, stats_before);
+}
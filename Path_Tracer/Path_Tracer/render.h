@@ -2,9 +2,38 @@
 
 #include "objects.h"
 #include "intersections.h"
+#include "checkpoint.h"
+#include "camera.h"
 #include <stdint.h>
 
+// Rays traced by the calling thread so far (one per intersect() of a render kernel, shadow rays included), for throughput figures
+extern thread_local uint64_t rays_traced;
+
 void adjust(Ray& r);
-void perturb(Ray& r, float degree);
-Vec3_simd path_tracing(Ray ray, Scene& scene, uint32_t bounces);
-Vec3_simd render(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t bounces, uint32_t samples, Scene& scene);
\ No newline at end of file
+// Sum (not the average) of samples first_sample .. first_sample + samples - 1 of pixel (x, y),
+// so it can be added to an accumulation buffer. One is compiled for each set of SceneFeature
+// bits (see intersections.h).
+typedef Vec3_simd (*RenderKernel)(uint32_t x, uint32_t y, const Camera& camera, uint32_t bounces,
+    uint32_t first_sample, uint32_t samples, Scene& scene, uint64_t seed);
+// The kernel for exactly what `scene` contains, chosen once per tile rather than per pixel.
+// All kernels of one math mode give the same image; the generic one only does more tests
+// and branches.
+RenderKernel render_kernel(const Scene& scene);
+// false: always use the FEATURE_ALL kernel (--generic-kernel, for comparing speed)
+void set_specialized_kernels(bool enabled);
+// true: kernels with approximate square roots, divisions and sines (--fast-math, fast_math.h).
+// Unlike the choice of kernel this changes the image, by about the error --bench-accuracy reports.
+void set_fast_math(bool enabled);
+
+// Pixel rectangle of one image tile, x1/y1 exclusive
+struct Tile {
+    uint32_t x0, y0, x1, y1;
+};
+
+uint32_t tile_count(uint32_t width, uint32_t height, uint32_t tile_size);
+Tile tile_rect(uint32_t tile_index, uint32_t width, uint32_t height, uint32_t tile_size);
+
+// Render every pixel of the tile that does not have all its samples yet.
+// Random numbers depend only on the pixel and sample index, so the result does not depend
+// on which thread or process rendered the tile, or whether the render was interrupted.
+void render_tile(const Tile& tile, Framebuffer& framebuffer, Scene& scene, const Camera& camera);
@@ -0,0 +1,331 @@
+#include "scene_cache.h"
+#include "scene_file.h"
+#include "mapped_file.h"
+#include "environment.h"
+#include "texture.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char SCENE_CACHE_MAGIC[8] = { 'P', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+static const uint32_t SCENE_CACHE_VERSION = 7;
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void hash_bytes(uint64_t& hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+}
+
+static void hash_vec3(uint64_t& hash, const Vec3_simd& v) {
+    float xyz[3] = { v.x, v.y, v.z };
+    hash_bytes(hash, xyz, sizeof(xyz));
+}
+
+// CameraSettings <-> the header's camera array, in the order given in SceneCacheHeader
+static void store_camera(const CameraSettings& camera, float* values) {
+    const Vec3_simd* vectors[3] = { &camera.position, &camera.look_at, &camera.up };
+    for (int i = 0; i < 3; ++i) {
+        values[3 * i + 0] = vectors[i]->x;
+        values[3 * i + 1] = vectors[i]->y;
+        values[3 * i + 2] = vectors[i]->z;
+    }
+    values[9] = camera.fov;
+    values[10] = camera.aspect;
+    values[11] = camera.aperture;
+    values[12] = camera.focus_distance;
+}
+
+static CameraSettings load_camera(const float* values) {
+    CameraSettings camera;
+    camera.position = Vec3_simd(values[0], values[1], values[2]);
+    camera.look_at = Vec3_simd(values[3], values[4], values[5]);
+    camera.up = Vec3_simd(values[6], values[7], values[8]);
+    camera.fov = values[9];
+    camera.aspect = values[10];
+    camera.aperture = values[11];
+    camera.focus_distance = values[12];
+    return camera;
+}
+
+bool hash_file(const char* path, uint64_t& hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    hash = 0xCBF29CE484222325ull;
+    unsigned char buffer[1 << 16];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        hash_bytes(hash, buffer, read);
+    fclose(file);
+    return true;
+}
+
+uint64_t hash_scene(const Scene& scene) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (const Sphere& sphere : scene.spheres) {
+        hash_vec3(hash, sphere.pos);
+        hash_bytes(hash, &sphere.radius, sizeof(float));
+        hash_bytes(hash, &sphere.material, sizeof(uint32_t));
+    }
+    for (const Plane& plane : scene.planes) {
+        hash_vec3(hash, plane.normal);
+        hash_bytes(hash, &plane.distance, sizeof(float));
+        hash_bytes(hash, &plane.material, sizeof(uint32_t));
+    }
+    for (const Triangle& triangle : scene.triangles) {
+        hash_vec3(hash, triangle.v0);
+        hash_vec3(hash, triangle.edge1);
+        hash_vec3(hash, triangle.edge2);
+        hash_bytes(hash, &triangle.material, sizeof(uint32_t));
+        hash_bytes(hash, &triangle.uv, sizeof(uint32_t));
+    }
+    for (const TriangleUV& uv : scene.triangle_uvs)
+        hash_bytes(hash, &uv, sizeof(TriangleUV));
+    for (const Material& material : scene.materials) {
+        hash_vec3(hash, material.color);
+        hash_vec3(hash, material.emission);
+        hash_bytes(hash, &material.roughness, sizeof(float));
+        hash_bytes(hash, &material.texture, sizeof(uint32_t));
+        hash_bytes(hash, &material.texture_scale, sizeof(float));
+    }
+    for (const Light& light : scene.lights) {
+        hash_vec3(hash, light.position);
+        hash_vec3(hash, light.intensity);
+        hash_bytes(hash, &light.type, sizeof(uint32_t));
+    }
+    float camera[16] = {};
+    store_camera(scene.camera, camera);
+    hash_bytes(hash, camera, sizeof(camera));
+    if (scene.environment) {
+        // The file name and size rather than the path, which may differ between machines
+        size_t slash = scene.environment_path.find_last_of("/\\");
+        std::string name = slash == std::string::npos ? scene.environment_path : scene.environment_path.substr(slash + 1);
+        uint32_t size[2] = { scene.environment->width(), scene.environment->height() };
+        hash_bytes(hash, name.data(), name.size());
+        hash_bytes(hash, size, sizeof(size));
+        hash_bytes(hash, &scene.environment_scale, sizeof(float));
+    }
+    for (size_t i = 0; i < scene.textures.size(); ++i) {
+        const std::string& path = scene.texture_paths[i];
+        size_t slash = path.find_last_of("/\\");
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        uint32_t size[2] = { scene.textures[i]->width(), scene.textures[i]->height() };
+        hash_bytes(hash, name.data(), name.size() + 1);
+        hash_bytes(hash, size, sizeof(size));
+    }
+    return hash;
+}
+
+bool load_scene_cache(const char* cache_path, uint64_t source_hash, Scene& scene, RenderSettings& settings) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(cache_path, MappedFile::READ_ONLY))
+        return false;
+
+    const uint8_t* base = (const uint8_t*)file->data();
+    const SceneCacheHeader* header = (const SceneCacheHeader*)base;
+    if (file->size() < sizeof(SceneCacheHeader) ||
+        memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) != 0 ||
+        header->version != SCENE_CACHE_VERSION ||
+        header->header_size != sizeof(SceneCacheHeader) ||
+        header->sphere_size != sizeof(Sphere) ||
+        header->plane_size != sizeof(Plane) ||
+        header->bvh_node_size != sizeof(BVHNode) ||
+        header->triangle_size != sizeof(Triangle) ||
+        header->light_size != sizeof(Light) ||
+        header->material_size != sizeof(Material) ||
+        header->triangle_uv_size != sizeof(TriangleUV) ||
+        header->source_hash != source_hash)
+        return false;
+
+    // Every array has to lie inside the file
+    if (header->sphere_offset + (uint64_t)header->sphere_count * sizeof(Sphere) > file->size() ||
+        header->plane_offset + (uint64_t)header->plane_count * sizeof(Plane) > file->size() ||
+        header->bvh_offset + (uint64_t)header->bvh_node_count * sizeof(BVHNode) > file->size() ||
+        header->triangle_offset + (uint64_t)header->triangle_count * sizeof(Triangle) > file->size() ||
+        header->triangle_bvh_offset + (uint64_t)header->triangle_bvh_node_count * sizeof(BVHNode) > file->size() ||
+        header->light_offset + (uint64_t)header->light_count * sizeof(Light) > file->size() ||
+        header->material_offset + (uint64_t)header->material_count * sizeof(Material) > file->size() ||
+        header->environment_path_offset + header->environment_path_length > file->size() ||
+        header->triangle_uv_offset + (uint64_t)header->triangle_uv_count * sizeof(TriangleUV) > file->size() ||
+        header->texture_paths_offset + header->texture_paths_length > file->size())
+        return false;
+
+    // The environment map and textures are opened into locals first: if one fails, the scene
+    // and settings are left as they were for the fallback to the scene file
+    std::shared_ptr<EnvironmentMap> environment;
+    std::string environment_path;
+    if (header->environment_path_length) {
+        environment_path.assign((const char*)base + header->environment_path_offset, header->environment_path_length);
+        std::unique_ptr<EnvironmentMap> map(new EnvironmentMap());
+        if (!map->load(environment_path.c_str(), header->environment_scale))
+            return false;
+        environment = std::move(map);
+    }
+    // Textures are reopened in their original order, which the materials refer to
+    std::vector<std::shared_ptr<Texture>> textures;
+    std::vector<std::string> texture_paths;
+    const char* texture_path = (const char*)base + header->texture_paths_offset;
+    const char* texture_paths_end = texture_path + header->texture_paths_length;
+    for (uint32_t i = 0; i < header->texture_count; ++i) {
+        const char* end = (const char*)memchr(texture_path, 0, texture_paths_end - texture_path);
+        if (!end)
+            return false;
+        std::unique_ptr<Texture> texture(new Texture());
+        if (!texture->open(std::string(texture_path, end)))
+            return false;
+        textures.push_back(std::move(texture));
+        texture_paths.push_back(std::string(texture_path, end));
+        texture_path = end + 1;
+    }
+
+    Span<Sphere> spheres;
+    spheres.data = (const Sphere*)(base + header->sphere_offset);
+    spheres.size = header->sphere_count;
+    Span<Plane> planes;
+    planes.data = (const Plane*)(base + header->plane_offset);
+    planes.size = header->plane_count;
+    Span<BVHNode> bvh;
+    bvh.data = (const BVHNode*)(base + header->bvh_offset);
+    bvh.size = header->bvh_node_count;
+    Span<Triangle> triangles;
+    triangles.data = (const Triangle*)(base + header->triangle_offset);
+    triangles.size = header->triangle_count;
+    Span<BVHNode> triangle_bvh;
+    triangle_bvh.data = (const BVHNode*)(base + header->triangle_bvh_offset);
+    triangle_bvh.size = header->triangle_bvh_node_count;
+    Span<Light> lights;
+    lights.data = (const Light*)(base + header->light_offset);
+    lights.size = header->light_count;
+    Span<Material> materials;
+    materials.data = (const Material*)(base + header->material_offset);
+    materials.size = header->material_count;
+    Span<TriangleUV> triangle_uvs;
+    triangle_uvs.data = (const TriangleUV*)(base + header->triangle_uv_offset);
+    triangle_uvs.size = header->triangle_uv_count;
+
+    settings.width = header->width;
+    settings.height = header->height;
+    settings.samples = header->samples;
+    settings.bounces = header->bounces;
+    settings.tile_size = header->tile_size;
+    scene.camera = load_camera(header->camera);
+    if (environment) {
+        scene.environment = std::move(environment);
+        scene.environment_path = std::move(environment_path);
+        scene.environment_scale = header->environment_scale;
+    }
+    scene.textures = std::move(textures);
+    scene.texture_paths = std::move(texture_paths);
+    scene.attach(std::move(file), spheres, planes, bvh, triangles, triangle_bvh, triangle_uvs, lights, materials);
+    return true;
+}
+
+bool write_scene_cache(const char* cache_path, uint64_t source_hash, const Scene& scene, const RenderSettings& settings) {
+    SceneCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    header.version = SCENE_CACHE_VERSION;
+    header.header_size = sizeof(SceneCacheHeader);
+    header.sphere_size = sizeof(Sphere);
+    header.plane_size = sizeof(Plane);
+    header.bvh_node_size = sizeof(BVHNode);
+    header.triangle_size = sizeof(Triangle);
+    header.light_size = sizeof(Light);
+    header.material_size = sizeof(Material);
+    header.source_hash = source_hash;
+
+    header.width = settings.width;
+    header.height = settings.height;
+    header.samples = settings.samples;
+    header.bounces = settings.bounces;
+    header.tile_size = settings.tile_size;
+    store_camera(scene.camera, header.camera);
+
+    header.sphere_count = scene.spheres.size;
+    header.plane_count = scene.planes.size;
+    header.bvh_node_count = scene.bvh.size;
+    header.triangle_count = scene.triangles.size;
+    header.triangle_bvh_node_count = scene.triangle_bvh.size;
+    header.light_count = scene.lights.size;
+    header.material_count = scene.materials.size;
+    header.environment_path_length = scene.environment ? (uint32_t)scene.environment_path.size() : 0;
+    header.environment_scale = scene.environment_scale;
+    header.triangle_uv_size = sizeof(TriangleUV);
+    header.triangle_uv_count = scene.triangle_uvs.size;
+    header.texture_count = (uint32_t)scene.texture_paths.size();
+    std::string texture_paths;
+    for (const std::string& path : scene.texture_paths)
+        texture_paths.append(path.c_str(), path.size() + 1);
+    header.texture_paths_length = (uint32_t)texture_paths.size();
+    header.sphere_offset = align_up(sizeof(SceneCacheHeader), 64);
+    header.plane_offset = align_up(header.sphere_offset + (uint64_t)scene.spheres.size * sizeof(Sphere), 64);
+    header.bvh_offset = align_up(header.plane_offset + (uint64_t)scene.planes.size * sizeof(Plane), 64);
+    header.triangle_offset = align_up(header.bvh_offset + (uint64_t)scene.bvh.size * sizeof(BVHNode), 64);
+    header.triangle_bvh_offset = align_up(header.triangle_offset + (uint64_t)scene.triangles.size * sizeof(Triangle), 64);
+    header.light_offset = align_up(header.triangle_bvh_offset + (uint64_t)scene.triangle_bvh.size * sizeof(BVHNode), 64);
+    header.material_offset = align_up(header.light_offset + (uint64_t)scene.lights.size * sizeof(Light), 64);
+    header.triangle_uv_offset = align_up(header.material_offset + (uint64_t)scene.materials.size * sizeof(Material), 64);
+    header.environment_path_offset = header.triangle_uv_offset + (uint64_t)scene.triangle_uvs.size * sizeof(TriangleUV);
+    header.texture_paths_offset = header.environment_path_offset + header.environment_path_length;
+    uint64_t file_size = header.texture_paths_offset + header.texture_paths_length;
+
+    // Written to a temporary file first, so a reader never maps a half-written cache
+    std::string temp_path = std::string(cache_path) + ".tmp";
+    MappedFile file;
+    if (!file.open(temp_path.c_str(), MappedFile::CREATE, (size_t)file_size))
+        return false;
+
+    uint8_t* base = (uint8_t*)file.data();
+    memset(base, 0, (size_t)file_size);
+    memcpy(base, &header, sizeof(header));
+    if (scene.spheres.size) memcpy(base + header.sphere_offset, scene.spheres.data, scene.spheres.size * sizeof(Sphere));
+    if (scene.planes.size) memcpy(base + header.plane_offset, scene.planes.data, scene.planes.size * sizeof(Plane));
+    if (scene.bvh.size) memcpy(base + header.bvh_offset, scene.bvh.data, scene.bvh.size * sizeof(BVHNode));
+    if (scene.triangles.size) memcpy(base + header.triangle_offset, scene.triangles.data, scene.triangles.size * sizeof(Triangle));
+    if (scene.triangle_bvh.size) memcpy(base + header.triangle_bvh_offset, scene.triangle_bvh.data, scene.triangle_bvh.size * sizeof(BVHNode));
+    if (scene.lights.size) memcpy(base + header.light_offset, scene.lights.data, scene.lights.size * sizeof(Light));
+    if (scene.materials.size) memcpy(base + header.material_offset, scene.materials.data, scene.materials.size * sizeof(Material));
+    if (scene.triangle_uvs.size) memcpy(base + header.triangle_uv_offset, scene.triangle_uvs.data, scene.triangle_uvs.size * sizeof(TriangleUV));
+    if (header.environment_path_length) memcpy(base + header.environment_path_offset, scene.environment_path.data(), header.environment_path_length);
+    if (header.texture_paths_length) memcpy(base + header.texture_paths_offset, texture_paths.data(), header.texture_paths_length);
+    file.close();
+
+    remove(cache_path);
+    return rename(temp_path.c_str(), cache_path) == 0;
+}
+
+// Only the settings a scene can state; everything else comes from defaults and flags
+static void apply_scene_settings(const RenderSettings& from, RenderSettings& to) {
+    to.width = from.width;
+    to.height = from.height;
+    to.samples = from.samples;
+    to.bounces = from.bounces;
+    to.tile_size = from.tile_size;
+}
+
+bool load_scene(const char* scene_path, const std::string& cache_path, Scene& scene, RenderSettings& settings) {
+    uint64_t source_hash = 0;
+    bool use_cache = !cache_path.empty() && hash_file(scene_path, source_hash);
+
+    // Defaults plus the scene's own statements, so the cache never stores values of flags
+    RenderSettings scene_settings;
+    if (use_cache && load_scene_cache(cache_path.c_str(), source_hash, scene, scene_settings)) {
+        apply_scene_settings(scene_settings, settings);
+        return true;
+    }
+
+    if (!load_scene_file(scene_path, scene, scene_settings))
+        return false;
+    scene.build_bvh();
+    apply_scene_settings(scene_settings, settings);
+
+    if (use_cache && !write_scene_cache(cache_path.c_str(), source_hash, scene, scene_settings))
+        printf("Nie udalo sie zapisac pamieci podrecznej sceny: %s\n", cache_path.c_str());
+    return true;
+}
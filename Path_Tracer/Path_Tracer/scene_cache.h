@@ -0,0 +1,69 @@
+#pragma once
+
+#include "objects.h"
+#include "settings.h"
+
+// Versioned binary scene cache: shapes, the prebuilt BVH and the scene's render settings.
+// An environment map stays in its .hdr file and textures in their tiled files; the cache
+// stores their paths.
+// The file is mapped and the scene arrays point straight into it, nothing is deserialized.
+// It is tied to the source scene by a content hash and rebuilt when the source changes.
+struct SceneCacheHeader {
+    char magic[8];              // "PTSCENE\0"
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t sphere_size;       // record sizes guard against layout changes
+    uint32_t plane_size;
+    uint32_t bvh_node_size;
+    uint32_t triangle_size;
+    uint32_t light_size;
+    uint32_t material_size;
+    uint32_t triangle_uv_size;
+    uint64_t source_hash;       // FNV-1a of the source scene file
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;
+    uint32_t bounces;
+    uint32_t tile_size;
+    uint32_t sphere_count;
+    uint32_t plane_count;
+    uint32_t bvh_node_count;
+    uint32_t triangle_count;
+    uint32_t triangle_bvh_node_count;
+    uint32_t light_count;
+    uint32_t material_count;
+    uint32_t environment_path_length;   // 0 = no environment map
+    float environment_scale;
+    uint32_t triangle_uv_count;
+    uint32_t texture_count;
+    uint32_t texture_paths_length;      // texture paths, each followed by a NUL
+    float camera[16];           // CameraSettings: position, look_at, up, fov, aspect, aperture, focus_distance
+
+    uint64_t sphere_offset;     // byte offsets from the start of the file, 64-byte aligned
+    uint64_t plane_offset;
+    uint64_t bvh_offset;
+    uint64_t triangle_offset;
+    uint64_t triangle_bvh_offset;
+    uint64_t light_offset;
+    uint64_t material_offset;
+    uint64_t environment_path_offset;   // the map is loaded from its own file, only the path is stored
+    uint64_t triangle_uv_offset;
+    uint64_t texture_paths_offset;
+    uint8_t _reserved[8];
+};
+
+// 64-bit FNV-1a hash of a file's contents
+bool hash_file(const char* path, uint64_t& hash);
+// 64-bit FNV-1a hash of the scene contents (field by field, padding is not hashed)
+uint64_t hash_scene(const Scene& scene);
+
+// Map a cache file and attach its arrays to `scene`. Fails if the file is missing,
+// has another version or layout, or was built from a different source.
+bool load_scene_cache(const char* cache_path, uint64_t source_hash, Scene& scene, RenderSettings& settings);
+bool write_scene_cache(const char* cache_path, uint64_t source_hash, const Scene& scene, const RenderSettings& settings);
+
+// Load a scene file through its cache: use the cache when it matches the source,
+// otherwise parse the text, build the BVH and write a new cache.
+// An empty `cache_path` disables the cache.
+bool load_scene(const char* scene_path, const std::string& cache_path, Scene& scene, RenderSettings& settings);
@@ -0,0 +1,310 @@
+#include "scene_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+static bool parse_float(const std::string& token, float& value) {
+    char* end;
+    value = strtof(token.c_str(), &end);
+    return !token.empty() && *end == 0;
+}
+
+// Read the floats on the rest of the line, at most `max_count`; -1 if anything else is there
+static int read_float_list(std::istringstream& line, float* values, int max_count) {
+    int count = 0;
+    std::string token;
+    while (line >> token) {
+        if (count == max_count || !parse_float(token, values[count++]))
+            return -1;
+    }
+    return count;
+}
+
+// Read `count` floats and leave the rest of the line
+static bool read_leading_floats(std::istringstream& line, float* values, int count) {
+    std::string token;
+    for (int i = 0; i < count; ++i) {
+        if (!(line >> token) || !parse_float(token, values[i]))
+            return false;
+    }
+    return true;
+}
+
+typedef std::map<std::string, uint32_t> MaterialNames;
+typedef std::map<std::string, uint32_t> TextureNames;
+
+// Material properties on the rest of the line:
+// <r> <g> <b> <roughness> [<emission r> <g> <b>] [texture <name> [<scale>]]
+static bool read_material_values(std::istringstream& line, const TextureNames& textures, Scene& scene, uint32_t& material) {
+    float v[7];
+    int count = 0;
+    uint32_t texture = Material::NO_TEXTURE;
+    float texture_scale = 1.0f;
+    std::string token;
+    while (line >> token) {
+        if (token == "texture") {
+            std::string name;
+            if (!(line >> name) || !textures.count(name))
+                return false;
+            texture = textures.find(name)->second;
+            int scale_count = read_float_list(line, &texture_scale, 1);
+            if (scale_count < 0 || !(texture_scale > 0.0f))
+                return false;
+            break;
+        }
+        if (count == 7 || !parse_float(token, v[count++]))
+            return false;
+    }
+    if (count != 4 && count != 7)
+        return false;
+    material = scene.add_material(Vec3_simd(v[0], v[1], v[2]), v[3], count == 7 ? Vec3_simd(v[4], v[5], v[6]) : Vec3_simd(),
+        texture, texture_scale);
+    return true;
+}
+
+// Material at the end of a shape statement: a name from a `material` statement,
+// or the properties written out in place
+static bool read_material(std::istringstream& line, const MaterialNames& names, const TextureNames& textures,
+    Scene& scene, uint32_t& material) {
+    std::streampos start = line.tellg();
+    std::string name;
+    if (!(line >> name))
+        return false;
+    MaterialNames::const_iterator found = names.find(name);
+    if (found != names.end()) {
+        material = found->second;
+        std::string extra;
+        return !(line >> extra);
+    }
+
+    line.clear();
+    line.seekg(start);
+    return read_material_values(line, textures, scene, material);
+}
+
+// Read exactly `count` floats from the rest of the line
+static bool read_floats(std::istringstream& line, float* values, int count) {
+    return read_float_list(line, values, count) == count;
+}
+
+// Read exactly `count` positive integers from the rest of the line
+static bool read_uints(std::istringstream& line, uint32_t* values, int count) {
+    for (int i = 0; i < count; ++i) {
+        long long parsed;
+        if (!(line >> parsed) || parsed < 1 || parsed > 0xFFFFFFFFll)
+            return false;
+        values[i] = (uint32_t)parsed;
+    }
+    std::string extra;
+    return !(line >> extra);
+}
+
+// Camera placement and optics; false if `keyword` is not a camera statement
+static bool read_camera_statement(const std::string& keyword, std::istringstream& line, CameraSettings& camera, bool& ok) {
+    float v[3];
+    if (keyword == "camera") {
+        ok = read_floats(line, v, 3);
+        if (ok) camera.position = Vec3_simd(v[0], v[1], v[2]);
+    }
+    else if (keyword == "look_at") {
+        ok = read_floats(line, v, 3);
+        if (ok) camera.look_at = Vec3_simd(v[0], v[1], v[2]);
+    }
+    else if (keyword == "up") {
+        ok = read_floats(line, v, 3) && (v[0] != 0.0f || v[1] != 0.0f || v[2] != 0.0f);
+        if (ok) camera.up = norm(Vec3_simd(v[0], v[1], v[2]));
+    }
+    else if (keyword == "fov") {
+        ok = read_floats(line, v, 1) && v[0] > 0.0f && v[0] < 180.0f;
+        if (ok) camera.fov = v[0];
+    }
+    else if (keyword == "aspect") {
+        ok = read_floats(line, v, 1) && v[0] > 0.0f;
+        if (ok) camera.aspect = v[0];
+    }
+    else if (keyword == "lens") {
+        ok = read_floats(line, v, 2) && v[0] >= 0.0f && v[1] >= 0.0f;
+        if (ok) {
+            camera.aperture = v[0];
+            camera.focus_distance = v[1];
+        }
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// A file named in the scene, relative to the scene file's directory unless the path is absolute
+static std::string scene_relative_path(const char* scene_path, const std::string& file) {
+    bool absolute = file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':');
+    std::string scene(scene_path);
+    size_t slash = scene.find_last_of("/\\");
+    if (absolute || slash == std::string::npos)
+        return file;
+    return scene.substr(0, slash + 1) + file;
+}
+
+bool load_scene_file(const char* path, Scene& scene, RenderSettings& settings) {
+    std::ifstream file(path);
+    if (!file) {
+        printf("Nie mozna otworzyc pliku sceny: %s\n", path);
+        return false;
+    }
+
+    MaterialNames material_names;
+    TextureNames texture_names;
+    bool look_at_set = false;
+    std::string text;
+    uint32_t line_number = 0;
+    while (std::getline(file, text)) {
+        line_number++;
+        size_t comment = text.find('#');
+        if (comment != std::string::npos)
+            text.erase(comment);
+
+        std::istringstream line(text);
+        std::string keyword;
+        if (!(line >> keyword))
+            continue; // pusta linia
+
+        bool ok;
+        float v[13];
+        uint32_t u[2];
+        uint32_t material;
+        if (keyword == "resolution") {
+            ok = read_uints(line, u, 2);
+            if (ok) {
+                settings.width = u[0];
+                settings.height = u[1];
+            }
+        }
+        else if (keyword == "samples") ok = read_uints(line, &settings.samples, 1);
+        else if (keyword == "bounces") ok = read_uints(line, &settings.bounces, 1);
+        else if (keyword == "tile_size") ok = read_uints(line, &settings.tile_size, 1);
+        else if (read_camera_statement(keyword, line, scene.camera, ok)) {
+            look_at_set = look_at_set || keyword == "look_at";
+        }
+        else if (keyword == "environment") {
+            std::string file;
+            int count = (line >> file) ? read_float_list(line, v, 1) : -1;
+            ok = count == 0 || (count == 1 && v[0] >= 0.0f);
+            if (ok && !scene.load_environment(scene_relative_path(path, file), count == 1 ? v[0] : 1.0f))
+                return false;
+        }
+        else if (keyword == "texture") {
+            std::string name, file, extra;
+            ok = (line >> name) && (line >> file) && !(line >> extra) && !texture_names.count(name);
+            if (ok) {
+                uint32_t texture = scene.add_texture(scene_relative_path(path, file));
+                if (texture == Material::NO_TEXTURE)
+                    return false;
+                texture_names[name] = texture;
+            }
+        }
+        else if (keyword == "material") {
+            // Names start with a letter, so they can not be mistaken for an inline color
+            std::string name;
+            ok = (line >> name) && (isalpha((unsigned char)name[0]) || name[0] == '_') && !material_names.count(name)
+                && read_material_values(line, texture_names, scene, material);
+            if (ok) material_names[name] = material;
+        }
+        else if (keyword == "plane") {
+            ok = read_leading_floats(line, v, 4) && read_material(line, material_names, texture_names, scene, material);
+            if (ok) scene.add_plane(norm(Vec3_simd(v[0], v[1], v[2])), v[3], material);
+        }
+        else if (keyword == "sphere") {
+            ok = read_leading_floats(line, v, 4) && v[3] > 0.0f && read_material(line, material_names, texture_names, scene, material);
+            if (ok) scene.add_sphere(Vec3_simd(v[0], v[1], v[2]), v[3], material);
+        }
+        else if (keyword == "triangle") {
+            // Optional texture coordinates of the corners before the material
+            ok = read_leading_floats(line, v, 9);
+            TriangleUV uv;
+            bool has_uv = false;
+            std::streampos start = line.tellg();
+            std::string token;
+            if (ok && (line >> token) && token == "uv") {
+                has_uv = true;
+                ok = read_leading_floats(line, &uv.u0, 6);
+            }
+            else {
+                line.clear();
+                line.seekg(start);
+            }
+            ok = ok && read_material(line, material_names, texture_names, scene, material);
+            if (ok) scene.add_triangle(Vec3_simd(v[0], v[1], v[2]), Vec3_simd(v[3], v[4], v[5]), Vec3_simd(v[6], v[7], v[8]),
+                material, has_uv ? &uv : nullptr);
+        }
+        else if (keyword == "point_light") {
+            ok = read_floats(line, v, 6);
+            if (ok) scene.add_point_light(Vec3_simd(v[0], v[1], v[2]), Vec3_simd(v[3], v[4], v[5]));
+        }
+        else if (keyword == "directional_light") {
+            ok = read_floats(line, v, 6) && (v[0] != 0.0f || v[1] != 0.0f || v[2] != 0.0f);
+            if (ok) scene.add_directional_light(Vec3_simd(v[0], v[1], v[2]), Vec3_simd(v[3], v[4], v[5]));
+        }
+        else {
+            printf("%s:%u: nieznane polecenie '%s'\n", path, line_number, keyword.c_str());
+            return false;
+        }
+
+        if (!ok) {
+            printf("%s:%u: bledne wartosci dla '%s'\n", path, line_number, keyword.c_str());
+            return false;
+        }
+    }
+
+    // Without look_at the camera looks along +z, as it always has
+    if (!look_at_set)
+        scene.camera.look_at = add(scene.camera.position, Vec3_simd(0.0f, 0.0f, 1.0f));
+    Vec3_simd view = sub(scene.camera.look_at, scene.camera.position);
+    if (dot(view, view) == 0.0f) {
+        printf("%s: look_at pokrywa sie z pozycja kamery\n", path);
+        return false;
+    }
+    return true;
+}
+
+void build_default_scene(Scene& scene) {
+    // Add plane
+    scene.add_plane(
+        Vec3_simd(0.0f, 1.0f, 0.0f),    // normal
+        -1.0f,                          // distance
+        scene.add_material(Vec3_simd(0.8f, 0.8f, 0.8f), 0.9f)   // color, roughness
+    );
+
+    // Add spheres
+    scene.add_sphere(
+        Vec3_simd(-2.0f, 0.0f, 0.0f),   // position
+        1.0f,                           // radius
+        scene.add_material(Vec3_simd(1.0f, 0.5f, 0.8f), 0.04f)  // color, roughness
+    );
+
+    scene.add_sphere(Vec3_simd(0.0f, 0.0f, 0.0f), 1.0f, scene.add_material(Vec3_simd(0.6f, 0.9f, 0.6f), 0.3f));
+
+    scene.add_sphere(Vec3_simd(2.0f, 0.0f, 0.0f), 1.0f, scene.add_material(Vec3_simd(0.8f, 0.4f, 0.8f), 0.9f));
+}
+
+bool apply_camera_statements(const std::string& text, CameraSettings& camera) {
+    CameraSettings edited = camera;
+    std::istringstream lines(text);
+    std::string statement;
+    while (std::getline(lines, statement)) {
+        std::istringstream line(statement);
+        std::string keyword;
+        if (!(line >> keyword))
+            continue;
+        bool ok;
+        if (!read_camera_statement(keyword, line, edited, ok) || !ok)
+            return false;
+    }
+    Vec3_simd view = sub(edited.look_at, edited.position);
+    if (dot(view, view) == 0.0f)
+        return false;
+    camera = edited;
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "objects.h"
+#include "settings.h"
+
+// Text scene description, one statement per line, '#' starts a comment:
+//
+//   resolution <width> <height>
+//   samples <n>
+//   bounces <n>
+//   tile_size <n>
+//   camera <x> <y> <z>
+//   look_at <x> <y> <z>                  (default: straight ahead along +z)
+//   up <x> <y> <z>                       (default: 0 -1 0, world +y points down the image)
+//   fov <vertical degrees>               (default: 90)
+//   aspect <width / height>              (default: from the resolution)
+//   lens <radius> <focus distance>       (depth of field; focus distance 0 = distance to look_at)
+//   environment <file.hdr> [<scale>]     (equirectangular HDR light, replaces the sky gradient)
+//   texture <name> <file>                (binary PPM or .tiles, see texture.h)
+//   material <name> <r> <g> <b> <roughness> [<emission r> <g> <b>] [texture <name> [<scale>]]
+//   plane <nx> <ny> <nz> <distance> <material>
+//   sphere <x> <y> <z> <radius> <material>
+//   triangle <x0> <y0> <z0> <x1> <y1> <z1> <x2> <y2> <z2> [uv <u0> <v0> <u1> <v1> <u2> <v2>] <material>
+//   point_light <x> <y> <z> <intensity r> <g> <b>
+//   directional_light <dx> <dy> <dz> <irradiance r> <g> <b>     (direction the light travels in)
+//
+// where <material> is either the name of an earlier `material` statement or the material
+// written out in place, <r> <g> <b> <roughness> [<emission r> <g> <b>] [texture ...]. Shapes with the
+// same properties share one material either way. Emissive spheres are sampled as lights.
+// A texture multiplies the material color and repeats <scale> times per texture coordinate
+// unit: one world unit on planes, once around spheres, over the `uv` coordinates of triangles
+// (the barycentric coordinates without them).
+//
+// Render settings found in the file are written to `settings`, shapes are added to `scene`.
+bool load_scene_file(const char* path, Scene& scene, RenderSettings& settings);
+
+// Camera statements of a scene file (camera, look_at, up, fov, aspect, lens), one per line,
+// applied to `camera`. False, leaving `camera` as it was, if a line is anything else or malformed.
+bool apply_camera_statements(const std::string& text, CameraSettings& camera);
+
+// The scene the program has always rendered: a floor and three spheres
+void build_default_scene(Scene& scene);
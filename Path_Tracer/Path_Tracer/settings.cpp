@@ -0,0 +1,231 @@
+#include "settings.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+static bool parse_uint(const char* text, uint32_t min_value, uint32_t& value) {
+    char* end = nullptr;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || parsed < min_value || parsed > 0xFFFFFFFFul)
+        return false;
+    value = (uint32_t)parsed;
+    return true;
+}
+
+// Comma-separated list, e.g. "1,16,256"
+static bool parse_uint_list(const char* text, uint32_t min_value, std::vector<uint32_t>& values) {
+    std::vector<uint32_t> parsed;
+    std::string list = text;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        uint32_t value = 0;
+        if (!parse_uint(list.substr(start, end - start).c_str(), min_value, value))
+            return false;
+        parsed.push_back(value);
+        start = end + 1;
+    }
+    values.swap(parsed);
+    return true;
+}
+
+static bool parse_float(const char* text, float& value) {
+    char* end = nullptr;
+    float parsed = strtof(text, &end);
+    if (end == text || *end != '\0' || !(parsed > 0.0f))
+        return false;
+    value = parsed;
+    return true;
+}
+
+// Quality presets of the interactive menu: 1 - high, 2 - low
+static void apply_quality(RenderSettings& settings, int quality) {
+    settings.bounces = 10 / quality;
+    settings.samples = quality == 1 ? 1000 : 10;
+}
+
+bool parse_arguments(int argc, const char* argv[], RenderSettings& settings) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = true;
+
+        // flags without a value
+        if (strcmp(arg, "--progress") == 0) { settings.progress = true; continue; }
+        if (strcmp(arg, "--blur") == 0) { settings.gaussian = true; continue; }
+        if (strcmp(arg, "--no-scene-cache") == 0) { settings.scene_cache = false; continue; }
+        if (strcmp(arg, "--hash") == 0) { settings.print_hash = true; continue; }
+        if (strcmp(arg, "--generic-kernel") == 0) { settings.generic_kernel = true; continue; }
+        if (strcmp(arg, "--fast-math") == 0) { settings.fast_math = true; continue; }
+        if (strcmp(arg, "--bench-accuracy") == 0) { settings.bench_accuracy = true; continue; }
+        if (strcmp(arg, "--bench-kernels") == 0) { settings.bench_kernels = true; continue; }
+        if (strcmp(arg, "--bench") == 0) { settings.bench_render = true; continue; }
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+        if (strcmp(arg, "--merge") == 0) {
+            // every following argument up to the next flag is a partial render
+            settings.merge_paths.clear();
+            while (i + 1 < argc && argv[i + 1][0] != '-')
+                settings.merge_paths.push_back(argv[++i]);
+            if (settings.merge_paths.empty()) {
+                printf("Brak plikow dla argumentu %s\n", arg);
+                return false;
+            }
+            continue;
+        }
+
+        if (!value) {
+            printf("Brak wartosci lub nieznany argument: %s\n", arg);
+            return false;
+        }
+
+        if (strcmp(arg, "--scene") == 0) settings.scene_path = value;
+        else if (strcmp(arg, "--scene-cache") == 0) settings.scene_cache_path = value;
+        else if (strcmp(arg, "--output") == 0 || strcmp(arg, "-o") == 0) settings.output_path = value;
+        else if (strcmp(arg, "--width") == 0) ok = parse_uint(value, 1, settings.width);
+        else if (strcmp(arg, "--height") == 0) ok = parse_uint(value, 1, settings.height);
+        else if (strcmp(arg, "--samples") == 0) ok = parse_uint(value, 1, settings.samples);
+        else if (strcmp(arg, "--bounces") == 0) ok = parse_uint(value, 1, settings.bounces);
+        else if (strcmp(arg, "--texture-cache") == 0) ok = parse_uint(value, 1, settings.texture_cache_mb);
+        else if (strcmp(arg, "--tile-size") == 0) ok = parse_uint(value, 1, settings.tile_size);
+        else if (strcmp(arg, "--threads") == 0) ok = parse_uint(value, 0, settings.threads);
+        else if (strcmp(arg, "--blur-radius") == 0) {
+            uint32_t radius = 0;
+            ok = parse_uint(value, 1, radius);
+            settings.blur_radius = (int)radius;
+        }
+        else if (strcmp(arg, "--blur-sigma") == 0) ok = parse_float(value, settings.blur_sigma);
+        else if (strcmp(arg, "--quality") == 0) {
+            ok = strcmp(value, "high") == 0 || strcmp(value, "low") == 0;
+            if (ok) apply_quality(settings, strcmp(value, "high") == 0 ? 1 : 2);
+        }
+        else if (strcmp(arg, "--seed") == 0) {
+            char* end = nullptr;
+            settings.seed = strtoull(value, &end, 10);
+            settings.seed_set = true;
+            ok = end != value && *end == '\0';
+        }
+        else if (strcmp(arg, "--stats") == 0) settings.stats_path = value;
+        else if (strcmp(arg, "--trace") == 0) settings.trace_path = value;
+        else if (strcmp(arg, "--pin") == 0) {
+            settings.pin = value;
+            ok = settings.pin == "none" || settings.pin == "cores" || settings.pin == "smt";
+        }
+        else if (strcmp(arg, "--cost-map") == 0) {
+            settings.cost_map = value;
+            ok = settings.cost_map == "cycles" || settings.cost_map == "rays";
+        }
+        else if (strcmp(arg, "--checkpoint") == 0) settings.checkpoint_path = value;
+        else if (strcmp(arg, "--resume") == 0) {
+            settings.checkpoint_path = value;
+            settings.resume = true;
+        }
+        else if (strcmp(arg, "--incremental") == 0) {
+            settings.checkpoint_path = value;
+            settings.incremental = true;
+        }
+        else if (strcmp(arg, "--checkpoint-interval") == 0) ok = parse_uint(value, 1, settings.checkpoint_interval);
+        else if (strcmp(arg, "--coordinator") == 0) settings.coordinator_address = value;
+        else if (strcmp(arg, "--worker") == 0) settings.worker_address = value;
+        else if (strcmp(arg, "--preview") == 0) settings.preview_address = value;
+        else if (strcmp(arg, "--local-workers") == 0) ok = parse_uint(value, 1, settings.local_workers);
+        else if (strcmp(arg, "--worker-timeout") == 0) ok = parse_uint(value, 1, settings.worker_timeout);
+        else if (strcmp(arg, "--bench-primitives") == 0) ok = parse_uint_list(value, 1, settings.bench_primitives);
+        else if (strcmp(arg, "--bench-hit-ratio") == 0) {
+            char* end = nullptr;
+            settings.bench_hit_ratio = strtof(value, &end);
+            ok = end != value && *end == '\0' && settings.bench_hit_ratio >= 0.0f && settings.bench_hit_ratio <= 1.0f;
+        }
+        else if (strcmp(arg, "--split") == 0) {
+            // "i/N": part i (1..N) of N
+            unsigned part = 0, parts = 0;
+            char tail = 0;
+            ok = sscanf(value, "%u/%u%c", &part, &parts, &tail) == 2 && parts >= 1 && part >= 1 && part <= parts;
+            if (ok) {
+                settings.split_index = part - 1;
+                settings.split_count = parts;
+            }
+        }
+        else {
+            printf("Nieznany argument: %s\n", arg);
+            return false;
+        }
+
+        if (!ok) {
+            printf("Bledna wartosc dla argumentu %s: %s\n", arg, value);
+            return false;
+        }
+        ++i; // pominiecie wartosci
+    }
+    return true;
+}
+
+void print_usage() {
+    printf("Uzycie: Path_Tracer [opcje]\n");
+    printf("Bez argumentow program uruchamia menu interaktywne.\n\n");
+    printf("  --scene <plik>              plik z opisem sceny (domyslnie wbudowana scena)\n");
+    printf("  --scene-cache <plik>        binarna kopia sceny (domyslnie <scena>.cache)\n");
+    printf("  --no-scene-cache            bez binarnej kopii sceny\n");
+    printf("  --texture-cache <MB>        pamiec na fragmenty tekstur (domyslnie 256)\n");
+    printf("  --output, -o <plik>         plik wynikowy PNG (domyslnie render.png)\n");
+    printf("  --width <n> --height <n>    rozdzielczosc obrazu\n");
+    printf("  --samples <n>               probki na piksel\n");
+    printf("  --bounces <n>               maksymalna liczba odbic\n");
+    printf("  --quality high|low          gotowe ustawienia probek i odbic\n");
+    printf("  --tile-size <n>             rozmiar fragmentu obrazu w pikselach\n");
+    printf("  --threads <n>               liczba watkow (0 = wszystkie)\n");
+    printf("  --pin none|cores|smt        przypisanie watkow do rdzeni (cores: najpierw osobne rdzenie, smt: oba watki rdzenia);\n");
+    printf("                              na maszynach NUMA fragmenty i kopia sceny w pamieci wezla watku\n");
+    printf("  --generic-kernel            jeden ogolny kernel zamiast skompilowanego dla obiektow sceny (porownanie szybkosci)\n");
+    printf("  --fast-math                 przyblizone pierwiastki, dzielenia i sinusy (szybciej, obraz minimalnie inny)\n");
+    printf("  --seed <n>                  ziarno generatora liczb losowych\n");
+    printf("  --progress                  wyswietlanie postepu\n");
+    printf("  --stats <plik>              liczniki promieni, testow i odbic na watek i fragment (.json lub .csv, wymaga PT_STATS)\n");
+    printf("  --cost-map cycles|rays      mapa kosztu pikseli zapisywana jako <obraz>_cost.png\n");
+    printf("  --trace <plik.json>         os czasu fragmentow i etapow na watek (chrome://tracing, Perfetto)\n");
+    printf("  --hash                      wypisanie skrotu wyrenderowanych danych (porownywanie renderow)\n");
+    printf("  --blur                      filtr Gaussa po wyrenderowaniu\n");
+    printf("  --blur-radius <n>           promien filtru (domyslnie 3)\n");
+    printf("  --blur-sigma <f>            sigma filtru (domyslnie 1.0)\n");
+    printf("  --checkpoint <plik>         zapisywanie postepu do pliku\n");
+    printf("  --resume <plik>             wznowienie przerwanego renderowania\n");
+    printf("  --incremental <plik>        po zmianie sceny renderowanie tylko zmienionych pikseli (checkpoint i <plik>.gbuf)\n");
+    printf("  --checkpoint-interval <s>   co ile sekund zapisywac checkpoint (domyslnie 60)\n");
+    printf("  --coordinator <adres>       rozdzielanie fragmentow miedzy workery (<port>, <host>:<port> lub unix:<sciezka>)\n");
+    printf("  --local-workers <n>         koordynator uruchamia n workerow na tej maszynie\n");
+    printf("  --worker-timeout <s>        po ilu sekundach bez odpowiedzi worker jest uznany za utracony (domyslnie 600)\n");
+    printf("  --worker <adres>            renderowanie fragmentow dla koordynatora\n");
+    printf("  --preview <port>            podglad zbieznosci w przegladarce (http://127.0.0.1:<port>/), zmiany kamery i materialow\n");
+    printf("                              restartuja akumulacje; <host>:<port> udostepnia podglad w sieci\n");
+    printf("  --split <i>/<N>             renderowanie czesci i z N (probki dzielone miedzy N niezaleznych zadan)\n");
+    printf("  --merge <plik>...           polaczenie czesci zapisanych przez --split --checkpoint w jeden obraz\n");
+    printf("  --bench                     benchmark renderowania wbudowanych scen (promienie/s, skalowanie, zbieznosc)\n");
+    printf("  --bench-accuracy            bledy --fast-math: maksymalny blad w ULP funkcji i RMSE obrazu wzgledem dokladnych obliczen\n");
+    printf("  --bench-kernels             mikrobenchmarki operacji wektorowych i intersekcji (bez renderowania)\n");
+    printf("  --bench-primitives <n,...>  liczby sfer w benchmarku intersekcji sceny (domyslnie 1,16,256,4096)\n");
+    printf("  --bench-hit-ratio <f>       czesc promieni trafiajacych w obiekt, 0..1 (domyslnie 0.5)\n");
+}
+
+void ask_settings(RenderSettings& settings) {
+    printf("PATH TRACER\n");
+    printf("Ten program generuje obraz w 3D za pomoca Path Tracingu\n");
+    printf("\n\nOpcje:\n");
+    printf("Renderowana jakosc obrazu (1- wysoka, 2 - niska): ");
+    int quality = 1; std::cin >> quality;
+    while (quality != 1 && quality != 2) {
+        printf("Wpisana wartosc jest bledna:\n");
+        printf("Renderowana jakosc obrazu (1- wysoka, 2 - niska): ");
+        std::cin >> quality;
+    }
+    apply_quality(settings, quality);
+
+    printf("\nUWAGA: Wyswietlenie postepu spowolni dzialanie algorytmu renderowania\n");
+    printf("Czy wyswietlac postep path tracera (1- tak, 0- nie): ");
+    std::cin >> settings.progress;
+    printf("\nUWAGA: Wybranie rozmycia obrazu wydluzy dzialanie programu\n");
+    printf("Czy rozmyc obraz po wyrenderowaniu (1- tak, 0- nie): ");
+    std::cin >> settings.gaussian;
+    printf("\n");
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Render settings, filled from the scene file and then overridden by command-line flags
+struct RenderSettings {
+    uint32_t width = 1024;
+    uint32_t height = 768;
+    uint32_t samples = 1000;
+    uint32_t bounces = 10;
+    uint32_t tile_size = 64;
+    uint32_t batch_size = 1;
+    uint32_t threads = 0;               // 0 = all hardware threads
+    std::string pin = "none";           // "cores" or "smt": pin render threads, node-local tiles and scene copies
+    bool generic_kernel = false;        // render with the kernel for every scene feature instead of one specialized for the scene
+    bool fast_math = false;             // approximate square roots, divisions and sines in the render kernels
+    uint64_t seed = 0;
+    bool seed_set = false;              // otherwise seeded from the clock
+
+    bool progress = false;              // print progress while rendering
+    bool print_hash = false;            // print a hash of the accumulated image (comparing renders)
+    std::string cost_map;               // "cycles" or "rays": also write <output>_cost.png
+    std::string trace_path;             // Chrome trace of tiles and processing stages
+    std::string stats_path;             // hot-path counters (.json or .csv), needs a PT_STATS build
+    bool gaussian = false;              // blur the image after rendering
+    int blur_radius = 3;
+    float blur_sigma = 1.0f;
+
+    std::string scene_path;             // empty = built-in scene
+    std::string scene_cache_path;       // empty = <scene_path>.cache
+    bool scene_cache = true;            // use the binary scene cache
+    uint32_t texture_cache_mb = 256;    // memory for texture tiles shared by all textures
+    std::string output_path = "render.png";
+    std::string checkpoint_path;        // empty = no checkpointing
+    bool resume = false;
+    bool incremental = false;           // re-render only what scene edits changed (checkpoint + G-buffer)
+    uint32_t checkpoint_interval = 60;  // seconds between checkpoint flushes
+
+    std::string coordinator_address;    // hand out tiles to workers ("<port>", "<host>:<port>" or "unix:<path>")
+    std::string worker_address;         // render tiles for this coordinator
+    uint32_t local_workers = 0;         // worker processes started by the coordinator on this machine
+    uint32_t worker_timeout = 600;      // seconds without an answer before a worker is considered lost
+
+    std::string preview_address;        // serve a progressive preview over HTTP ("<port>" = 127.0.0.1:<port>, or "<host>:<port>")
+
+    uint32_t split_index = 0;           // render only this part of the samples (--split i/N, stored 0-based)
+    uint32_t split_count = 1;
+    std::vector<std::string> merge_paths; // partial renders to combine instead of rendering
+
+    bool bench_kernels = false;         // run the kernel microbenchmarks instead of rendering
+    bool bench_render = false;          // run the whole-render benchmark instead of rendering
+    bool bench_accuracy = false;        // measure the error of --fast-math instead of rendering
+    std::vector<uint32_t> bench_primitives = { 1, 16, 256, 4096 }; // sphere counts of the scene intersect benchmark
+    float bench_hit_ratio = 0.5f;       // fraction of benchmark rays aimed at a primitive
+};
+
+// Apply command-line flags on top of `settings`. Returns false on an unknown flag or a bad value.
+bool parse_arguments(int argc, const char* argv[], RenderSettings& settings);
+void print_usage();
+
+// Interactive menu on stdin, used when the program is started without arguments
+void ask_settings(RenderSettings& settings);
@@ -0,0 +1,135 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#ifdef PT_STATS
+thread_local RenderStats thread_stats;
+#endif
+
+namespace {
+
+struct TileRecord {
+    uint32_t x0, y0, x1, y1;
+    uint32_t thread;
+    RenderStats counters;
+};
+
+std::mutex records_mutex;
+std::vector<TileRecord> records;        // one per rendered tile, appended once per tile
+std::atomic<uint32_t> next_thread_id(0);
+#ifdef PT_STATS
+thread_local uint32_t thread_id = 0xFFFFFFFFu;
+#endif
+
+void accumulate(RenderStats& total, const RenderStats& counters) {
+#define PT_STAT_ADD(name) total.name += counters.name;
+    PT_STAT_COUNTERS(PT_STAT_ADD)
+#undef PT_STAT_ADD
+}
+
+void write_json_counters(FILE* file, const RenderStats& counters) {
+    const char* separator = "";
+#define PT_STAT_JSON(name) fprintf(file, "%s\"" #name "\": %llu", separator, (unsigned long long)counters.name); separator = ", ";
+    PT_STAT_COUNTERS(PT_STAT_JSON)
+#undef PT_STAT_JSON
+}
+
+void write_csv_row(FILE* file, const char* scope, long long thread, const TileRecord* tile, const RenderStats& counters) {
+    fprintf(file, "%s,", scope);
+    if (thread >= 0) fprintf(file, "%lld", thread);
+    if (tile) fprintf(file, ",%u,%u,%u,%u", tile->x0, tile->y0, tile->x1, tile->y1);
+    else fprintf(file, ",,,,");
+#define PT_STAT_CSV(name) fprintf(file, ",%llu", (unsigned long long)counters.name);
+    PT_STAT_COUNTERS(PT_STAT_CSV)
+#undef PT_STAT_CSV
+    fprintf(file, "\n");
+}
+
+} // namespace
+
+bool stats_enabled() {
+#ifdef PT_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+RenderStats stats_snapshot() {
+#ifdef PT_STATS
+    return thread_stats;
+#else
+    return RenderStats();
+#endif
+}
+
+void stats_record_tile(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, const RenderStats& before) {
+#ifdef PT_STATS
+    if (thread_id == 0xFFFFFFFFu)
+        thread_id = next_thread_id++;
+
+    TileRecord record = { x0, y0, x1, y1, thread_id, RenderStats() };
+#define PT_STAT_DIFF(name) record.counters.name = thread_stats.name - before.name;
+    PT_STAT_COUNTERS(PT_STAT_DIFF)
+#undef PT_STAT_DIFF
+
+    std::lock_guard<std::mutex> lock(records_mutex);
+    records.push_back(record);
+#else
+    (void)x0; (void)y0; (void)x1; (void)y1; (void)before;
+#endif
+}
+
+bool stats_write(const char* path) {
+    std::lock_guard<std::mutex> lock(records_mutex);
+
+    RenderStats totals;
+    std::vector<RenderStats> threads(next_thread_id.load());
+    for (const TileRecord& record : records) {
+        accumulate(totals, record.counters);
+        accumulate(threads[record.thread], record.counters);
+    }
+
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".csv") == 0) {
+        fprintf(file, "scope,thread,x0,y0,x1,y1");
+#define PT_STAT_HEADER(name) fprintf(file, "," #name);
+        PT_STAT_COUNTERS(PT_STAT_HEADER)
+#undef PT_STAT_HEADER
+        fprintf(file, "\n");
+
+        write_csv_row(file, "total", -1, nullptr, totals);
+        for (size_t t = 0; t < threads.size(); ++t)
+            write_csv_row(file, "thread", (long long)t, nullptr, threads[t]);
+        for (const TileRecord& record : records)
+            write_csv_row(file, "tile", record.thread, &record, record.counters);
+    }
+    else {
+        fprintf(file, "{\n  \"totals\": { ");
+        write_json_counters(file, totals);
+        fprintf(file, " },\n  \"threads\": [\n");
+        for (size_t t = 0; t < threads.size(); ++t) {
+            fprintf(file, "    { \"thread\": %u, ", (uint32_t)t);
+            write_json_counters(file, threads[t]);
+            fprintf(file, " }%s\n", t + 1 < threads.size() ? "," : "");
+        }
+        fprintf(file, "  ],\n  \"tiles\": [\n");
+        for (size_t i = 0; i < records.size(); ++i) {
+            const TileRecord& record = records[i];
+            fprintf(file, "    { \"x0\": %u, \"y0\": %u, \"x1\": %u, \"y1\": %u, \"thread\": %u, ",
+                record.x0, record.y0, record.x1, record.y1, record.thread);
+            write_json_counters(file, record.counters);
+            fprintf(file, " }%s\n", i + 1 < records.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+    }
+
+    return fclose(file) == 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hot-path counters for sizing hardware and catching performance regressions.
+// Compiled in only when PT_STATS is defined (-DPT_STATS, or /D PT_STATS with MSVC);
+// otherwise PT_STAT() expands to nothing and the render loop is unchanged.
+//
+// Each thread counts into its own thread_local block, so counting needs no atomics.
+// render_tile() attributes what a tile cost to the tile and the thread that rendered it.
+
+// X-macro list of the counters, in the order they are written out
+#define PT_STAT_COUNTERS(X) \
+    X(samples)              /* camera samples started */ \
+    X(rays)                 /* rays traced through the scene */ \
+    X(bounces)              /* rays that hit something and bounced */ \
+    X(escaped_rays)         /* rays that left the scene (background) */ \
+    X(shadow_rays)          /* rays towards lights (next-event estimation) */ \
+    X(primitive_tests)      /* sphere, plane and triangle intersection tests */ \
+    X(bvh_node_visits)      /* BVH nodes taken from the traversal stack */ \
+    X(texture_fetches)      /* texels read through the texture tile cache */ \
+    X(texture_misses)       /* tiles the texture cache had to read from disk */
+
+struct RenderStats {
+#define PT_STAT_FIELD(name) uint64_t name = 0;
+    PT_STAT_COUNTERS(PT_STAT_FIELD)
+#undef PT_STAT_FIELD
+};
+
+#ifdef PT_STATS
+extern thread_local RenderStats thread_stats;
+#define PT_STAT(name) (++thread_stats.name)
+#else
+#define PT_STAT(name) ((void)0)
+#endif
+
+// Whether this build counts anything
+bool stats_enabled();
+
+// Counters of the calling thread, to be passed to stats_record_tile() after the tile
+RenderStats stats_snapshot();
+// Attribute the calling thread's counts since `before` to the tile x0,y0 - x1,y1
+void stats_record_tile(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, const RenderStats& before);
+
+// Write totals, per-thread and per-tile counters; CSV if the path ends in ".csv", JSON otherwise
+bool stats_write(const char* path);
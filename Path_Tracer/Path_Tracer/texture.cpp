@@ -0,0 +1,408 @@
+#include "texture.h"
+#include "scene_cache.h"
+#include "stats.h"
+#include <math.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const char TEXTURE_MAGIC[8] = { 'P', 'T', 'T', 'I', 'L', 'E', 'S', 0 };
+const uint32_t TEXTURE_VERSION = 1;
+const uint32_t TILE_SIZE = 32;                      // texels per tile side
+const uint32_t TILE_TEXELS = TILE_SIZE * TILE_SIZE; // 4 KB of RGBA8, one page
+const uint32_t CACHE_WAYS = 8;
+const uint64_t TILE_DATA_ALIGNMENT = 4096;
+
+struct TextureFileHeader {
+    char magic[8];              // "PTTILES\0"
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_hash;       // FNV-1a of the source image
+    uint32_t level_count;
+    uint32_t tile_size;
+    struct {
+        uint32_t width, height;
+        uint32_t tiles_x, tiles_y;
+        uint64_t first_tile;
+    } levels[Texture::MAX_LEVELS];
+    uint64_t tile_data_offset;  // tiles of all levels follow, TILE_TEXELS * 4 bytes each
+};
+
+int seek(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// Position of texel (x, y) of a tile in Morton order: the bits of x and y interleaved
+inline uint32_t morton(uint32_t x, uint32_t y) {
+    uint32_t index = 0;
+    for (uint32_t bit = 0; bit < 5; ++bit)
+        index |= ((x >> bit) & 1u) << (2 * bit) | ((y >> bit) & 1u) << (2 * bit + 1);
+    return index;
+}
+
+float srgb_to_linear(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+uint8_t linear_to_srgb8(float c) {
+    c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+    float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+    return (uint8_t)(s * 255.0f + 0.5f);
+}
+
+const float* srgb_table() {
+    static const std::vector<float> table = []() {
+        std::vector<float> values(256);
+        for (int i = 0; i < 256; ++i)
+            values[i] = srgb_to_linear(i / 255.0f);
+        return values;
+    }();
+    return table.data();
+}
+
+// Tiles of every texture, shared by all threads. A slot holds one tile; its key says which.
+// Writers (misses) hold the set's lock and make the slot's version odd while the slot
+// changes; readers take no lock and retry through the miss path when the version moved.
+class TileCache {
+public:
+    explicit TileCache(size_t bytes) {
+        size_t slots = bytes / (TILE_TEXELS * sizeof(uint32_t));
+        set_count = (uint32_t)(slots / CACHE_WAYS > 0 ? slots / CACHE_WAYS : 1);
+        slot_state.reset(new Slot[(size_t)set_count * CACHE_WAYS]);
+        texels.reset(new std::atomic<uint32_t>[(size_t)set_count * CACHE_WAYS * TILE_TEXELS]);
+        set_locks.reset(new std::mutex[set_count]);
+    }
+
+    uint32_t texel(const Texture& texture, uint64_t key, uint64_t tile, uint32_t index) {
+        PT_STAT(texture_fetches);
+        uint32_t set = set_of(key);
+        Slot* ways = &slot_state[(size_t)set * CACHE_WAYS];
+        for (uint32_t way = 0; way < CACHE_WAYS; ++way) {
+            Slot& slot = ways[way];
+            if (slot.key.load(std::memory_order_acquire) != key)
+                continue;
+            uint32_t version = slot.version.load(std::memory_order_acquire);
+            if (version & 1)
+                break;  // being replaced
+            uint32_t value = data(set, way)[index].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) != version || slot.key.load(std::memory_order_relaxed) != key)
+                break;
+            touch(slot);
+            return value;
+        }
+        return miss(texture, key, tile, index, set);
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> key{ 0 };         // 0 = empty
+        std::atomic<uint32_t> version{ 0 };     // odd while the slot is rewritten
+        std::atomic<uint32_t> last_used{ 0 };
+    };
+
+    uint32_t set_of(uint64_t key) const {
+        return (uint32_t)(hash_mix(key) % set_count);
+    }
+
+    std::atomic<uint32_t>* data(uint32_t set, uint32_t way) const {
+        return &texels[((size_t)set * CACHE_WAYS + way) * TILE_TEXELS];
+    }
+
+    // Stamp the slot as recently used; written only when the clock moved on, so hits on a
+    // hot tile do not keep writing its cache line
+    void touch(Slot& slot) {
+        uint32_t now = clock.load(std::memory_order_relaxed);
+        if (slot.last_used.load(std::memory_order_relaxed) != now)
+            slot.last_used.store(now, std::memory_order_relaxed);
+    }
+
+    uint32_t miss(const Texture& texture, uint64_t key, uint64_t tile, uint32_t index, uint32_t set) {
+        std::lock_guard<std::mutex> lock(set_locks[set]);
+        Slot* ways = &slot_state[(size_t)set * CACHE_WAYS];
+
+        // Another thread may have loaded it meanwhile; writers hold the lock, so no retries here
+        uint32_t victim = 0;
+        for (uint32_t way = 0; way < CACHE_WAYS; ++way) {
+            if (ways[way].key.load(std::memory_order_relaxed) == key) {
+                touch(ways[way]);
+                return data(set, way)[index].load(std::memory_order_relaxed);
+            }
+            if (ways[way].last_used.load(std::memory_order_relaxed) < ways[victim].last_used.load(std::memory_order_relaxed))
+                victim = way;
+        }
+
+        PT_STAT(texture_misses);
+        uint32_t loaded[TILE_TEXELS];
+        if (!texture.read_tile(tile, loaded))
+            memset(loaded, 0, sizeof(loaded));  // unreadable tile: black rather than a failed render
+
+        Slot& slot = ways[victim];
+        uint32_t version = slot.version.load(std::memory_order_relaxed);
+        slot.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.key.store(key, std::memory_order_relaxed);
+        std::atomic<uint32_t>* target = data(set, victim);
+        for (uint32_t i = 0; i < TILE_TEXELS; ++i)
+            target[i].store(loaded[i], std::memory_order_relaxed);
+        slot.last_used.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        slot.version.store(version + 2, std::memory_order_release);
+        return loaded[index];
+    }
+
+    uint32_t set_count;
+    std::unique_ptr<Slot[]> slot_state;
+    std::unique_ptr<std::atomic<uint32_t>[]> texels;
+    std::unique_ptr<std::mutex[]> set_locks;
+    std::atomic<uint32_t> clock{ 1 };   // advances with every miss
+};
+
+size_t cache_bytes = (size_t)256 << 20;
+std::atomic<uint64_t> next_texture_id(1);
+
+TileCache& tile_cache() {
+    static TileCache cache(cache_bytes);
+    return cache;
+}
+
+// Binary PPM (P6, up to 8 bits per channel) as linear RGB
+bool read_ppm(const char* path, uint32_t& width, uint32_t& height, std::vector<float>& rgb) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    // Header fields are separated by whitespace and may be interleaved with comments
+    char magic[3] = {};
+    uint32_t fields[3];
+    bool ok = fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && magic[1] == '6';
+    for (int i = 0; ok && i < 3; ++i) {
+        int c = fgetc(file);
+        while (c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (c == '#')
+                while (c != '\n' && c != EOF) c = fgetc(file);
+            c = fgetc(file);
+        }
+        ungetc(c, file);
+        ok = fscanf(file, "%u", &fields[i]) == 1;
+    }
+    ok = ok && fgetc(file) != EOF && fields[0] > 0 && fields[1] > 0 && fields[2] > 0 && fields[2] <= 255;
+
+    std::vector<uint8_t> bytes;
+    if (ok) {
+        width = fields[0];
+        height = fields[1];
+        bytes.resize((size_t)width * height * 3);
+        ok = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+
+    rgb.resize(bytes.size());
+    for (size_t i = 0; i < bytes.size(); ++i)
+        rgb[i] = srgb_to_linear(bytes[i] / (float)fields[2]);
+    return true;
+}
+
+// Mip chain of a PPM image written as a tiled texture file
+bool convert_image(const char* image_path, const char* tiled_path, uint64_t source_hash) {
+    uint32_t width, height;
+    std::vector<float> level;
+    if (!read_ppm(image_path, width, height, level))
+        return false;
+
+    TextureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC));
+    header.version = TEXTURE_VERSION;
+    header.header_size = sizeof(TextureFileHeader);
+    header.source_hash = source_hash;
+    header.tile_size = TILE_SIZE;
+    uint64_t tiles = 0;
+    for (uint32_t w = width, h = height; header.level_count < Texture::MAX_LEVELS; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1) {
+        uint32_t l = header.level_count++;
+        header.levels[l].width = w;
+        header.levels[l].height = h;
+        header.levels[l].tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+        header.levels[l].tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+        header.levels[l].first_tile = tiles;
+        tiles += (uint64_t)header.levels[l].tiles_x * header.levels[l].tiles_y;
+        if (w == 1 && h == 1)
+            break;
+    }
+    header.tile_data_offset = (sizeof(header) + TILE_DATA_ALIGNMENT - 1) / TILE_DATA_ALIGNMENT * TILE_DATA_ALIGNMENT;
+
+    // Written to a temporary file first, so a reader never opens a half-written texture
+    std::string temp_path = std::string(tiled_path) + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file)
+        return false;
+    std::vector<uint8_t> padding(header.tile_data_offset - sizeof(header), 0);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+
+    uint32_t tile[TILE_TEXELS];
+    for (uint32_t l = 0; ok && l < header.level_count; ++l) {
+        uint32_t w = header.levels[l].width, h = header.levels[l].height;
+        if (l > 0) {
+            // 2x2 box filter in linear space; odd sizes fold the last row or column in
+            uint32_t pw = header.levels[l - 1].width, ph = header.levels[l - 1].height;
+            std::vector<float> next((size_t)w * h * 3);
+            for (uint32_t y = 0; y < h; ++y) {
+                for (uint32_t x = 0; x < w; ++x) {
+                    uint32_t x0 = 2 * x < pw ? 2 * x : pw - 1, x1 = 2 * x + 1 < pw ? 2 * x + 1 : pw - 1;
+                    uint32_t y0 = 2 * y < ph ? 2 * y : ph - 1, y1 = 2 * y + 1 < ph ? 2 * y + 1 : ph - 1;
+                    for (uint32_t c = 0; c < 3; ++c) {
+                        next[((size_t)y * w + x) * 3 + c] = 0.25f * (
+                            level[((size_t)y0 * pw + x0) * 3 + c] + level[((size_t)y0 * pw + x1) * 3 + c] +
+                            level[((size_t)y1 * pw + x0) * 3 + c] + level[((size_t)y1 * pw + x1) * 3 + c]);
+                    }
+                }
+            }
+            level.swap(next);
+        }
+
+        // Tiles row by row; texels past the edge of the level repeat the edge
+        for (uint32_t ty = 0; ok && ty < header.levels[l].tiles_y; ++ty) {
+            for (uint32_t tx = 0; ok && tx < header.levels[l].tiles_x; ++tx) {
+                for (uint32_t y = 0; y < TILE_SIZE; ++y) {
+                    for (uint32_t x = 0; x < TILE_SIZE; ++x) {
+                        uint32_t sx = tx * TILE_SIZE + x < w ? tx * TILE_SIZE + x : w - 1;
+                        uint32_t sy = ty * TILE_SIZE + y < h ? ty * TILE_SIZE + y : h - 1;
+                        const float* p = &level[((size_t)sy * w + sx) * 3];
+                        tile[morton(x, y)] = linear_to_srgb8(p[0]) | linear_to_srgb8(p[1]) << 8 |
+                            linear_to_srgb8(p[2]) << 16 | 0xFF000000u;
+                    }
+                }
+                ok = fwrite(tile, sizeof(tile), 1, file) == 1;
+            }
+        }
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        return false;
+    remove(tiled_path);
+    return rename(temp_path.c_str(), tiled_path) == 0;
+}
+
+inline bool ends_with(const std::string& text, const char* suffix) {
+    size_t length = strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+} // namespace
+
+void set_texture_cache_size(size_t bytes) {
+    cache_bytes = bytes;
+}
+
+Texture::~Texture() {
+    if (file)
+        fclose(file);
+}
+
+bool Texture::open(const std::string& path) {
+    // An image is used through its tiled copy, rebuilt when the image changes
+    std::string tiled_path = path;
+    uint64_t source_hash = 0;
+    bool from_image = !ends_with(path, ".tiles");
+    if (from_image) {
+        if (!hash_file(path.c_str(), source_hash)) {
+            printf("Nie mozna otworzyc tekstury: %s\n", path.c_str());
+            return false;
+        }
+        tiled_path = path + ".tiles";
+    }
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        file = fopen(tiled_path.c_str(), "rb");
+        TextureFileHeader header;
+        bool valid = file && fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC)) == 0 &&
+            header.version == TEXTURE_VERSION && header.header_size == sizeof(TextureFileHeader) &&
+            header.tile_size == TILE_SIZE && header.level_count > 0 && header.level_count <= MAX_LEVELS &&
+            (!from_image || header.source_hash == source_hash);
+        if (valid) {
+            level_count = header.level_count;
+            for (uint32_t l = 0; l < level_count; ++l) {
+                levels[l].width = header.levels[l].width;
+                levels[l].height = header.levels[l].height;
+                levels[l].tiles_x = header.levels[l].tiles_x;
+                levels[l].tiles_y = header.levels[l].tiles_y;
+                levels[l].first_tile = header.levels[l].first_tile;
+            }
+            tile_data_offset = header.tile_data_offset;
+            key_base = next_texture_id.fetch_add(1) << 40;
+            return true;
+        }
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+        if (!from_image || attempt > 0 || !convert_image(path.c_str(), tiled_path.c_str(), source_hash))
+            break;
+    }
+    printf("Nie mozna wczytac tekstury (obslugiwane: binarny PPM lub plik .tiles): %s\n", path.c_str());
+    return false;
+}
+
+bool Texture::read_tile(uint64_t tile, uint32_t* texels) const {
+    std::lock_guard<std::mutex> lock(file_mutex);
+    return seek(file, tile_data_offset + tile * TILE_TEXELS * sizeof(uint32_t)) == 0 &&
+        fread(texels, sizeof(uint32_t), TILE_TEXELS, file) == TILE_TEXELS;
+}
+
+uint32_t Texture::texel(uint32_t level, uint32_t x, uint32_t y) const {
+    const Level& l = levels[level];
+    uint64_t tile = l.first_tile + (uint64_t)(y / TILE_SIZE) * l.tiles_x + x / TILE_SIZE;
+    return tile_cache().texel(*this, key_base | tile, tile, morton(x % TILE_SIZE, y % TILE_SIZE));
+}
+
+Vec3_simd Texture::bilinear(uint32_t level, float u, float v) const {
+    const Level& l = levels[level];
+    float fx = (u - floorf(u)) * l.width - 0.5f;
+    float fy = (v - floorf(v)) * l.height - 0.5f;
+    float x_floor = floorf(fx);
+    float y_floor = floorf(fy);
+    float tx = fx - x_floor;
+    float ty = fy - y_floor;
+
+    // Repeat across the edges
+    int x0 = (int)x_floor, y0 = (int)y_floor;
+    uint32_t x_lo = x0 < 0 ? l.width - 1 : (uint32_t)x0 % l.width;
+    uint32_t x_hi = (uint32_t)(x0 + 1) % l.width;
+    uint32_t y_lo = y0 < 0 ? l.height - 1 : (uint32_t)y0 % l.height;
+    uint32_t y_hi = (uint32_t)(y0 + 1) % l.height;
+
+    const float* srgb = srgb_table();
+    uint32_t corners[4] = { texel(level, x_lo, y_lo), texel(level, x_hi, y_lo), texel(level, x_lo, y_hi), texel(level, x_hi, y_hi) };
+    float weights[4] = { (1.0f - tx) * (1.0f - ty), tx * (1.0f - ty), (1.0f - tx) * ty, tx * ty };
+    __m128 color = _mm_setzero_ps();
+    for (int i = 0; i < 4; ++i) {
+        uint32_t c = corners[i];
+        __m128 linear = _mm_set_ps(0.0f, srgb[(c >> 16) & 0xFF], srgb[(c >> 8) & 0xFF], srgb[c & 0xFF]);
+        color = _mm_fmadd_ps(linear, _mm_set1_ps(weights[i]), color);
+    }
+    return Vec3_simd(color);
+}
+
+Vec3_simd Texture::sample(float u, float v, float footprint) const {
+    // Level whose texels are about as large as the footprint, blended with the next one
+    float texels_across = footprint * (levels[0].width > levels[0].height ? levels[0].width : levels[0].height);
+    float lod = texels_across > 1.0f ? log2f(texels_across) : 0.0f;
+    if (lod >= (float)(level_count - 1))
+        return bilinear(level_count - 1, u, v);
+    uint32_t level = (uint32_t)lod;
+    float blend = lod - level;
+    Vec3_simd fine = bilinear(level, u, v);
+    if (blend <= 0.0f)
+        return fine;
+    Vec3_simd coarse = bilinear(level + 1, u, v);
+    return add(fine, mul(sub(coarse, fine), blend));
+}
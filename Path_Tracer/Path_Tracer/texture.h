@@ -0,0 +1,63 @@
+#pragma once
+
+#include "vec3_simd.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+
+// Image textures that do not have to fit in memory.
+//
+// A texture lives in a tiled file: every mip level is cut into 32x32 tiles of 8-bit sRGB
+// texels, stored in Morton (Z) order inside the tile so that a filter footprint touches few
+// cache lines. Tiles are read from disk only when a lookup needs them, into one fixed-size
+// cache shared by all textures and render threads. The cache is 8-way set associative with
+// LRU replacement inside each set; lookups that hit take no lock (each slot carries a
+// sequence counter that readers check), only misses lock their set while the tile is read.
+//
+// Source images (binary PPM) are converted to `<image>.tiles` on first use and the tiled
+// file is reused while the image is unchanged, like the scene cache.
+
+// Cache size for all textures; takes effect when the first texture is opened
+void set_texture_cache_size(size_t bytes);
+
+class Texture {
+public:
+    Texture() = default;
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+    ~Texture();
+
+    // A .tiles file, or a PPM image converted to one. Prints the reason and returns false on failure.
+    bool open(const std::string& path);
+
+    uint32_t width() const { return levels[0].width; }
+    uint32_t height() const { return levels[0].height; }
+
+    // Linear RGB at (u, v), repeating outside [0, 1). `footprint` is the size of the area to
+    // average, in the same units as u and v; it picks the mip levels (trilinear filtering).
+    Vec3_simd sample(float u, float v, float footprint) const;
+
+    // Read tile `tile` (counted over all levels) from the file, for the cache
+    bool read_tile(uint64_t tile, uint32_t* texels) const;
+
+    static const uint32_t MAX_LEVELS = 16;
+
+private:
+    struct Level {
+        uint32_t width, height;
+        uint32_t tiles_x, tiles_y;
+        uint64_t first_tile;    // tiles of the levels before this one
+    };
+
+    // 0xAABBGGRR texel through the tile cache
+    uint32_t texel(uint32_t level, uint32_t x, uint32_t y) const;
+    Vec3_simd bilinear(uint32_t level, float u, float v) const;
+
+    Level levels[MAX_LEVELS] = {};
+    uint32_t level_count = 0;
+    uint64_t tile_data_offset = 0;
+    uint64_t key_base = 0;          // unique per opened texture, keys its tiles in the cache
+    FILE* file = nullptr;
+    mutable std::mutex file_mutex;  // misses of several threads share the file position
+};
@@ -0,0 +1,213 @@
+#include "topology.h"
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+
+// Logical CPU ids are group * 64 + bit, the way SetThreadGroupAffinity addresses them
+std::vector<CpuInfo> cpu_topology() {
+    std::vector<CpuInfo> cpus;
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationAll, NULL, &length);
+    std::vector<uint8_t> buffer(length);
+    if (!length || !GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &length))
+        return cpus;
+
+    std::map<uint32_t, uint32_t> core_of, node_of;
+    uint32_t cores = 0;
+    for (DWORD offset = 0; offset < length;) {
+        const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+        if (info->Relationship == RelationProcessorCore) {
+            for (WORD g = 0; g < info->Processor.GroupCount; ++g) {
+                const GROUP_AFFINITY& group = info->Processor.GroupMask[g];
+                for (uint32_t bit = 0; bit < 64; ++bit) {
+                    if (group.Mask & ((KAFFINITY)1 << bit))
+                        core_of[group.Group * 64u + bit] = cores;
+                }
+            }
+            cores++;
+        }
+        else if (info->Relationship == RelationNumaNode) {
+            const GROUP_AFFINITY& group = info->NumaNode.GroupMask;
+            for (uint32_t bit = 0; bit < 64; ++bit) {
+                if (group.Mask & ((KAFFINITY)1 << bit))
+                    node_of[group.Group * 64u + bit] = info->NumaNode.NodeNumber;
+            }
+        }
+        offset += info->Size;
+    }
+
+    for (const std::pair<const uint32_t, uint32_t>& entry : core_of) {
+        CpuInfo cpu;
+        cpu.id = entry.first;
+        cpu.core = entry.second;
+        cpu.node = node_of.count(entry.first) ? node_of[entry.first] : 0;
+        cpu.smt_index = 0;
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static bool set_affinity(const std::vector<uint32_t>& ids) {
+    // A thread runs in one processor group, the group of the first CPU
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = (WORD)(ids[0] / 64);
+    for (uint32_t id : ids) {
+        if (id / 64 == affinity.Group)
+            affinity.Mask |= (KAFFINITY)1 << (id % 64);
+    }
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != 0;
+}
+
+#else
+
+static bool read_number(const std::string& path, uint32_t& value) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    bool ok = fscanf(file, "%u", &value) == 1;
+    fclose(file);
+    return ok;
+}
+
+// The cpuN directory in sysfs has a nodeM link for the node of the CPU
+static uint32_t cpu_node(uint32_t id) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+    DIR* dir = opendir(path.c_str());
+    if (!dir)
+        return 0;
+    uint32_t node = 0;
+    while (dirent* entry = readdir(dir)) {
+        if (sscanf(entry->d_name, "node%u", &node) == 1)
+            break;
+    }
+    closedir(dir);
+    return node;
+}
+
+std::vector<CpuInfo> cpu_topology() {
+    std::vector<CpuInfo> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return cpus;
+
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> core_ids;    // (package, core in package) -> core
+    for (uint32_t id = 0; id < CPU_SETSIZE; ++id) {
+        if (!CPU_ISSET(id, &allowed))
+            continue;
+        std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+        uint32_t package = 0, core = id;
+        read_number(topology + "physical_package_id", package);
+        read_number(topology + "core_id", core);
+        std::pair<uint32_t, uint32_t> key(package, core);
+        if (!core_ids.count(key)) {
+            uint32_t next = (uint32_t)core_ids.size();
+            core_ids[key] = next;
+        }
+
+        CpuInfo cpu;
+        cpu.id = id;
+        cpu.core = core_ids[key];
+        cpu.node = cpu_node(id);
+        cpu.smt_index = 0;
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static bool set_affinity(const std::vector<uint32_t>& ids) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint32_t id : ids)
+        CPU_SET(id, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#endif
+
+PinPolicy pin_policy(const std::string& name) {
+    if (name == "cores")
+        return PIN_CORES;
+    if (name == "smt")
+        return PIN_SMT;
+    return PIN_NONE;
+}
+
+ThreadPlacement::ThreadPlacement(PinPolicy policy, uint32_t threads) {
+    if (policy == PIN_NONE)
+        return;
+    std::vector<CpuInfo> cpus = cpu_topology();
+    if (cpus.empty())
+        return;
+
+    // Number nodes without gaps and count the hardware threads of every core
+    std::map<uint32_t, uint32_t> node_numbers;
+    std::map<uint32_t, uint32_t> threads_in_core;
+    for (CpuInfo& cpu : cpus) {
+        if (!node_numbers.count(cpu.node)) {
+            uint32_t next = (uint32_t)node_numbers.size();
+            node_numbers[cpu.node] = next;
+        }
+        cpu.node = node_numbers[cpu.node];
+        cpu.smt_index = threads_in_core[cpu.core]++;
+    }
+
+    std::vector<std::vector<CpuInfo>> per_node(node_numbers.size());
+    for (const CpuInfo& cpu : cpus)
+        per_node[cpu.node].push_back(cpu);
+    for (std::vector<CpuInfo>& node : per_node) {
+        std::sort(node.begin(), node.end(), [policy](const CpuInfo& a, const CpuInfo& b) {
+            if (policy == PIN_CORES && a.smt_index != b.smt_index)
+                return a.smt_index < b.smt_index;
+            if (a.core != b.core)
+                return a.core < b.core;
+            return a.smt_index < b.smt_index;
+        });
+    }
+
+    // Threads alternate between nodes, so a partial thread count still uses every socket's
+    // memory bandwidth
+    for (size_t i = 0; order.size() < cpus.size(); ++i) {
+        for (const std::vector<CpuInfo>& node : per_node) {
+            if (i < node.size())
+                order.push_back(node[i]);
+        }
+    }
+    uint32_t used = std::min(threads, (uint32_t)order.size());
+    nodes = std::min(used, (uint32_t)per_node.size());
+    if (nodes == 0)
+        nodes = 1;
+}
+
+uint32_t ThreadPlacement::thread_node(uint32_t thread) const {
+    return order.empty() ? 0 : order[thread % order.size()].node;
+}
+
+bool ThreadPlacement::pin(uint32_t thread) const {
+    if (order.empty())
+        return true;
+    return set_affinity(std::vector<uint32_t>(1, order[thread % order.size()].id));
+}
+
+bool ThreadPlacement::pin_to_node(uint32_t node) const {
+    std::vector<uint32_t> ids;
+    for (const CpuInfo& cpu : order) {
+        if (cpu.node == node)
+            ids.push_back(cpu.id);
+    }
+    return ids.empty() || set_affinity(ids);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Where render threads run: which logical CPU each thread is pinned to and on which NUMA node
+// that CPU sits. Without pinning threads move freely and everything is treated as one node.
+enum PinPolicy {
+    PIN_NONE,   // leave placement to the OS
+    PIN_CORES,  // one thread per physical core first, SMT siblings only once every core has one
+    PIN_SMT     // fill both hardware threads of a core before moving to the next core
+};
+
+// "none", "cores" or "smt" (the --pin flag)
+PinPolicy pin_policy(const std::string& name);
+
+struct CpuInfo {
+    uint32_t id;            // logical CPU number used by the OS
+    uint32_t core;          // physical core, unique across packages
+    uint32_t node;          // NUMA node as numbered by the OS (ThreadPlacement renumbers them from 0)
+    uint32_t smt_index;     // position among the hardware threads of its core
+};
+
+// Logical CPUs this process may run on (its affinity mask), with their cores and nodes
+std::vector<CpuInfo> cpu_topology();
+
+class ThreadPlacement {
+public:
+    ThreadPlacement(PinPolicy policy, uint32_t threads);
+
+    bool pinned() const { return !order.empty(); }
+    uint32_t node_count() const { return nodes; }
+    // Node thread `thread` runs on, 0 without pinning
+    uint32_t thread_node(uint32_t thread) const;
+    // Pin the calling thread, which is render thread `thread`. False if the OS refused.
+    bool pin(uint32_t thread) const;
+    // Pin the calling thread to some CPU of `node`, for work that prepares that node's memory
+    bool pin_to_node(uint32_t node) const;
+
+private:
+    std::vector<CpuInfo> order;     // CPU of thread t is order[t % size], empty = not pinned
+    uint32_t nodes = 1;
+};
@@ -0,0 +1,111 @@
+#include "trace.h"
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start;     // nanoseconds since trace_start()
+    uint64_t end;
+    int32_t x, y;
+};
+
+struct ThreadBuffer {
+    uint32_t tid;
+    std::string name;
+    std::vector<TraceEvent> events;     // appended only by the owning thread
+};
+
+std::atomic<bool> enabled(false);
+std::chrono::steady_clock::time_point origin;
+
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+thread_local ThreadBuffer* local_buffer = nullptr;
+
+uint64_t now() {
+    // Never 0, which marks a scope started while tracing was off
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count() + 1;
+}
+
+ThreadBuffer& thread_buffer() {
+    if (!local_buffer) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffers.emplace_back(new ThreadBuffer());
+        local_buffer = buffers.back().get();
+        local_buffer->tid = (uint32_t)buffers.size();
+        local_buffer->events.reserve(1024);
+    }
+    return *local_buffer;
+}
+
+void write_escaped(FILE* file, const char* text) {
+    for (; *text; ++text) {
+        if (*text == '"' || *text == '\\')
+            fputc('\\', file);
+        fputc(*text, file);
+    }
+}
+
+} // namespace
+
+void trace_start() {
+    origin = std::chrono::steady_clock::now();
+    enabled = true;
+}
+
+bool trace_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void trace_thread_name(const char* name) {
+    if (trace_enabled())
+        thread_buffer().name = name;
+}
+
+TraceScope::TraceScope(const char* event_name, int32_t event_x, int32_t event_y)
+    : name(event_name), x(event_x), y(event_y), start(trace_enabled() ? now() : 0) {}
+
+TraceScope::~TraceScope() {
+    if (!start)
+        return;
+    TraceEvent event = { name, start, now(), x, y };
+    thread_buffer().events.push_back(event);
+}
+
+bool trace_write(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char* separator = "";
+    for (const std::unique_ptr<ThreadBuffer>& buffer : buffers) {
+        if (!buffer->name.empty()) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"", separator, buffer->tid);
+            write_escaped(file, buffer->name.c_str());
+            fprintf(file, "\"}}");
+            separator = ",\n";
+        }
+        for (const TraceEvent& event : buffer->events) {
+            // Complete events, timestamps in microseconds
+            fprintf(file, "%s{\"name\":\"", separator);
+            write_escaped(file, event.name);
+            fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", buffer->tid,
+                event.start * 1e-3, (event.end - event.start) * 1e-3);
+            if (event.x >= 0)
+                fprintf(file, ",\"args\":{\"x\":%d,\"y\":%d}", event.x, event.y);
+            fprintf(file, "}");
+            separator = ",\n";
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
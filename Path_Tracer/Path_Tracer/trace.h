@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timeline of tiles and processing stages per thread, written as a Chrome trace
+// (chrome://tracing, ui.perfetto.dev) to show idle gaps and straggling tiles (--trace).
+//
+// Every thread appends to its own buffer, so recording takes no locks; a thread registers
+// its buffer once, on its first event. Buffers outlive their threads and are written out
+// by trace_write() after all work is done. Recording is off until trace_start().
+
+void trace_start();
+bool trace_enabled();
+
+// Name shown for the calling thread's row
+void trace_thread_name(const char* name);
+
+// Records the time between construction and destruction as one event of the calling thread.
+// `name` must be a string literal (it is stored, not copied). x/y are shown as arguments
+// when not negative, e.g. the tile position.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, int32_t x = -1, int32_t y = -1);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    int32_t x, y;
+    uint64_t start;     // 0 when tracing is off
+};
+
+// Write all recorded events as a JSON trace
+bool trace_write(const char* path);
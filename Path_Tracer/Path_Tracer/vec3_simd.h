@@ -1,6 +1,7 @@
 #pragma once
 
 #include <math.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
 #include <immintrin.h> // For SIMD intrinsics
@@ -129,26 +130,53 @@ inline Vec3_simd saturate(Vec3_simd a) {
     return Vec3_simd(result);
 }
 
-// Random number generation (scalar remains same)
-inline float randf() {
-    return rand() / (RAND_MAX + 1.0f);
+// Counter-based random numbers. Every value is a hash of (seed, pixel, sample, dimension)
+// rather than the next state of a generator, so a sample comes out the same no matter
+// which thread, tile order, machine or split part renders it.
+struct Sampler {
+    uint64_t key;           // render seed mixed with the pixel index
+    uint32_t sample;        // sample index within the pixel
+    uint32_t dimension;     // random numbers already drawn for this sample
+};
+
+// splitmix64 finalizer
+inline uint64_t hash_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+inline Sampler sampler_start(uint64_t seed, uint32_t pixel, uint32_t sample) {
+    Sampler sampler = { hash_mix(seed + (pixel + 1ull) * 0x9E3779B97F4A7C15ull), sample, 0 };
+    return sampler;
+}
+
+inline uint32_t sampler_next(Sampler& sampler) {
+    // The counter is hashed on its own first, so neighbouring keys never give shifted copies of one sequence
+    uint64_t counter = ((uint64_t)sampler.sample << 32) | sampler.dimension++;
+    return (uint32_t)(hash_mix(sampler.key + hash_mix(counter)) >> 32);
+}
+
+// Random float in [0, 1)
+inline float randf(Sampler& sampler) {
+    return (sampler_next(sampler) >> 8) * (1.0f / 16777216.0f);
 }
 
 // SIMD random vector [-1, 1]
-inline Vec3_simd randf3() {
+inline Vec3_simd randf3(Sampler& sampler) {
     alignas(16) float vals[4];
     for (int i = 0; i < 3; ++i) {
-        vals[i] = 2.0f * randf() - 1.0f;
+        vals[i] = 2.0f * randf(sampler) - 1.0f;
     }
     vals[3] = 0.0f;  // unused component
     return Vec3_simd(_mm_load_ps(vals));
 }
 
 // SIMD random point in unit sphere
-inline Vec3_simd rand_in_sphere() {
-    Vec3_simd value = randf3();
+inline Vec3_simd rand_in_sphere(Sampler& sampler) {
+    Vec3_simd value = randf3(sampler);
     while (dot(value, value) > 1.0f) {  // Using squared length check
-        value = randf3();
+        value = randf3(sampler);
     }
     return value;
 }
\ No newline at end of file